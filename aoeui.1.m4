@@ -13,6 +13,10 @@ AOEUI \- a lightweight visual editor optimized for the cmd(Dvorak,QWERTY) keyboa
 .B -k
 ]
 [
+.B -l
+.I milliseconds
+]
+[
 .B -o
 ]
 [
@@ -50,11 +54,27 @@ displays a short command introduction and summary.
 can browse very large read-only files with quick start-up time,
 since the original texts are memory-mapped from files and not
 duplicated in memory unless they are about to be modified.
+.P
+Files compressed with
+.BR gzip ,
+.BR xz ,
+or
+.B zstd
+are recognized and decompressed into the editor in the background
+as they are read.
+Saving such a file recompresses its new content with the same program
+into a new file that then replaces the original.
 .SH OPTIONS
 .TP
 .B -k
 Disable keyword highlighting.
 .TP
+.BI -l " 50"
+While commands are arriving faster than they can be shown, as during
+a paste or when a key is held down, apply them all before updating
+the display, but update it at least this often, in milliseconds.
+Zero updates the display after every command.
+.TP
 .B -o
 Do not save the original contents of a modified file in
 .IR file ~.
@@ -542,10 +562,34 @@ is the default escape sequence in
 The variant version of this command
 .RB ( ^Space^_
 and its synonyms)
-searches for occurrences of POSIX regular expressions.
+searches for occurrences of POSIX extended regular expressions,
+in which
+.B .
+and negated bracket expressions never match a newline, and
+.B ^
+and
+.B $
+match at the beginning and end of any line.
+The GNU extensions
+.BR \ew ,
+.BR \eW ,
+.BR \es ,
+.BR \eS ,
+.BR \eb ,
+.BR \eB ,
+.B \e<
+and
+.B \e>
+are also recognized; back-references are not.
 Each non-command character that is typed thereafter will be appended
 to the current search target string and the selection is moved to the
 next occurrence thereof.
+The other occurrences of the target that are visible in any window
+are highlighted as well.
+All of the occurrences in the view are counted in the background
+while the editor is otherwise idle, and the position of the current
+one among them is then displayed as
+.IR "match k of n" .
 .P
 The case of alphabetic characters is
 .I not
@@ -583,6 +627,103 @@ and its synonyms) simply leaves search mode with the cursor at
 the latest hit, with the mark returned to where it was before the search
 (if anywhere).
 This is useful for using search to place the bounds of a selection.
+.TP
+.B Insert
+leaves search mode after replacing every occurrence of the search
+target in the view with the contents of the clip buffer.
+When the target is a regular expression,
+.B \e1
+through
+.B \e9
+in the clip buffer stand for the text matched by its parenthesized
+groups, and
+.B \e\e
+stands for a single backslash.
+The cursor, the mark, and the other views of the text stay with
+the text around them, across undoing and redoing too.
+All of the replacements are undone together by a single
+.BR ^cmd(U,Z) .
+.P
+Every file can be searched at once, too.
+.TP
+.B ^Space/
+(note that the slash
+.B /
+is not a control character)
+looks for the selection in all of the open texts and in all of
+the files in the tree below the current directory, listing
+each line that contains it in the
+.B "* Grep *"
+text as
+.IR path : line : text ,
+sorted by path name.
+Results appear as they are found while the files are searched
+in the background.
+Hidden files and directories, files that appear to be binary,
+and the editor's own working files are skipped.
+.TP
+.B ^Space*
+(note that the asterisk
+.B *
+is not a control character)
+does the same with the selection as a regular expression.
+.TP
+.B ^Space/
+with no selection visits the file and line named at the start
+of the cursor's line, as in the
+.B "* Grep *"
+text or the output of
+.B "grep -n"
+in a shell window.
+.TP
+.B ^Space%
+(note that the percent sign
+.B %
+is not a control character)
+prepares to replace the hits of the last such search with the
+clip buffer, in which
+.B \e1
+through
+.B \e9
+stand for the groups of a regular expression
+(and
+.B \e\e
+for a backslash).
+Each line still listed in the
+.B "* Grep *"
+text is shown as it would become in the
+.B "* Replace *"
+text, where lines can be deleted to leave them as they are.
+.B ^Space%
+in the
+.B "* Replace *"
+text then makes the replacements that it lists.
+Open texts are changed as if edited, and each can be restored with a single
+.BR ^cmd(U,Z) ;
+other files are rewritten by renaming a new copy over the old one,
+which is kept with a tilde appended to its name unless
+.B -o
+was used.
+A text or file that has changed since the preview is left as it is.
+.TP
+.B ^Space@
+(note that the at sign
+.B @
+is not a control character)
+lists the files in the tree below the current directory in the
+.B "* Files *"
+text, and narrows the list as characters are typed to those whose
+path names contain them in order, with the likeliest matches first:
+those that begin words, run together, or fall in the file's own name.
+.BR ^cmd(H,G) " and " ^cmd(T,H)
+move up and down the list,
+.B Return
+opens the file on the cursor's line in place of the list,
+and any other command leaves it.
+The list of files is kept in
+.B ~/.aoeui
+between sessions and brought up to date in the background;
+on Linux, files that come and go are noticed as they do.
 .SH TEXTS, VIEWS, and WINDOWS
 .TP
 .B ^cmd(K,W)
@@ -860,6 +1001,8 @@ use the title bar of the terminal emulator as a status indicator
 that displays the path name of the active view and whether or not it has
 been saved since last modified.
 Unless the file is large, it also displays the line number of the cursor.
+Text pasted into such a terminal is inserted just as it was copied,
+without automatic indentation, and is undone as a unit.
 .TP
 .B TERM_PROGRAM
 will, if set to Apple_Terminal, make
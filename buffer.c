@@ -256,6 +256,24 @@ size_t buffer_move(struct buffer *to, position_t to_offset,
 	return buffer_delete(from, from_offset, bytes);
 }
 
+void buffer_spans(struct buffer *buffer, struct spans *spans)
+{
+	memset(spans, 0, sizeof *spans);
+	if (!buffer || !buffer->payload)
+		return;
+	spans->data[0] = (Byte_t *) buffer->data;
+	spans->bytes[0] = buffer->gap;
+	spans->data[1] = (Byte_t *) buffer->data + buffer->gap +
+			 buffer_gap_bytes(buffer);
+	spans->bytes[1] = buffer->payload - buffer->gap;
+	if (!spans->bytes[0]) {
+		spans->data[0] = spans->data[1];
+		spans->bytes[0] = spans->bytes[1];
+		spans->data[1] = NULL;
+		spans->bytes[1] = 0;
+	}
+}
+
 void buffer_snap(struct buffer *buffer)
 {
 	if (buffer && buffer->fd >= 0) {
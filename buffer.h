@@ -6,6 +6,12 @@
 
 struct buffer;
 
+/* Content as (at most) two contiguous extents, without moving the gap */
+struct spans {
+	const Byte_t *data[2];
+	size_t bytes[2];
+};
+
 struct buffer *buffer_create(char *path);
 void buffer_destroy(struct buffer *);
 size_t buffer_raw(struct buffer *, char **, position_t, size_t);
@@ -15,6 +21,7 @@ size_t buffer_insert(struct buffer *, const void *, position_t, size_t);
 size_t buffer_move(struct buffer *dest, position_t,
 		   struct buffer *src, position_t, size_t);
 void buffer_snap(struct buffer *);
+void buffer_spans(struct buffer *, struct spans *);
 
 /* do *not* use directly; this definition is here
  * just for the inline functions.
@@ -14,6 +14,9 @@
  */
 
 static struct stream *streams;
+static Boolean_t (*idler)(void);
+
+#define READ_CHUNK 65536
 
 typedef Boolean_t (*activity)(struct stream *, char *received, ssize_t bytes);
 
@@ -23,9 +26,12 @@ struct stream {
 	Boolean_t retain;
 	activity activity;
 	struct view *view;
+	struct text *text;		/* being loaded */
+	pid_t pid;			/* of its loader */
 	locus_t locus;
 	const char *data;
 	size_t bytes, writ;
+	Boolean_t (*watcher)(struct view *, char *, ssize_t);
 };
 
 static Boolean_t insertion_activity(struct stream *stream,
@@ -72,6 +78,83 @@ static Boolean_t shell_output_activity(struct stream *stream, char *received,
 	return TRUE;
 }
 
+/*
+ *	A loader's exit status must not be reaped by the SIGCHLD handler
+ *	before load_activity() sees it, so SIGCHLD is held while any
+ *	loader runs.  Children start with it released.
+ */
+static unsigned loaders;
+
+static void hold_sigchld(Boolean_t hold)
+{
+	sigset_t sigchld;
+
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	if (hold ? !loaders++ : !--loaders)
+		sigprocmask(hold ? SIG_BLOCK : SIG_UNBLOCK, &sigchld, NULL);
+}
+
+static void release_signals(void)
+{
+	sigset_t none;
+
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+/* TRUE when the loader exited successfully */
+static Boolean_t loader_exit(struct stream *stream)
+{
+	int status = -1;
+
+	while (waitpid(stream->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	stream->pid = -1;
+	hold_sigchld(FALSE);
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+/*
+ *	Decompressed file content is appended to its text as it arrives
+ *	without recording undo information or making the text dirty.
+ *	The stream belongs to the text, not to the view that opened it,
+ *	so that the load continues while any view of the text remains.
+ *	A text whose decompressor fails keeps what it has but is made
+ *	read-only, lest a save replace its file with a truncation.
+ */
+static Boolean_t load_activity(struct stream *stream, char *received,
+			       ssize_t bytes)
+{
+	struct text *text = stream->text;
+	position_t offset = buffer_bytes(text->buffer);
+	struct view *view;
+
+	if (bytes <= 0) {
+		text->flags &= ~TEXT_LOADING;
+		if (!loader_exit(stream)) {
+			text->flags |= TEXT_RDONLY;
+			errno = 0;
+			message("%s: could not be decompressed completely; "
+				"it is incomplete and read-only",
+				path_format(text->path));
+		}
+		if (text->views)
+			view_scan(text->views);
+		return FALSE;
+	}
+	buffer_insert(text->buffer, received, offset, bytes);
+	text_hash_inserted(text, offset, bytes);
+	text_matches_inserted(text, offset, bytes);
+	for (view = text->views; view; view = view->next)
+		if (view->start + view->bytes == offset)
+			view->bytes += bytes;
+	if (text->preserved == text->dirties)
+		text->preserved++;
+	text->dirties++;
+	return TRUE;
+}
+
 static Boolean_t error_activity(struct stream *stream, char *received,
 				ssize_t bytes)
 {
@@ -82,6 +165,12 @@ static Boolean_t error_activity(struct stream *stream, char *received,
 	return TRUE;
 }
 
+static Boolean_t watch_activity(struct stream *stream, char *received,
+				ssize_t bytes)
+{
+	return stream->watcher(stream->view, received, bytes);
+}
+
 static Boolean_t out_activity(struct stream *stream, char *x, ssize_t bytes)
 {
 	ssize_t chunk = stream->bytes - stream->writ;
@@ -109,6 +198,7 @@ static struct stream *stream_create(fd_t fd)
 	struct stream *stream = allocate0(sizeof *stream);
 
 	stream->fd = fd;
+	stream->pid = -1;
 	stream->locus = NO_LOCUS;
 	if (!streams)
 		streams = stream;
@@ -127,6 +217,10 @@ static void stream_destroy(struct stream *stream, struct stream *prev)
 		close(stream->fd);
 	if (stream->view)
 		locus_destroy(stream->view, stream->locus);
+	if (stream->pid >= 0) {
+		/* the loader ends with a SIGPIPE */
+		hold_sigchld(FALSE);
+	}
 	if (prev)
 		prev->next = stream->next;
 	else
@@ -145,7 +239,7 @@ Boolean_t multiplexor(Boolean_t block)
 	fd_set fds[3];
 	char *rdbuff = NULL;
 
-	for (j = 0; j < 3; j++)
+again:	for (j = 0; j < 3; j++)
 		FD_ZERO(&fds[j]);
 	FD_SET(0, &fds[0]);
 	FD_SET(0, &fds[2]);
@@ -155,15 +249,25 @@ Boolean_t multiplexor(Boolean_t block)
 		if (stream->fd > maxfd)
 			maxfd = stream->fd;
 	}
-	if (block)
+	if (block && !idler)
 		tvp = NULL;
 	else
 		memset(tvp = &tv, 0, sizeof tv);
 
 	errno = 0;
-	if (select(maxfd + 1, &fds[0], &fds[1], &fds[2], tvp) < 0)
+	if ((j = select(maxfd + 1, &fds[0], &fds[1], &fds[2], tvp)) < 0)
 		return errno != EAGAIN && errno != EINTR;
 
+	/* Idle work runs in slices while nothing else is happening;
+	 * its completion returns to let the display be updated.
+	 */
+	if (!j && block && idler) {
+		if (idler())
+			goto again;
+		idler = NULL;
+		return FALSE;
+	}
+
 	for (prev = NULL, stream = streams; stream; stream = next) {
 		next = stream->next;
 		if (!FD_ISSET(stream->fd, &fds[!!stream->data]) &&
@@ -175,9 +279,9 @@ Boolean_t multiplexor(Boolean_t block)
 			bytes = 0;
 		else {
 			if (!rdbuff)
-				rdbuff = allocate(1024);
+				rdbuff = allocate(READ_CHUNK);
 			errno = 0;
-			bytes = read(stream->fd, rdbuff, 1023);
+			bytes = read(stream->fd, rdbuff, READ_CHUNK-1);
 		}
 		if (stream->activity(stream, rdbuff, bytes))
 			prev = stream;
@@ -209,14 +313,30 @@ void demultiplex_view(struct view *view)
 
 	for (stream = streams; stream; stream = next) {
 		next = stream->next;
-		if (stream->view == view)
+		if (stream->view == view) {
+			if (stream->watcher)
+				stream->watcher(view, NULL, 0);
 			stream_destroy(stream, prev);
-		else
+		} else
 			prev = stream;
 	}
 	child_close(view);
 }
 
+/* Stops the loading of a text that is being closed. */
+void demultiplex_text(struct text *text)
+{
+	struct stream *stream, *prev = NULL, *next;
+
+	for (stream = streams; stream; stream = next) {
+		next = stream->next;
+		if (stream->text == text)
+			stream_destroy(stream, prev);
+		else
+			prev = stream;
+	}
+}
+
 void multiplex_write(fd_t fd, const char *data, ssize_t bytes, Boolean_t retain)
 {
 	struct stream *stream;
@@ -235,6 +355,42 @@ void multiplex_write(fd_t fd, const char *data, ssize_t bytes, Boolean_t retain)
 	stream->bytes = bytes;
 }
 
+/* Starts a worker thread with every signal blocked, so that signals
+ * go to the editor's own thread and interrupt its select().
+ */
+int thread_create(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+	sigset_t all, old;
+	int err;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(thread, NULL, start, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return err;
+}
+
+/* Other modules can have their own descriptors watched; the stream
+ * persists while the watcher returns TRUE, and goes away with the view,
+ * whose watcher is then called once more with nothing received.
+ */
+void multiplex_read(fd_t fd, struct view *view,
+		    Boolean_t (*watcher)(struct view *, char *, ssize_t))
+{
+	struct stream *stream = stream_create(fd);
+	stream->activity = watch_activity;
+	stream->view = view;
+	stream->watcher = watcher;
+}
+
+/* Registers (or with NULL, cancels) work to be done while idle;
+ * it's called repeatedly until it returns FALSE.
+ */
+void multiplex_idle(Boolean_t (*work)(void))
+{
+	idler = work;
+}
+
 static void single_write(fd_t fd, Unicode_t ch)
 {
 	char buf[8];
@@ -300,6 +456,7 @@ static pid_t child(fd_t stdfd[3][2], unsigned stdfds, const char *argv[])
 		return pid;	/* parent */
 
 	/* child */
+	release_signals();
 	for (j = 0; j < 3; j++) {
 		close(stdfd[j][0]);
 		errno = 0;
@@ -327,6 +484,143 @@ static pid_t child(fd_t stdfd[3][2], unsigned stdfds, const char *argv[])
 	exit(EXIT_FAILURE);
 }
 
+/*
+ *	Filters are commands that read from and write to the given
+ *	file descriptors directly, e.g. the compressors that are used
+ *	to load and save compressed files.
+ */
+static pid_t filter(const char *argv[], fd_t std_in, fd_t std_out,
+		    fd_t std_err)
+{
+	int j;
+	pid_t pid;
+	fd_t fd[3];
+
+	fflush(NULL);
+	errno = 0;
+	if ((pid = fork()) < 0) {
+		message("could not fork");
+		return -1;
+	}
+
+	if (pid)
+		return pid;	/* parent */
+
+	/* child */
+	release_signals();
+	fd[0] = std_in, fd[1] = std_out, fd[2] = std_err;
+	for (j = 0; j < 3; j++) {
+		errno = 0;
+		if (fd[j] != j && dup2(fd[j], j) != j) {
+			fprintf(stderr, "dup2(%d,%d) failed: %s\n",
+				fd[j], j, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (j = 0; j < 3; j++)
+		if (fd[j] > 2)
+			close(fd[j]);
+
+	errno = 0;
+	execvp(argv[0], (char *const *) argv);
+
+	fprintf(stderr, "could not execute %s: %s\n",
+		argv[0], strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+Boolean_t text_load_command(struct view *view, const char *argv[],
+			    fd_t std_in)
+{
+	fd_t out[2], err[2];
+	struct stream *std_out, *std_err;
+	pid_t pid;
+
+	errno = 0;
+	if (pipe(out)) {
+		message("could not create pipes");
+		return FALSE;
+	}
+	if (pipe(err)) {
+		message("could not create pipes");
+		close(out[0]);
+		close(out[1]);
+		return FALSE;
+	}
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	fcntl(err[0], F_SETFD, FD_CLOEXEC);
+	hold_sigchld(TRUE);
+	if ((pid = filter(argv, std_in, out[1], err[1])) < 0) {
+		hold_sigchld(FALSE);
+		close(out[0]);
+		close(err[0]);
+		close(out[1]);
+		close(err[1]);
+		return FALSE;
+	}
+	close(out[1]);
+	close(err[1]);
+	view->text->flags |= TEXT_LOADING;
+	std_out = stream_create(out[0]);
+	std_out->activity = load_activity;
+	std_out->text = view->text;
+	std_out->pid = pid;
+	std_err = stream_create(err[0]);
+	std_err->activity = error_activity;
+	return TRUE;
+}
+
+/* Synchronously pipes data through a filter into a file. */
+Boolean_t filter_write(const char *argv[], const char *data, size_t bytes,
+		       fd_t std_out)
+{
+	fd_t in[2], null;
+	pid_t pid;
+	ssize_t wrote;
+	int status = -1;
+	sigset_t sigchld, old;
+
+	errno = 0;
+	if (pipe(in)) {
+		message("could not create pipes");
+		return FALSE;
+	}
+
+	/* Keep the SIGCHLD handler from reaping the filter first */
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, &old);
+
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	null = open("/dev/null", O_WRONLY);
+	pid = filter(argv, in[0], std_out, null >= 0 ? null : 2);
+	close(in[0]);
+	if (null >= 0)
+		close(null);
+	if (pid < 0) {
+		close(in[1]);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		return FALSE;
+	}
+
+	while (bytes) {
+		errno = 0;
+		wrote = write(in[1], data, bytes);
+		if (wrote < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		}
+		data += wrote;
+		bytes -= wrote;
+	}
+	close(in[1]);
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return !bytes && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
 static const char *shell_name(void)
 {
 	const char *shell = getenv("SHELL");
@@ -6,8 +6,14 @@ void mode_child(struct view *);
 void mode_shell_pipe(struct view *);
 void shell_command(struct view *, Unicode_t);
 void background_command(const char *command);
+Boolean_t text_load_command(struct view *, const char *argv[], fd_t std_in);
+Boolean_t filter_write(const char *argv[], const char *, size_t, fd_t std_out);
 
 Boolean_t multiplexor(Boolean_t block);
 void multiplex_write(fd_t fd, const char *, ssize_t bytes, Boolean_t retain);
+void multiplex_read(fd_t fd, struct view *,
+		    Boolean_t (*watcher)(struct view *, char *, ssize_t));
+void multiplex_idle(Boolean_t (*work)(void));
+int thread_create(pthread_t *, void *(*)(void *), void *);
 
 #endif
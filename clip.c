@@ -42,3 +42,12 @@ size_t clip_paste(struct view *view, position_t offset, unsigned reg)
 			   buffer_bytes(clip_buffer[reg]));
 	return view_insert(view, raw, offset, bytes);
 }
+
+size_t clip_raw(unsigned reg, char **raw)
+{
+	*raw = NULL;
+	if (reg >= clip_buffers || !clip_buffer[reg])
+		return 0;
+	return buffer_raw(clip_buffer[reg], raw, 0,
+			  buffer_bytes(clip_buffer[reg]));
+}
@@ -0,0 +1,461 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "types.h"
+#include "utf8.h"
+#include "display.h"
+#include "vt.h"
+
+/*
+ *	Replays scripted edits and scrolls through a headless display
+ *	into a model terminal, and reports what each frame costs in
+ *	bytes, write() calls, and the display's own CPU time (the
+ *	model's is left out).  After every frame, the model's screen
+ *	and cursor must match the image that was painted, or the
+ *	scenario fails.  Each scenario is played on a basic terminal,
+ *	on one that has REP, synchronized output, and left and right
+ *	margins, and on one that also takes 24-bit colors.
+ *
+ *	usage: display-bench [-r rows] [-c columns] [-n frames] [scenario...]
+ */
+
+void die(const char *, ...);
+Boolean_t multiplexor(Boolean_t);
+
+static struct display *D;
+static struct vt *V;
+static int rows = 24, columns = 80, frames = 100;
+static struct vt_cell *want;	/* the intended image */
+static int want_row, want_column;
+static unsigned long bytes, writes;
+static double model_seconds;
+static int failures;
+
+static double cpu(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sink(void *arg, const struct iovec *iov, int pieces)
+{
+	double start = cpu();
+	int j;
+
+	writes++;
+	for (j = 0; j < pieces; j++) {
+		bytes += iov[j].iov_len;
+		vt_write(V, iov[j].iov_base, iov[j].iov_len);
+	}
+	model_seconds += cpu() - start;
+}
+
+/* The model's replies to queries go back to the display. */
+static void answer(void)
+{
+	char buf[32];
+	size_t n, used;
+
+	while ((n = vt_replies(V, buf, sizeof buf)))
+		for (used = 0; used < n; ) {
+			used += display_input(D, buf + used, n - used);
+			while (!IS_ERROR_CODE(display_getch(D, FALSE)))
+				;
+		}
+}
+
+static void dput(int row, int col, Unicode_t ch, rgba_t fgrgba, rgba_t bgrgba)
+{
+	struct vt_cell *cell;
+
+	if (row < 0 || row >= rows || col < 0 || col >= columns)
+		return;
+	cell = &want[row*columns + col];
+	cell->unicode = ch;
+	cell->fgrgba = fgrgba;
+	cell->bgrgba = bgrgba;
+	display_put(D, row, col, ch, fgrgba, bgrgba);
+}
+
+static void dcursor(int row, int col)
+{
+	want_row = row;
+	want_column = col;
+	display_cursor(D, row, col);
+}
+
+/* Scrolls a rectangle by hint, up when "lines" is positive;
+ * the caller paints what's uncovered.
+ */
+static void dscroll(int row, int col, int lines, int rows_, int cols)
+{
+	int r, c, from;
+
+	if (lines > 0)
+		display_delete_lines(D, row, col, lines, rows_, cols);
+	else
+		display_insert_lines(D, row, col, -lines, rows_, cols);
+	for (r = lines > 0 ? 0 : rows_-1; r >= 0 && r < rows_;
+	     r += lines > 0 ? 1 : -1) {
+		from = r + lines;
+		for (c = 0; c < cols; c++) {
+			struct vt_cell *cell = &want[(row+r)*columns + col+c];
+			if (from >= 0 && from < rows_)
+				*cell = want[(row+from)*columns + col+c];
+			else {
+				cell->unicode = ' ';
+				cell->fgrgba = DEFAULT_FGRGBA;
+				cell->bgrgba = DEFAULT_BGRGBA;
+			}
+		}
+	}
+}
+
+/* Some text that looks a little like a program */
+static const char *words[] = {
+	"if", "(", "window->cursor", "=", "text_size", ");", "return",
+	"static", "int", "position_t", "café", "{", "}", "display_put",
+	"for", "j++", "naïve", "while", "offset", "break;", "/*", "*/",
+};
+#define WORDS (sizeof words / sizeof *words)
+
+static size_t line_text(unsigned line, char *buf, size_t max)
+{
+	unsigned seed = line * 2654435761u, indent = seed >> 28 & 3;
+	size_t bytes = 0, n;
+	const char *word;
+
+	memset(buf, '\t', indent);
+	bytes = indent;
+	for (n = seed >> 24 & 7; n < 12; n++) {
+		seed = seed * 1103515245 + 12345;
+		word = words[(seed >> 16) % WORDS];
+		if (bytes + strlen(word) + 1 >= max)
+			break;
+		bytes += sprintf(buf + bytes, "%s ", word);
+	}
+	return bytes;
+}
+
+/* Paints a line of text into a row within [col,col+cols),
+ * with tabs expanded and some words colored.
+ */
+static void dline(int row, int col, int cols, unsigned line, int shift,
+		  rgba_t bgrgba)
+{
+	char buf[256];
+	size_t n = line_text(line, buf, sizeof buf), j, used;
+	int c = 0, k;
+	rgba_t fgrgba = DEFAULT_FGRGBA;
+	Unicode_t ch;
+
+	for (k = 0; k < shift && c < cols; k++)
+		dput(row, col + c++, 'x', DEFAULT_FGRGBA, bgrgba);
+	for (j = 0; j < n && c < cols; j += used) {
+		used = utf8_length(buf + j, n - j);
+		ch = utf8_unicode(buf + j, used);
+		if (ch == '\t') {
+			do
+				dput(row, col + c++, ' ', fgrgba, bgrgba);
+			while (c < cols && c & 7);
+			continue;
+		}
+		if (ch == ' ')
+			fgrgba = line % 7 ? DEFAULT_FGRGBA : MAGENTA_RGBA;
+		else if (j && buf[j-1] == ' ' && buf[j] == 's')
+			fgrgba = BLUE_RGBA;
+		dput(row, col + c++, ch, fgrgba, bgrgba);
+	}
+	while (c < cols)
+		dput(row, col + c++, ' ', DEFAULT_FGRGBA, bgrgba);
+}
+
+static void dtext(int row, int col, int rows_, int cols, unsigned first)
+{
+	int r;
+	for (r = 0; r < rows_; r++)
+		dline(row + r, col, cols, first + r, 0, DEFAULT_BGRGBA);
+}
+
+/* The scenarios: each paints frame "k", the first being the setup */
+
+static void typing(int k)
+{
+	if (!k)
+		dtext(0, 0, rows, columns, 0);
+	dline(rows/2, 0, columns, rows/2, k % (columns/2), DEFAULT_BGRGBA);
+	dcursor(rows/2, k % (columns/2));
+}
+
+static void deleting(int k)
+{
+	if (!k)
+		dtext(0, 0, rows, columns, 0);
+	dline(rows/2, 0, columns, rows/2, columns/2 - 1 - k % (columns/2),
+	      DEFAULT_BGRGBA);
+	dcursor(rows/2, 0);
+}
+
+static void scrolling(int k)
+{
+	dtext(0, 0, rows, columns, k);
+	dcursor(rows/2, 0);
+}
+
+static void hinted(int k)
+{
+	if (!k)
+		dtext(0, 0, rows, columns, 0);
+	else {
+		dscroll(0, 0, 1, rows, columns);
+		dline(rows-1, 0, columns, rows-1 + k, 0, DEFAULT_BGRGBA);
+	}
+	dcursor(rows-1, 0);
+}
+
+static void paging(int k)
+{
+	dtext(0, 0, rows, columns, k * (rows-1));
+	dcursor(0, 0);
+}
+
+/* side by side windows; the left one scrolls */
+static void vsplit(int k)
+{
+	int half = columns / 2, r;
+
+	if (!k) {
+		dtext(0, 0, rows, half, 0);
+		for (r = 0; r < rows; r++)
+			dput(r, half, '|', BLACK_RGBA, WHITE_RGBA);
+		dtext(0, half+1, rows, columns-half-1, 1000);
+	} else {
+		dscroll(0, 0, 1, rows, half);
+		dline(rows-1, 0, half, rows-1 + k, 0, DEFAULT_BGRGBA);
+	}
+	dcursor(rows-1, 0);
+}
+
+/* stacked windows; the upper one scrolls back */
+static void hsplit(int k)
+{
+	int half = rows / 2;
+
+	if (!k) {
+		dtext(0, 0, half, columns, frames);
+		dtext(half, 0, rows-half, columns, 1000);
+	} else {
+		dscroll(0, 0, -1, half, columns);
+		dline(0, 0, columns, frames - k, 0, DEFAULT_BGRGBA);
+	}
+	dcursor(0, 0);
+}
+
+static void cursor(int k)
+{
+	if (!k)
+		dtext(0, 0, rows, columns, 0);
+	dcursor(k * 7 % rows, k * 13 % columns);
+}
+
+/* a selection that grows a row at a time */
+static void selecting(int k)
+{
+	int r;
+
+	for (r = 0; r < rows; r++)
+		dline(r, 0, columns, r, 0,
+		      r >= 2 && r < 2 + k % (rows-2) ? CYAN_RGBA
+						     : DEFAULT_BGRGBA);
+	dcursor(2 + k % (rows-2), 0);
+}
+
+/* rows recolored from a few colors outside the basic sixteen */
+static void tinting(int k)
+{
+	static const rgba_t tint[] = {
+		0xff800000, 0x80ff0000, 0x0080ff00, 0xff008000,
+		0x8000ff00, 0x00ff8000, 0xc0c0c000, 0x40404000,
+	};
+	int r, c;
+
+	for (r = 0; r < rows; r++)
+		for (c = 0; c < columns; c++)
+			dput(r, c, 'a' + (r + c) % 26,
+			     tint[(r + c/8 + k) % 8], DEFAULT_BGRGBA);
+	dcursor(0, 0);
+}
+
+/* everything changes */
+static void filling(int k)
+{
+	dtext(0, 0, rows, columns, k * 7919);
+	dcursor(0, 0);
+}
+
+static const struct scenario {
+	const char *name;
+	void (*frame)(int);
+} scenario[] = {
+	{ "type", typing },
+	{ "delete", deleting },
+	{ "scroll", scrolling },
+	{ "hint", hinted },
+	{ "page", paging },
+	{ "vsplit", vsplit },
+	{ "hsplit", hsplit },
+	{ "cursor", cursor },
+	{ "select", selecting },
+	{ "tint", tinting },
+	{ "fill", filling },
+	{ NULL }
+};
+
+static const struct terminal {
+	const char *name;
+	unsigned features;
+	const char *colorterm;
+} terminal[] = {
+	{ "basic", 0 },
+	{ "xterm", VT_REP | VT_SYNC | VT_MARGINS },
+	{ "direct", VT_REP | VT_SYNC | VT_MARGINS, "truecolor" },
+	{ NULL }
+};
+
+/* Does the model show what was painted?  The colors of spaces
+ * don't matter.
+ */
+static Boolean_t verify(const char *name, int k)
+{
+	const struct vt_cell *is, *was;
+	int r, c;
+
+	for (r = 0; r < rows; r++)
+		for (c = 0; c < columns; c++) {
+			is = vt_cell(V, r, c);
+			was = &want[r*columns + c];
+			if (is->unicode != was->unicode ||
+			    is->bgrgba != was->bgrgba ||
+			    is->unicode != ' ' && is->fgrgba != was->fgrgba) {
+				fprintf(stderr, "%s: frame %d: at %d,%d "
+					"U+%04X %08x/%08x should be "
+					"U+%04X %08x/%08x\n",
+					name, k, r, c,
+					is->unicode, is->fgrgba, is->bgrgba,
+					was->unicode, was->fgrgba,
+					was->bgrgba);
+				return FALSE;
+			}
+		}
+	vt_cursor(V, &r, &c);
+	if (r != want_row || c != want_column) {
+		fprintf(stderr, "%s: frame %d: cursor at %d,%d "
+			"should be at %d,%d\n",
+			name, k, r, c, want_row, want_column);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void run(const struct scenario *s, const struct terminal *t)
+{
+	int k, bad = -1, n;
+	double seconds = 0, start, model;
+
+	V = vt_create(rows, columns, t->features);
+	if (t->colorterm)
+		setenv("COLORTERM", t->colorterm, 1);
+	else
+		unsetenv("COLORTERM");
+	D = display_headless(rows, columns, sink, NULL);
+	display_get_geometry(D, &n, &n);
+	answer();
+	want = calloc(rows * columns, sizeof *want);
+	for (k = 0; k < rows * columns; k++) {
+		want[k].unicode = ' ';
+		want[k].fgrgba = DEFAULT_FGRGBA;
+		want[k].bgrgba = DEFAULT_BGRGBA;
+	}
+
+	for (k = 0; k <= frames; k++) {
+		if (k == 1)
+			bytes = writes = 0, seconds = 0;
+		start = cpu();
+		model = model_seconds;
+		s->frame(k);
+		display_sync(D);
+		seconds += cpu() - start - (model_seconds - model);
+		if (bad < 0 && !verify(s->name, k))
+			bad = k;
+	}
+
+	printf("%-8s %-6s %6d %9lu %9.1f %7.2f %9.2f  %s\n",
+	       s->name, t->name, frames, bytes, (double) bytes / frames,
+	       (double) writes / frames, seconds * 1e6 / frames,
+	       bad < 0 ? "ok" : "MISMATCH");
+	if (bad >= 0)
+		failures++;
+
+	display_end(D);
+	D = NULL;
+	vt_destroy(V);
+	free(want);
+}
+
+void die(const char *msg, ...)
+{
+	va_list ap;
+	display_end(D);
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+Boolean_t multiplexor(Boolean_t block)
+{
+	return FALSE;
+}
+
+int main(int argc, char **argv)
+{
+	const struct scenario *s;
+	const struct terminal *t;
+	int ch, j;
+
+	while ((ch = getopt(argc, argv, "r:c:n:")) != -1)
+		switch (ch) {
+		case 'r': rows = atoi(optarg);		break;
+		case 'c': columns = atoi(optarg);	break;
+		case 'n': frames = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "usage: %s [-r rows] [-c columns] "
+				"[-n frames] [scenario...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	if (rows < 4 || columns < 16 || frames < 1) {
+		fprintf(stderr, "%s: the display is too small\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %-6s %6s %9s %9s %7s %9s  %s\n",
+	       "scenario", "term", "frames", "bytes", "bytes/fr",
+	       "writes", "usec/fr", "screen");
+	for (s = scenario; s->name; s++) {
+		for (j = optind; j < argc; j++)
+			if (!strcmp(argv[j], s->name))
+				break;
+		if (optind < argc && j == argc)
+			continue;
+		for (t = terminal; t->name; t++)
+			run(s, t);
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
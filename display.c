@@ -7,12 +7,32 @@
  *	update it when repainting differs from the image.
  *	Assume lowest-common-denominator terminal emulation.
  *
+ *	Painting composes a frame of cells apart from the image;
+ *	display_sync() compares the two a row at a time, sends what
+ *	differs, and writes all of it at once.  The hints scroll the
+ *	frame along with the image so that moved text needn't be sent.
+ *	On a terminal, that comparison and the writing happen in a
+ *	render thread while the editor goes back to its input.
+ *	Terminals that support synchronized output (DEC private mode
+ *	2026) are told where each frame begins and ends, so that they
+ *	show it whole however the pty happens to split it.
+ *	Lines are scrolled within a scrolling region, and within left
+ *	and right margins when the terminal has them, so that scrolling
+ *	one window of a split display leaves its neighbors alone.
+ *	Colors are chosen with SGR sequences that are formatted once
+ *	per pair of colors and cached.  Terminals that claim 24-bit
+ *	color in $COLORTERM get colors outside the basic sixteen as
+ *	they are, instead of by redefining entries of the palette.
+ *
  *	reference: man 4 console_codes
  */
 
-#define OUTBUF_SIZE	1024
+#define OUTBUF_SIZE	65536
 #define INBUF_SIZE	64
+#define PASTE_PAUSE	2	/* seconds without input that end a paste */
 #define MAX_COLORS	8
+#define SGRS		64	/* cached color selections; a power of 2 */
+#define DIRECT_COLOR	256	/* from colormap(), for 38;2 and 48;2 */
 
 #define ESCCHAR '\x1b'
 #define ESC "\x1b"
@@ -36,9 +56,22 @@
 #define CTL_DELLINES	CSI "%uM"
 #define CTL_INSCOLS	CSI "%u@"
 #define CTL_INSLINES	CSI "%uL"
+#define CTL_REGION	CSI "%d;%dr"
+#define CTL_FULLREGION	CSI "r"
+#define CTL_MARGINS	CSI "%d;%ds"
+#define CTL_FULLMARGINS	CSI "s"
+#define CTL_QUERYMARGINS CSI "?69$p"
+#define CTL_MARGINMODE	CSI "?69h"
+#define CTL_NOMARGINMODE CSI "?69l"
 #define CTL_RGB		OSC "4;%d;rgb:%02x/%02x/%02x" ST
 #define CTL_CURSORRGB	OSC "12;rgb:%02x/%02x/%02x" ST
 #define CTL_CURSORPOS	CSI "6n"
+#define CTL_QUERYSYNC	CSI "?2026$p"
+#define CTL_BEGINSYNC	CSI "?2026h"
+#define CTL_ENDSYNC	CSI "?2026l"
+#define CTL_PASTEMODE	CSI "?2004h"
+#define CTL_NOPASTEMODE	CSI "?2004l"
+#define CTL_PASTEEND	CSI "201~"
 #define FG_COLOR	30
 #define BG_COLOR	40
 #define XTERM_TITLE	OSC "0;%s" ST
@@ -58,6 +91,22 @@ enum cursor_position_knowledge {
 	NEEDED, SOUGHT, KNOWN, INVALID
 };
 
+/* The SGR sequence that selects a pair of colors, either of
+ * which may be BAD_RGBA to leave it as it is.
+ */
+struct sgr {
+	rgba_t fgrgba, bgrgba;
+	size_t bytes;
+	char str[40];
+};
+
+/* A frame on its way to the render thread */
+struct snapshot {
+	int rows, columns;
+	int cursor_row, cursor_column;
+	struct cell *cells;
+};
+
 struct display {
 	int rows, columns;
 	int cursor_row, cursor_column;
@@ -67,60 +116,138 @@ struct display {
 	int at_row, at_column;
 	enum cursor_position_knowledge get_initial_cursor_position;
 	int initial_row, initial_column;
-	struct cell *image;
+	Boolean_t size_sought;
+	enum cursor_position_knowledge repeat_probe;
+	Boolean_t can_repeat;		/* REP works */
+	Boolean_t can_sync;		/* mode 2026 is known */
+	Boolean_t can_region;		/* DECSTBM */
+	Boolean_t can_margin;		/* DECSLRM, enabled by mode 69 */
+	struct cell *image;		/* what the terminal shows */
+	struct cell *frame;		/* what it's to show at the next sync */
+	struct cell *sending;		/* the frame being rendered */
+	unsigned long *image_hash, *frame_hash;	/* per row */
 	struct display *next;
 	Byte_t inbuf[INBUF_SIZE];
-	char outbuf[OUTBUF_SIZE];
-	size_t inbuf_bytes, outbuf_bytes;
+	char *outbuf;
+	size_t inbuf_bytes, outbuf_bytes, outbuf_alloc;
+	Boolean_t pasting;		/* within a bracketed paste */
+	char *paste;
+	size_t paste_bytes, paste_alloc;
 	Boolean_t is_xterm, is_linux, is_apple;
 	rgba_t color[MAX_COLORS];
 	unsigned colors;
+	Boolean_t can_rgb;		/* 24-bit color */
+	struct sgr sgr[SGRS];
 	char *title;
+	void (*sink)(void *, const struct iovec *, int);	/* headless */
+	void *sink_arg;
+	Boolean_t threaded;		/* frames go to the render thread */
+	pthread_t renderer;
+	struct snapshot *ready, *spare;	/* exchanged atomically */
+	Boolean_t busy, quit;		/* accessed atomically */
+	fd_t wake[2], idle[2];		/* pipes */
+	int failed;			/* errno of a failed write, atomic */
 };
 
 struct termios original_termios;
 static struct display *display_list;
 static void (*old_sigwinch)(int, siginfo_t *, void *);
+static volatile sig_atomic_t winched;
 static FILE *debug_file;
 
-static void emit(const char *str, size_t bytes)
+/* Writes out the pieces in order, with as few calls as possible;
+ * a headless display hands them all to its sink at once.
+ */
+static void emitv(struct display *display, struct iovec *iov, int pieces)
 {
-	size_t wrote;
+	size_t bytes = 0;
 	ssize_t chunk;
+	int j;
 
+	for (j = 0; j < pieces; j++)
+		bytes += iov[j].iov_len;
 	if (debug_file && bytes) {
 		fprintf(debug_file, "emit %d:", (int) bytes);
-		fwrite(str, bytes, 1, debug_file);
+		for (j = 0; j < pieces; j++)
+			fwrite(iov[j].iov_base, iov[j].iov_len, 1, debug_file);
 		fputc('\n', debug_file);
 	}
+	if (display->sink) {
+		display->sink(display->sink_arg, iov, pieces);
+		return;
+	}
 
-	for (wrote = 0; wrote < bytes; wrote += chunk) {
+	while (pieces) {
+		if (!iov->iov_len) {
+			iov++, pieces--;
+			continue;
+		}
 		errno = 0;
-		chunk = write(1, str + wrote, bytes - wrote);
+		chunk = writev(1, iov, pieces);
 		if (chunk < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
+			if (display->threaded &&
+			    pthread_equal(pthread_self(), display->renderer)) {
+				/* The editor's thread dies of it. */
+				__atomic_store_n(&display->failed,
+						 errno ? errno : EIO,
+						 __ATOMIC_SEQ_CST);
+				return;
+			}
 			die("write of %d bytes failed", bytes);
 		}
+		for (; pieces && (size_t) chunk >= iov->iov_len; iov++, pieces--)
+			chunk -= iov->iov_len;
+		if (pieces) {
+			iov->iov_base = (char *) iov->iov_base + chunk;
+			iov->iov_len -= chunk;
+		}
 	}
 }
 
+static void emit(struct display *display, const char *str, size_t bytes)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) str;
+	iov.iov_len = bytes;
+	emitv(display, &iov, 1);
+}
+
+/* When the terminal can synchronize its output, what's sent
+ * is bracketed so that it's shown only once it has all arrived.
+ */
 static void flush(struct display *display)
 {
-	emit(display->outbuf, display->outbuf_bytes);
+	struct iovec iov[3];
+
+	if (!display->outbuf_bytes)
+		return;
+	if (display->can_sync) {
+		iov[0].iov_base = (void *) CTL_BEGINSYNC;
+		iov[0].iov_len = sizeof CTL_BEGINSYNC - 1;
+		iov[1].iov_base = display->outbuf;
+		iov[1].iov_len = display->outbuf_bytes;
+		iov[2].iov_base = (void *) CTL_ENDSYNC;
+		iov[2].iov_len = sizeof CTL_ENDSYNC - 1;
+		emitv(display, iov, 3);
+	} else
+		emit(display, display->outbuf, display->outbuf_bytes);
 	display->outbuf_bytes = 0;
 }
 
+/* Output accumulates until the next flush, however much there is. */
 static void out(struct display *display, const char *str, size_t bytes)
 {
-	if (display->outbuf_bytes + bytes > sizeof display->outbuf)
-		flush(display);
-	if (bytes > sizeof display->outbuf)
-		emit(str, bytes);
-	else {
-		memcpy(display->outbuf + display->outbuf_bytes, str, bytes);
-		display->outbuf_bytes += bytes;
+	if (display->outbuf_bytes + bytes > display->outbuf_alloc) {
+		display->outbuf_alloc = (display->outbuf_bytes + bytes) * 2 +
+					OUTBUF_SIZE;
+		display->outbuf = reallocate(display->outbuf,
+					     display->outbuf_alloc);
 	}
+	memcpy(display->outbuf + display->outbuf_bytes, str, bytes);
+	display->outbuf_bytes += bytes;
 }
 
 static void outs(struct display *display, const char *str)
@@ -138,50 +265,219 @@ static void outf(struct display *display, const char *msg, ...)
 	outs(display, buf);
 }
 
+/* Frames of a terminal display are rendered and written by a
+ * thread of their own, so that the editor can return to its input
+ * as soon as a frame is painted.  display_sync() copies the frame
+ * into a snapshot and leaves it in a single slot; a snapshot that's
+ * still there when the next arrives is stale and dropped.  The two
+ * threads trade snapshots by atomic exchanges, without locking.
+ *
+ * The image, the output buffer, and the terminal's state belong to
+ * the render thread while it runs.  What else changes them first
+ * calls drain(), which takes back any frame that hasn't begun and
+ * waits for the thread to go idle.  Pipes wake the threads.
+ */
+static void snapshot_destroy(struct snapshot *snap)
+{
+	if (snap) {
+		RELEASE(snap->cells);
+		RELEASE(snap);
+	}
+}
+
+static void recycle(struct display *display, struct snapshot *snap)
+{
+	if (snap)
+		snapshot_destroy(__atomic_exchange_n(&display->spare, snap,
+						     __ATOMIC_SEQ_CST));
+}
+
+/* A write that failed in the render thread is fatal here. */
+static void failed(struct display *display)
+{
+	int err = __atomic_load_n(&display->failed, __ATOMIC_SEQ_CST);
+
+	if (err) {
+		errno = err;
+		die("write to the terminal failed");
+	}
+}
+
+static void drain(struct display *display)
+{
+	char buf[64];
+
+	if (!display->threaded)
+		return;
+	failed(display);
+	recycle(display, __atomic_exchange_n(&display->ready, NULL,
+					     __ATOMIC_SEQ_CST));
+	while (__atomic_load_n(&display->busy, __ATOMIC_SEQ_CST))
+		if (read(display->idle[0], buf, sizeof buf) < 0 &&
+		    errno != EINTR)
+			break;
+}
+
 static void force_moveto(struct display *display, int row, int column)
 {
 	outf(display, CTL_GOTO, (display->at_row = row) + 1,
 	     (display->at_column = column) + 1);
 }
 
-static void moveto(struct display *display, int row, int column)
+/* Cursor motion is sent in whichever of its encodings is shortest:
+ * an absolute position, or a vertical motion (relative, by line
+ * feeds, or to an absolute row) followed by a horizontal one
+ * (relative, by backspaces, to an absolute column, after a carriage
+ * return, or by writing over the characters already displayed in
+ * the current colors).  A column past the last one means that the
+ * terminal is waiting to wrap, so it's reached absolutely.
+ */
+static int digits(int n)
 {
-	if (row == display->at_row &&
-	    column >= display->at_column &&
-	    column < display->at_column + 8) {
-		int j, cols = column - display->at_column;
-		struct cell *cell = &display->image[row*display->columns +
-						    display->at_column];
-		for (j = 0; j < cols; j++)
-			if (cell[j].unicode != ' ' ||
-			    cell[j].bgrgba != display->bgrgba)
-				break;
-		if (j == cols) {
-			while (j-- > 0)
-				outs(display, " ");
-			display->at_column = column;
-			return;
-		}
-	} else if (row == display->at_row + 1) {
-		if (column == display->at_column) {
-			outs(display, "\n");
-			display->at_row++;
-			return;
-		}
-		if (!column) {
-			outs(display, "\n\r");
-			display->at_row++;
-			display->at_column = 0;
-			return;
+	int d = 1;
+	for (; n >= 10; n /= 10)
+		d++;
+	return d;
+}
+
+/* CSI with an optional count, which is omitted when it's 1 */
+static size_t motion(char *buf, int n, char final)
+{
+	if (n == 1)
+		return sprintf(buf, CSI "%c", final);
+	return sprintf(buf, CSI "%d%c", n, final);
+}
+
+static size_t motion_bytes(int n)
+{
+	return n == 1 ? 3 : 3 + digits(n);
+}
+
+/* Bytes needed to reach a column by rewriting what's displayed before
+ * it, or -1 if the colors differ or it'd take too many.
+ */
+static int overwrite_bytes(struct display *display, int row,
+			   int from, int to, int limit)
+{
+	const struct cell *cell = &display->image[row*display->columns + from];
+	char buf[8];
+	int bytes = 0;
+
+	for (; from < to; from++, cell++) {
+		if (cell->bgrgba != display->bgrgba ||
+		    cell->unicode != ' ' && cell->fgrgba != display->fgrgba)
+			return -1;
+		if ((bytes += unicode_utf8(buf, cell->unicode)) >= limit)
+			return -1;
+	}
+	return bytes;
+}
+
+static size_t overwrite(struct display *display, char *buf, int row,
+			int from, int to)
+{
+	const struct cell *cell = &display->image[row*display->columns + from];
+	size_t bytes = 0;
+
+	for (; from < to; from++, cell++)
+		bytes += unicode_utf8(buf + bytes, cell->unicode);
+	return bytes;
+}
+
+static size_t vertical(struct display *display, char *buf, int row)
+{
+	int n = row - display->at_row;
+	size_t bytes = 0;
+
+	if (!n)
+		return 0;
+	if (n > 0 && n <= motion_bytes(n)) {
+		memset(buf, '\n', n);
+		return n;
+	}
+	if (motion_bytes(n < 0 ? -n : n) <= motion_bytes(row + 1))
+		bytes = motion(buf, n < 0 ? -n : n, n < 0 ? 'A' : 'B');
+	else
+		bytes = motion(buf, row + 1, 'd');
+	return bytes;
+}
+
+static size_t horizontal(struct display *display, char *buf, int row,
+			 int column)
+{
+	int at = display->at_column, best, n, bytes;
+	char how = 'G';
+
+	best = motion_bytes(column + 1);		/* CHA */
+	n = column ? motion_bytes(column) : 0;	/* CR, CUF */
+	if (column &&
+	    (bytes = overwrite_bytes(display, row, 0, column, n)) >= 0)
+		n = bytes, how = 'o';
+	else
+		how = column ? 'r' : 'R';
+	if (n + 1 < best)
+		best = n + 1;
+	else
+		how = 'G';
+	if (at < display->columns) {
+		if (column == at)
+			return 0;
+		if (column > at) {
+			if ((n = motion_bytes(column - at)) < best)
+				best = n, how = 'C';
+			if ((bytes = overwrite_bytes(display, row, at, column,
+						     best)) >= 0)
+				best = bytes, how = 'O';
+		} else {
+			if ((n = motion_bytes(at - column)) < best)
+				best = n, how = 'D';
+			if (at - column < best)
+				best = at - column, how = 'b';
 		}
 	}
-	force_moveto(display, row, column);
+
+	switch (how) {
+	case 'C':
+		return motion(buf, column - at, 'C');
+	case 'D':
+		return motion(buf, at - column, 'D');
+	case 'b':
+		memset(buf, '\b', at - column);
+		return at - column;
+	case 'O':
+		return overwrite(display, buf, row, at, column);
+	case 'R':
+		*buf = '\r';
+		return 1;
+	case 'r':
+		*buf = '\r';
+		return 1 + motion(buf + 1, column, 'C');
+	case 'o':
+		*buf = '\r';
+		return 1 + overwrite(display, buf + 1, row, 0, column);
+	}
+	return motion(buf, column + 1, 'G');
 }
 
-void display_sync(struct display *display)
+static void moveto(struct display *display, int row, int column)
 {
-	moveto(display, display->cursor_row, display->cursor_column);
-	flush(display);
+	char best[32], try[64];
+	size_t best_bytes, bytes;
+
+	if (row == display->at_row && column == display->at_column)
+		return;
+	best_bytes = sprintf(best, CTL_GOTO, row + 1, column + 1);
+	if (display->at_row >= 0 && display->at_row < display->rows) {
+		bytes = vertical(display, try, row);
+		if (bytes < best_bytes) {
+			bytes += horizontal(display, try + bytes, row, column);
+			if (bytes < best_bytes)
+				memcpy(best, try, best_bytes = bytes);
+		}
+	}
+	out(display, best, best_bytes);
+	display->at_row = row;
+	display->at_column = column;
 }
 
 static unsigned linux_colormap(rgba_t rgba)
@@ -242,6 +538,8 @@ static unsigned colormap(struct display *display, rgba_t rgba)
 	for (idx = 0; idx < 8; idx++)
 		if (rgba == bright[idx])
 			return idx + 10;
+	if (display->can_rgb)
+		return DIRECT_COLOR;
 	for (idx = 0; idx < display->colors; idx++)
 		if (display->color[idx] == rgba)
 			return idx+18;
@@ -260,93 +558,182 @@ static unsigned colormap(struct display *display, rgba_t rgba)
 		display->color[best] = color_mean(display->color[best], rgba);
 	}
 	best += 18;
+	/* Cached selections may use the entry that's changing. */
+	memset(display->sgr, 0, sizeof display->sgr);
 	outf(display, CTL_RGB, best,
 	     rgba >> 24, rgba >> 16 & 0xff, rgba >> 8 & 0xff);
 	return best;
 }
 
-static void set_color(struct display *display, rgba_t rgba, unsigned magic)
+/* Formats the SGR parameters that select a color. */
+static size_t color_params(struct display *display, char *buf,
+			   rgba_t rgba, unsigned magic)
 {
+	unsigned c;
+
 	if (display->is_linux)
-		outf(display, CSI "%dm", linux_colormap(rgba) + magic);
-	else {
-		unsigned c = colormap(display, rgba);
-		if (c >= 18)
-			outf(display, CSI "%d;5;%dm", magic+8, c);
-		else if (c >= 10)
-			outf(display, CSI "%dm", c - 10 + magic + 60);
-		else
-			outf(display, CSI "%dm", c + magic);
-	}
+		return sprintf(buf, "%d", linux_colormap(rgba) + magic);
+	c = colormap(display, rgba);
+	if (c == DIRECT_COLOR)
+		return sprintf(buf, "%d;2;%d;%d;%d", magic+8,
+			       rgba >> 24, rgba >> 16 & 0xff, rgba >> 8 & 0xff);
+	if (c >= 18)
+		return sprintf(buf, "%d;5;%d", magic+8, c);
+	if (c >= 10)
+		return sprintf(buf, "%d", c - 10 + magic + 60);
+	return sprintf(buf, "%d", c + magic);
 }
 
-static void background_color(struct display *display, rgba_t rgba)
+/* Selects colors with one SGR sequence, which is formatted only
+ * the first time that a pair of colors is changed to.
+ */
+static void set_colors(struct display *display, rgba_t fgrgba, rgba_t bgrgba)
 {
-	if (rgba != display->bgrgba) {
-		set_color(display, rgba, BG_COLOR);
-		display->bgrgba = rgba;
+	struct sgr *sgr;
+	char buf[sizeof sgr->str];
+	size_t bytes;
+
+	if (fgrgba == display->fgrgba)
+		fgrgba = BAD_RGBA;
+	if (bgrgba == display->bgrgba)
+		bgrgba = BAD_RGBA;
+	if (fgrgba == BAD_RGBA && bgrgba == BAD_RGBA)
+		return;
+	sgr = &display->sgr[(fgrgba * 31 ^ bgrgba) * 2654435761u >> 26 &
+			    (SGRS-1)];
+	if (!sgr->bytes || sgr->fgrgba != fgrgba || sgr->bgrgba != bgrgba) {
+		bytes = sprintf(buf, CSI);
+		if (fgrgba != BAD_RGBA)
+			bytes += color_params(display, buf + bytes, fgrgba,
+					      FG_COLOR);
+		if (bgrgba != BAD_RGBA) {
+			if (fgrgba != BAD_RGBA)
+				buf[bytes++] = ';';
+			bytes += color_params(display, buf + bytes, bgrgba,
+					      BG_COLOR);
+		}
+		buf[bytes++] = 'm';
+		memcpy(sgr->str, buf, bytes);
+		sgr->bytes = bytes;
+		sgr->fgrgba = fgrgba;
+		sgr->bgrgba = bgrgba;
 	}
+	out(display, sgr->str, sgr->bytes);
+	if (fgrgba != BAD_RGBA)
+		display->fgrgba = fgrgba;
+	if (bgrgba != BAD_RGBA)
+		display->bgrgba = bgrgba;
 }
 
-static void foreground_color(struct display *display, rgba_t rgba)
+static void background_color(struct display *display, rgba_t rgba)
 {
-	if (rgba != display->fgrgba) {
-		set_color(display, rgba, FG_COLOR);
-		display->fgrgba = rgba;
-	}
+	set_colors(display, display->fgrgba, rgba);
 }
 
 static void default_colors(struct display *display) {
-	foreground_color(display, DEFAULT_FGRGBA);
-	background_color(display, DEFAULT_BGRGBA);
+	set_colors(display, DEFAULT_FGRGBA, DEFAULT_BGRGBA);
 }
 
 void display_put(struct display *display, int row, int column,
 		 Unicode_t unicode, rgba_t fgrgba, rgba_t bgrgba)
 {
-	char buf[8];
 	struct cell *cell;
 	if (row < 0 || row >= display->rows ||
 	    column < 0 || column >= display->columns)
 		return;
 	if (unicode < ' ')
 		unicode = ' ';
-	cell = &display->image[row*display->columns + column];
-	if (cell->unicode == unicode &&
-	    (cell->fgrgba == fgrgba || unicode == ' ') &&
-	    cell->bgrgba == bgrgba)
-		return;
-	moveto(display, row, column);
-	background_color(display, bgrgba);
-	if (unicode != ' ')
-		foreground_color(display, fgrgba);
-	out(display, buf, unicode_utf8(buf, unicode));
-	display->at_column++;
-	/* display->image may have moved due to resize */
-	cell = &display->image[row*display->columns + column];
+	cell = &display->frame[row*display->columns + column];
 	cell->unicode = unicode;
 	cell->bgrgba = bgrgba;
 	cell->fgrgba = fgrgba;
 }
 
-static Boolean_t color_fill(struct display *display,
-			    int row, int rows, int column, int columns,
-			    rgba_t fgrgba, rgba_t bgrgba)
+INLINE Boolean_t same(const struct cell *x, const struct cell *y)
 {
-	int r, c;
-	Boolean_t any = FALSE;
-	for (r = 0; r < rows; r++) {
-		struct cell *cell = &display->image[(row+r) * display->columns +
-						    column];
-		for (c = 0; c < columns; c++, cell++)
-			if (cell->fgrgba != fgrgba ||
-			    cell->bgrgba != bgrgba) {
-				cell->fgrgba = fgrgba;
-				cell->bgrgba = bgrgba;
-				any = TRUE;
-			}
+	return	x->unicode == y->unicode &&
+		x->bgrgba == y->bgrgba &&
+		(x->fgrgba == y->fgrgba || x->unicode == ' ');
+}
+
+static void put(struct display *display, int row, int column,
+		const struct cell *new)
+{
+	char buf[8];
+
+	moveto(display, row, column);
+	set_colors(display,
+		   new->unicode == ' ' ? display->fgrgba : new->fgrgba,
+		   new->bgrgba);
+	out(display, buf, unicode_utf8(buf, new->unicode));
+	display->at_column++;
+	display->image[row*display->columns + column] = *new;
+}
+
+/* After a cell's been sent, the next "n" cells in the row are to be
+ * the same; sends them as a repetition or, for spaces, an erasure,
+ * if that's shorter than sending them one by one.
+ */
+static Boolean_t run(struct display *display, int row, int column, int n)
+{
+	struct cell *cell = &display->image[row*display->columns + column];
+	char buf[16];
+	int j, bytes = n * unicode_utf8(buf, cell[-1].unicode);
+
+	if (display->can_repeat && motion_bytes(n) < bytes) {
+		out(display, buf, motion(buf, n, 'b'));
+		display->at_column += n;
+	} else if (cell[-1].unicode == ' ' &&
+		   (!display->is_apple || cell[-1].bgrgba == DEFAULT_BGRGBA) &&
+		   2 * motion_bytes(n) < bytes)
+		out(display, buf, motion(buf, n, 'X'));	/* ECH */
+	else
+		return FALSE;
+	for (j = 0; j < n; j++)
+		cell[j] = cell[-1];
+	return TRUE;
+}
+
+/* Sends what differs in a row of the frame.  When the rest of the
+ * row is blank, it's erased instead, since erasure fills with the
+ * current background color (or with the default, on Apple's).
+ */
+static void render_row(struct display *display, int row)
+{
+	int columns = display->columns, column, blank, n;
+	struct cell *new = &display->sending[row*columns];
+	struct cell *old = &display->image[row*columns];
+	rgba_t bgrgba = new[columns-1].bgrgba;
+
+	if (!memcmp(new, old, columns * sizeof *new))
+		return;
+	for (blank = columns; blank > 0; blank--)
+		if (new[blank-1].unicode != ' ' ||
+		    new[blank-1].bgrgba != bgrgba)
+			break;
+	if (display->is_apple && bgrgba != DEFAULT_BGRGBA)
+		blank = columns;
+	for (column = 0; column < columns; column++) {
+		if (same(&new[column], &old[column]))
+			continue;
+		if (column < blank) {
+			put(display, row, column, &new[column]);
+			for (n = 1; column + n < blank; n++)
+				if (memcmp(&new[column+n], &new[column],
+					   sizeof *new) ||
+				    same(&new[column+n], &old[column+n]))
+					break;
+			if (n > 1 && run(display, row, column + 1, n - 1))
+				column += n - 1;
+			continue;
+		}
+		moveto(display, row, column);
+		background_color(display, bgrgba);
+		outs(display, CTL_ERASELINE);
+		memcpy(old + column, new + column,
+		       (columns - column) * sizeof *old);
+		break;
 	}
-	return any;
 }
 
 /* After an erase, insert, or delete command, update the state.
@@ -357,39 +744,52 @@ static Boolean_t color_fill(struct display *display,
  * We avoid the discrepancy by setting the colors to the default values
  * prior to executing erase, insert, and delete commands in the functions
  * that complete their work by calling this routine.
- * Returns TRUE if any state was modified.
  */
-static Boolean_t space_fill(struct display *display, int row, int rows,
-			    int column, int columns)
+static void blank_cells(struct display *display, struct cell *cells,
+			int row, int rows, int column, int columns)
 {
 	int r, c;
-	Boolean_t any = FALSE;
-	rgba_t fg = display->fgrgba, bg = display->bgrgba;
+	struct cell blank;
 
+	blank.unicode = ' ';
+	blank.fgrgba = display->fgrgba;
+	blank.bgrgba = display->bgrgba;
 	if (display->is_apple) {
-		fg = DEFAULT_FGRGBA;
-		bg = DEFAULT_BGRGBA;
+		blank.fgrgba = DEFAULT_FGRGBA;
+		blank.bgrgba = DEFAULT_BGRGBA;
 	}
 
 	for (r = 0; r < rows; r++) {
-		struct cell *cell = &display->image[(row+r) * display->columns +
-						    column];
-		for (c = 0; c < columns; c++, cell++)
-			if (cell->unicode != ' ') {
-				cell->unicode = ' ';
-				any = TRUE;
-			}
+		int at = (row+r) * display->columns + column;
+		for (c = 0; c < columns; c++, at++)
+			cells[at] = blank;
 	}
+}
+
+/* The frame is filled in the same way as the image. */
+static void space_fill(struct display *display, int row, int rows,
+		       int column, int columns)
+{
+	blank_cells(display, display->image, row, rows, column, columns);
+	blank_cells(display, display->frame, row, rows, column, columns);
+}
 
-	if (color_fill(display, row, rows, column, columns, fg, bg))
-		any = TRUE;
-	return any;
+/* Moves cells in both the image and the frame. */
+static void move_cells(struct display *display, int to, int from, int cells)
+{
+	memmove(&display->image[to], &display->image[from],
+		cells * sizeof *display->image);
+	memmove(&display->frame[to], &display->frame[from],
+		cells * sizeof *display->frame);
 }
 
+/* Erasure is painting with default spaces; display_sync()
+ * decides how to send it.
+ */
 void display_erase(struct display *display, int row, int column,
 		   int rows, int columns)
 {
-	int r;
+	int r, c;
 
 	if (row < 0 || row >= display->rows ||
 	    column < 0 || column >= display->columns)
@@ -398,38 +798,18 @@ void display_erase(struct display *display, int row, int column,
 		rows = display->rows - row;
 	if (column + columns > display->columns)
 		columns = display->columns - column;
-	if (rows <= 0 || columns <= 0)
-		return;
-	default_colors(display);
-	if (!space_fill(display, row, rows, column, columns))
-		return;
-	if (!column &&
-	    columns == display->columns &&
-	    row + rows == display->rows) {
-		if (!row)
-			outs(display, CTL_ERASEALL);
-		else {
-			moveto(display, row, column);
-			outs(display, CTL_ERASETOEND);
-		}
-	} else if (column + columns == display->columns) {
-		for (r = 0; r < rows; r++) {
-			moveto(display, row + r, column);
-			outs(display, CTL_ERASELINE);
-		}
-	} else {
-		for (r = 0; r < rows; r++) {
-			moveto(display, row + r, column);
-			outf(display, CTL_ERASECOLS, columns);
-		}
-	}
+	for (r = 0; r < rows; r++)
+		for (c = 0; c < columns; c++)
+			display_put(display, row + r, column + c, ' ',
+				    DEFAULT_FGRGBA, DEFAULT_BGRGBA);
 }
 
 void display_insert_spaces(struct display *display, int row, int column,
 			   int spaces, int columns)
 {
-	struct cell *cell;
+	int at;
 
+	drain(display);
 	if (row < 0 || row >= display->rows ||
 	    column < 0 || column >= display->columns)
 		return;
@@ -446,16 +826,17 @@ void display_insert_spaces(struct display *display, int row, int column,
 	}
 	moveto(display, row, column);
 	outf(display, CTL_INSCOLS, spaces);
-	cell = &display->image[row*display->columns + column];
-	memmove(cell + spaces, cell, (columns - spaces) * sizeof *cell);
+	at = row*display->columns + column;
+	move_cells(display, at + spaces, at, columns - spaces);
 	space_fill(display, row, 1, column, spaces);
 }
 
 void display_delete_chars(struct display *display, int row, int column,
 			  int chars, int columns)
 {
-	struct cell *cell;
+	int at;
 
+	drain(display);
 	if (row < 0 || row >= display->rows ||
 	    column < 0 || column >= display->columns)
 		return;
@@ -470,8 +851,8 @@ void display_delete_chars(struct display *display, int row, int column,
 	outf(display, CTL_DELCOLS, chars);
 	moveto(display, row, column + columns - chars);
 	outf(display, CTL_INSCOLS, chars);
-	cell = &display->image[row*display->columns + column];
-	memmove(cell, cell + chars, (columns - chars) * sizeof *cell);
+	at = row*display->columns + column;
+	move_cells(display, at, at + chars, columns - chars);
 	space_fill(display, row, 1, column + columns - chars, chars);
 }
 
@@ -490,90 +871,423 @@ static Boolean_t validate(struct display *display, int row, int column,
 	return *lines > 0 && *columns > 0;
 }
 
+/* Scrolls the rectangle alone by inserting (lines > 0) or deleting
+ * lines within a scrolling region and margins, if the terminal can.
+ * Setting or resetting either one homes the cursor.
+ */
+static Boolean_t scroll_region(struct display *display, int row, int column,
+			       int lines, int rows, int columns)
+{
+	Boolean_t margins = column || columns != display->columns;
+
+	if (!display->can_region || (margins && !display->can_margin))
+		return FALSE;
+	default_colors(display);
+	outf(display, CTL_REGION, row + 1, row + rows);
+	if (margins)
+		outf(display, CTL_MARGINS, column + 1, column + columns);
+	force_moveto(display, row, column);
+	if (lines > 0)
+		outf(display, CTL_INSLINES, lines);
+	else
+		outf(display, CTL_DELLINES, -lines);
+	if (margins)
+		outs(display, CTL_FULLMARGINS);
+	outs(display, CTL_FULLREGION);
+	display->at_row = display->at_column = 0;
+	return TRUE;
+}
+
+/* Moves the lines of a rectangle of the image or of the frame. */
+static void move_lines(struct display *display, struct cell *cells,
+		       int to, int from, int lines, int column, int columns)
+{
+	int r;
+
+	if (!column && columns == display->columns) {
+		memmove(&cells[to * columns], &cells[from * columns],
+			lines * columns * sizeof *cells);
+		return;
+	}
+	if (to < from)
+		for (r = 0; r < lines; r++)
+			memmove(&cells[(to + r) * display->columns + column],
+				&cells[(from + r) * display->columns + column],
+				columns * sizeof *cells);
+	else
+		for (r = lines; r-- > 0; )
+			memmove(&cells[(to + r) * display->columns + column],
+				&cells[(from + r) * display->columns + column],
+				columns * sizeof *cells);
+}
+
+/* Scrolls a rectangle of the terminal and of the image by inserting
+ * (lines > 0) or deleting lines at its top.  Full-width rectangles
+ * can always be scrolled; narrower ones only within margins.
+ */
+static Boolean_t scroll_lines(struct display *display, int row, int column,
+			      int lines, int rows, int columns)
+{
+	Boolean_t full = !column && columns == display->columns;
+	int n = lines > 0 ? lines : -lines;
+
+	if (full && row + rows == display->rows) {
+		default_colors(display);
+		moveto(display, row, 0);
+		if (lines > 0)
+			outf(display, CTL_INSLINES, n);
+		else
+			outf(display, CTL_DELLINES, n);
+	} else if (scroll_region(display, row, column, lines, rows, columns))
+		;
+	else if (!full)
+		return FALSE;
+	else if (lines > 0) {
+		default_colors(display);
+		moveto(display, row + rows - n, 0);
+		outf(display, CTL_DELLINES, n);
+		moveto(display, row, 0);
+		outf(display, CTL_INSLINES, n);
+	} else {
+		default_colors(display);
+		moveto(display, row, 0);
+		outf(display, CTL_DELLINES, n);
+		moveto(display, row + rows - n, 0);
+		outf(display, CTL_INSLINES, n);
+	}
+	if (lines > 0) {
+		move_lines(display, display->image, row + n, row, rows - n,
+			   column, columns);
+		blank_cells(display, display->image, row, n, column, columns);
+	} else {
+		move_lines(display, display->image, row, row + n, rows - n,
+			   column, columns);
+		blank_cells(display, display->image, row + rows - n, n,
+			    column, columns);
+	}
+	return TRUE;
+}
+
+/* The frame moves even when the terminal can't scroll the rectangle,
+ * so that what's moved needn't be painted again, only sent.
+ */
 void display_insert_lines(struct display *display, int row, int column,
 			  int lines, int rows, int columns)
 {
-	if (column ||
-	    columns != display->columns ||
-	    !validate(display, row, column, &rows, &columns, &lines))
+	if (!validate(display, row, column, &rows, &columns, &lines))
 		return;
-	default_colors(display);
-	if (row + rows != display->rows) {
-		moveto(display, row + rows - lines, 0);
-		outf(display, CTL_DELLINES, lines);
-	}
-	moveto(display, row, 0);
-	outf(display, CTL_INSLINES, lines);
-	memmove(&display->image[(row + lines) * display->columns],
-		&display->image[row * display->columns],
-		(rows - lines) * display->columns * sizeof *display->image);
-	space_fill(display, row, lines, 0, display->columns);
+	drain(display);
+	scroll_lines(display, row, column, lines, rows, columns);
+	move_lines(display, display->frame, row + lines, row, rows - lines,
+		   column, columns);
+	blank_cells(display, display->frame, row, lines, column, columns);
 }
 
 void display_delete_lines(struct display *display, int row, int column,
 			  int lines, int rows, int columns)
 {
-	struct cell *cell;  /* assigned later for safety from resizing */
+	if (!validate(display, row, column, &rows, &columns, &lines))
+		return;
+	drain(display);
+	scroll_lines(display, row, column, -lines, rows, columns);
+	move_lines(display, display->frame, row, row + lines, rows - lines,
+		   column, columns);
+	blank_cells(display, display->frame, row + rows - lines, lines,
+		    column, columns);
+}
+
+/* Rows of the image and of the frame are compared by hash, as in the
+ * classic curses optimization, to find text that has moved up or down
+ * since it was sent.  A run of frame rows that lie elsewhere in the
+ * image is scrolled into place when that costs less than sending
+ * their cells again.  (A row's first match must be its only one, so
+ * blank and repeated rows join runs but can't start them.)
+ */
+#define SCROLL_COST 16	/* bytes, about, to scroll within a region */
+#define SCROLLS 4	/* at most, per frame */
+
+static unsigned long row_hash(const struct cell *cell, int columns)
+{
+	unsigned long hash = 2166136261UL;
 
-	if (column ||
-	    columns != display->columns ||
-	    !validate(display, row, column, &rows, &columns, &lines))
+	for (; columns--; cell++) {
+		hash = (hash ^ cell->unicode) * 16777619UL;
+		hash = (hash ^ cell->bgrgba) * 16777619UL;
+		if (cell->unicode != ' ')
+			hash = (hash ^ cell->fgrgba) * 16777619UL;
+	}
+	return hash;
+}
+
+/* Cells of frame row "row" that would have to be sent if the
+ * terminal showed image row "from" there, or a blank row if
+ * "from" is negative
+ */
+static int row_cost(struct display *display, int row, int from)
+{
+	int columns = display->columns, column, cost = 0;
+	struct cell *new = &display->sending[row*columns];
+	struct cell blank;
+
+	if (from >= 0) {
+		for (column = 0; column < columns; column++)
+			cost += !same(&new[column],
+				      &display->image[from*columns + column]);
+		return cost;
+	}
+	blank.unicode = ' ';
+	blank.fgrgba = DEFAULT_FGRGBA;
+	blank.bgrgba = DEFAULT_BGRGBA;
+	for (column = 0; column < columns; column++)
+		cost += !same(&new[column], &blank);
+	return cost;
+}
+
+/* What's saved by scrolling so that frame rows [row,row+rows)
+ * show image rows [row+shift,row+shift+rows)
+ */
+static int scroll_savings(struct display *display, int row, int rows,
+			  int shift)
+{
+	int top = shift > 0 ? row : row + shift;
+	int bottom = shift > 0 ? row + rows + shift : row + rows;
+	int r, saved = 0;
+
+	for (r = top; r < bottom; r++) {
+		saved += row_cost(display, r, r);
+		if (r >= row && r < row + rows)
+			saved -= row_cost(display, r, r + shift);
+		else
+			saved -= row_cost(display, r, -1);
+	}
+	return saved;
+}
+
+static Boolean_t scroll_detect(struct display *display)
+{
+	int rows = display->rows, columns = display->columns;
+	unsigned long *old = display->image_hash, *new = display->frame_hash;
+	int r, j, s, n, top, shift, saved;
+	int best = SCROLL_COST, best_row = 0, best_rows = 0, best_shift = 0;
+
+	for (r = 0; r < rows; r++) {
+		old[r] = row_hash(&display->image[r*columns], columns);
+		new[r] = row_hash(&display->sending[r*columns], columns);
+	}
+	for (r = 0; r < rows; r += n) {
+		n = 1;
+		if (new[r] == old[r])
+			continue;
+		for (s = -1, j = 0; j < rows; j++)
+			if (old[j] == new[r]) {
+				if (s >= 0)
+					break;
+				s = j;
+			}
+		if (s < 0 || j < rows)
+			continue;
+		shift = s - r;
+		for (top = r;
+		     top > 0 && top - 1 + shift >= 0 &&
+		     new[top-1] == old[top-1+shift];
+		     top--) {
+		}
+		while (r + n < rows && r + n + shift < rows &&
+		       new[r+n] == old[r+n+shift])
+			n++;
+		saved = scroll_savings(display, top, r + n - top, shift);
+		if (saved > best) {
+			best = saved;
+			best_row = top;
+			best_rows = r + n - top;
+			best_shift = shift;
+		}
+	}
+	if (!best_rows)
+		return FALSE;
+	if (best_shift > 0)
+		return scroll_lines(display, best_row, 0, -best_shift,
+				    best_rows + best_shift, columns);
+	return scroll_lines(display, best_row + best_shift, 0, -best_shift,
+			    best_rows - best_shift, columns);
+}
+
+/* When a row differs from what's shown by cells inserted or deleted
+ * at one place, the rest of it is shifted on the terminal rather than
+ * sent again, if that's shorter.
+ */
+#define MAX_SHIFT 8	/* cells */
+#define SHIFT_COST 8	/* bytes, about, to move and shift */
+
+static void shift_row(struct display *display, int row)
+{
+	int columns = display->columns, at, n, j, cost, inserted, deleted;
+	struct cell *new = &display->sending[row*columns];
+	struct cell *old = &display->image[row*columns];
+	struct cell blank;
+
+	for (at = 0; at < columns; at++)
+		if (!same(&new[at], &old[at]))
+			break;
+	if (at == columns)
+		return;
+	blank.unicode = ' ';
+	blank.fgrgba = DEFAULT_FGRGBA;
+	blank.bgrgba = DEFAULT_BGRGBA;
+	for (cost = 0, j = at; j < columns; j++)
+		cost += !same(&new[j], &old[j]);
+	for (n = 1; n <= MAX_SHIFT && at + n < columns; n++) {
+		for (inserted = n, j = at + n; j < columns; j++)
+			inserted += !same(&new[j], &old[j-n]);
+		for (deleted = 0, j = at; j < columns; j++)
+			deleted += !same(&new[j],
+					 j + n < columns ? &old[j+n] : &blank);
+		if (cost - inserted > SHIFT_COST ||
+		    cost - deleted > SHIFT_COST)
+			break;
+	}
+	if (n > MAX_SHIFT || at + n >= columns)
 		return;
 	default_colors(display);
-	moveto(display, row, 0);
-	outf(display, CTL_DELLINES, lines);
-	if (row + rows != display->rows) {
-		moveto(display, row + rows - lines, 0);
-		outf(display, CTL_INSLINES, lines);
+	moveto(display, row, at);
+	if (inserted <= deleted) {
+		outf(display, CTL_INSCOLS, n);
+		memmove(&old[at+n], &old[at], (columns - at - n) * sizeof *old);
+		blank_cells(display, display->image, row, 1, at, n);
+	} else {
+		outf(display, CTL_DELCOLS, n);
+		memmove(&old[at], &old[at+n], (columns - at - n) * sizeof *old);
+		blank_cells(display, display->image, row, 1, columns - n, n);
 	}
-	cell = &display->image[row * display->columns];
-	memmove(cell, cell + lines * display->columns,
-		(rows - lines) * display->columns * sizeof *cell);
-	space_fill(display, row + rows - lines, lines, 0, display->columns);
-}
-
-static struct cell *resize(struct display *display, struct cell *old,
-			   int old_rows, int old_columns,
-			   int new_rows, int new_columns)
-{
-	int cells = new_rows * new_columns;
-	size_t bytes = cells * sizeof *old;
-	struct cell *new = allocate(bytes);
-	int min_rows = new_rows < old_rows ? new_rows : old_rows;
-	int min_columns = new_columns < old_columns ? new_columns : old_columns;
-	int j, k;
-
-	if (!old) {
-		memset(new, 0, bytes);
-		for (j = 0; j < cells; j++) {
-			new[j].unicode = ' ';
-			new[j].bgrgba = display->bgrgba;
-			new[j].fgrgba = display->fgrgba;
-		}
-		return new;
+}
+
+/* Sends a frame, and then everything that's been queued
+ * for the terminal, in one write.
+ */
+static void render(struct display *display, struct cell *frame,
+		   int cursor_row, int cursor_column)
+{
+	int row;
+
+	display->sending = frame;
+	for (row = 0; row < SCROLLS && scroll_detect(display); row++) {
+	}
+	for (row = 0; row < display->rows; row++) {
+		shift_row(display, row);
+		render_row(display, row);
 	}
+	moveto(display, cursor_row, cursor_column);
+	flush(display);
+}
 
-	for (j = 0; j < min_rows; j++) {
-		struct cell *cell = &new[j*new_columns];
-		for (k = 0; k < min_columns; k++)
-			*cell++ = old[j*old_columns+k];
-		for (; k < new_columns; k++) {
-			*cell = cell[-1];
-			cell++->unicode = ' ';
+static void *renderer(void *arg)
+{
+	struct display *display = arg;
+	struct snapshot *snap;
+	Boolean_t quit;
+	char buf[64];
+
+	for (;;) {
+		__atomic_store_n(&display->busy, TRUE, __ATOMIC_SEQ_CST);
+		while ((snap = __atomic_exchange_n(&display->ready, NULL,
+						   __ATOMIC_SEQ_CST))) {
+			if (snap->rows == display->rows &&
+			    snap->columns == display->columns)
+				render(display, snap->cells,
+				       snap->cursor_row, snap->cursor_column);
+			recycle(display, snap);
 		}
-	}
-	for (; j < new_rows; j++) {
-		struct cell *cell = &new[j*new_columns];
-		for (k = 0; k < new_columns; k++) {
-			*cell = *(cell - display->columns);
-			cell++->unicode = ' ';
+		quit = __atomic_load_n(&display->quit, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&display->busy, FALSE, __ATOMIC_SEQ_CST);
+		if (write(display->idle[1], "", 1)) {
+			/* a full pipe will wake the editor anyway */
+		}
+		if (quit)
+			return NULL;
+		while (read(display->wake[0], buf, sizeof buf) < 0 &&
+		       errno == EINTR) {
 		}
 	}
+}
+
+/* The render thread takes no signals; they're for the editor's. */
+static void render_start(struct display *display)
+{
+	sigset_t all, old;
+	int err;
+
+	if (pipe(display->wake))
+		return;
+	if (pipe(display->idle)) {
+		close(display->wake[0]);
+		close(display->wake[1]);
+		return;
+	}
+	fcntl(display->wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(display->idle[1], F_SETFL, O_NONBLOCK);
+	display->quit = FALSE;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&display->renderer, NULL, renderer, display);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		close(display->wake[0]);
+		close(display->wake[1]);
+		close(display->idle[0]);
+		close(display->idle[1]);
+		return;
+	}
+	display->threaded = TRUE;
+}
+
+static void render_stop(struct display *display)
+{
+	if (!display->threaded)
+		return;
+	drain(display);
+	__atomic_store_n(&display->quit, TRUE, __ATOMIC_SEQ_CST);
+	if (write(display->wake[1], "", 1)) {
+	}
+	pthread_join(display->renderer, NULL);
+	display->threaded = FALSE;
+	close(display->wake[0]);
+	close(display->wake[1]);
+	close(display->idle[0]);
+	close(display->idle[1]);
+	snapshot_destroy(display->spare);
+	display->spare = NULL;
+}
+
+void display_sync(struct display *display)
+{
+	struct snapshot *snap;
+	size_t cells = display->rows * display->columns;
 
-	RELEASE(old);
-	return new;
+	if (!display->threaded) {
+		render(display, display->frame,
+		       display->cursor_row, display->cursor_column);
+		return;
+	}
+	failed(display);
+	snap = __atomic_exchange_n(&display->spare, NULL, __ATOMIC_SEQ_CST);
+	if (!snap)
+		snap = allocate0(sizeof *snap);
+	if (snap->rows != display->rows || snap->columns != display->columns)
+		snap->cells = reallocate(snap->cells,
+					 cells * sizeof *snap->cells);
+	memcpy(snap->cells, display->frame, cells * sizeof *snap->cells);
+	snap->rows = display->rows;
+	snap->columns = display->columns;
+	snap->cursor_row = display->cursor_row;
+	snap->cursor_column = display->cursor_column;
+	recycle(display, __atomic_exchange_n(&display->ready, snap,
+					     __ATOMIC_SEQ_CST));
+	if (write(display->wake[1], "", 1)) {
+		/* a full pipe has wakened the thread already */
+	}
 }
 
+/* A new geometry begins with a clear screen. */
 static void set_geometry(struct display *display, int rows, int columns)
 {
 	if (display->image &&
@@ -581,13 +1295,20 @@ static void set_geometry(struct display *display, int rows, int columns)
 	    display->columns == columns)
 		return;
 
-	display->image = resize(display, display->image,
-				display->rows, display->columns,
-				rows, columns);
+	RELEASE(display->image);
+	RELEASE(display->frame);
+	RELEASE(display->image_hash);
+	RELEASE(display->frame_hash);
+	display->image = allocate(rows * columns * sizeof *display->image);
+	display->frame = allocate(rows * columns * sizeof *display->frame);
+	display->image_hash = allocate(rows * sizeof *display->image_hash);
+	display->frame_hash = allocate(rows * sizeof *display->frame_hash);
 	display->rows = rows;
 	display->columns = columns;
 	display->size_changed = TRUE;
-	display_erase(display, 0, 0, rows, columns);
+	default_colors(display);
+	outs(display, CTL_ERASEALL);
+	space_fill(display, 0, rows, 0, columns);
 	display_cursor(display, display->cursor_row, display->cursor_column);
 	if (display->get_initial_cursor_position == KNOWN)
 		display->get_initial_cursor_position = INVALID;
@@ -600,6 +1321,10 @@ static void geometry(struct display *display)
 	const char *p;
 	unsigned n;
 
+	if (display->sink) {
+		set_geometry(display, display->rows, display->columns);
+		return;
+	}
 #ifdef TIOCGWINSZ
 	if (!ioctl(1, TIOCGWINSZ, &ws)) {
 		rows = ws.ws_row;
@@ -623,6 +1348,7 @@ static void geometry(struct display *display)
 			columns = 80;
 		force_moveto(display, 666, 666);
 		outs(display, CTL_CURSORPOS);
+		display->size_sought = TRUE;
 	}
 	set_geometry(display, rows, columns);
 }
@@ -636,7 +1362,9 @@ void display_get_geometry(struct display *display, int *rows, int *columns)
 
 void display_reset(struct display *display)
 {
+	drain(display);
 	RELEASE(display->image);
+	RELEASE(display->frame);
 	if (display->is_xterm) {
 		if (display->get_initial_cursor_position == NEEDED) {
 			display->get_initial_cursor_position = SOUGHT;
@@ -656,20 +1384,37 @@ void display_reset(struct display *display)
 	if (display->is_linux)
 		outs(display, CTL_NUMLOCK CTL_CLEARLEDS CTL_NUMLOCKLED);
 	display->colors = 0;
+	memset(display->sgr, 0, sizeof display->sgr);
 	display->fgrgba = BAD_RGBA;
 	display->bgrgba = BAD_RGBA;
 	geometry(display);
 	force_moveto(display, 0, 0);
+	display->can_repeat = display->can_sync = FALSE;
+	display->can_margin = FALSE;
+	display->can_region = display->is_xterm || display->is_linux;
+	if (display->is_xterm) {
+		/* Does REP work?  The cursor will be reported in
+		 * column 3 if it does, and 2 if it doesn't.
+		 */
+		display->repeat_probe = SOUGHT;
+		outs(display, " " CSI "b" CTL_CURSORPOS);
+		force_moveto(display, 0, 0);
+		/* Frames are synchronized only if the terminal
+		 * answers that it knows mode 2026.
+		 */
+		outs(display, CTL_QUERYSYNC CTL_QUERYMARGINS CTL_PASTEMODE);
+	}
 	display->cursor_row = display->cursor_column = 0;
 	display->cursor_rgba = BAD_RGBA;
 	flush(display);
 }
 
+/* The new size is fetched at the next display_sync(), not in
+ * the handler, which could interrupt the output buffer's growth.
+ */
 static void sigwinch(int signo, siginfo_t *info, void *data)
 {
-	struct display *display;
-	for (display = display_list; display; display = display->next)
-		geometry(display);
+	winched = 1;
 	if (old_sigwinch)
 		old_sigwinch(signo, info, data);
 }
@@ -685,6 +1430,15 @@ void cfmakeraw(struct termios *termios)
 }
 #endif
 
+/* Terminals that take 24-bit colors say so in $COLORTERM. */
+static Boolean_t direct_color(void)
+{
+	const char *colorterm = getenv("COLORTERM");
+
+	return colorterm && (!strcmp(colorterm, "truecolor") ||
+			     !strcmp(colorterm, "24bit"));
+}
+
 struct display *display_init(void)
 {
 	struct display *display = allocate0(sizeof *display);
@@ -723,6 +1477,33 @@ struct display *display_init(void)
 		display->is_linux = !strcmp(term, "linux") ||
 				    !strcmp(term, "network");
 	}
+	display->can_rgb = display->is_xterm && !display->is_apple &&
+			   direct_color();
+	display_reset(display);
+	render_start(display);
+	return display;
+}
+
+/* A headless display emulates an xterm of a fixed size whose
+ * output goes to a sink; the replies to its queries are handed
+ * back with display_input().  It serves to measure and check
+ * the display without a terminal.
+ */
+struct display *display_headless(int rows, int columns,
+				 void (*sink)(void *, const struct iovec *,
+					      int),
+				 void *arg)
+{
+	struct display *display = allocate0(sizeof *display);
+
+	display->rows = rows;
+	display->columns = columns;
+	display->is_xterm = TRUE;
+	display->can_rgb = direct_color();
+	display->sink = sink;
+	display->sink_arg = arg;
+	display->next = display_list;
+	display_list = display;
 	display_reset(display);
 	return display;
 }
@@ -734,10 +1515,14 @@ void display_end(struct display *display)
 	if (!display)
 		return;
 
+	render_stop(display);
 	display_title(display, NULL);
 	default_colors(display);
 	if (display->is_xterm) {
-		outs(display, CTL_ERASEALL
+		if (display->can_margin)
+			outs(display, CTL_NOMARGINMODE);
+		outs(display, CTL_NOPASTEMODE
+			      CTL_ERASEALL
 			      CTL_RESETMODES
 			      CTL_RESETCOLORS
 			      XTERM_REGSCREEN);
@@ -750,9 +1535,15 @@ void display_end(struct display *display)
 		outs(display, CTL_RESET CTL_RESETMODES);
 	flush(display);
 
-	tcsetattr(1, TCSADRAIN, &original_termios);
+	if (!display->sink)
+		tcsetattr(1, TCSADRAIN, &original_termios);
 
 	RELEASE(display->image);
+	RELEASE(display->frame);
+	RELEASE(display->image_hash);
+	RELEASE(display->frame_hash);
+	RELEASE(display->outbuf);
+	RELEASE(display->paste);
 
 	for (d = display_list; d; prev = d, d = d->next)
 		if (d == display) {
@@ -782,6 +1573,7 @@ Boolean_t display_title(struct display *display, const char *title)
 		display->title = strdup(title);
 	else
 		title = "";
+	drain(display);
 	outf(display, XTERM_TITLE, title ? title : "");
 	return TRUE;
 }
@@ -807,6 +1599,7 @@ Boolean_t display_cursor_color(struct display *display, rgba_t rgba)
 	    rgba & 0xff /* no alpha */)
 		return FALSE;
 	if (rgba != display->cursor_rgba) {
+		drain(display);
 		outf(display, CTL_CURSORRGB,
 		     rgba >> 24, rgba >> 16 & 0xff, rgba >> 8 & 0xff);
 		display->cursor_rgba = rgba;
@@ -816,10 +1609,102 @@ Boolean_t display_cursor_color(struct display *display, rgba_t rgba)
 
 void display_beep(struct display *display)
 {
-	emit("\a", 1);
+	drain(display);
+	out(display, "\a", 1);
 	display_sync(display);
 }
 
+/* Queues bytes as if they had been read from the terminal,
+ * as many as fit, and returns how many did.
+ */
+size_t display_input(struct display *display, const char *str, size_t bytes)
+{
+	size_t room = sizeof display->inbuf - 1 - display->inbuf_bytes;
+
+	if (bytes > room)
+		bytes = room;
+	memcpy(display->inbuf + display->inbuf_bytes, str, bytes);
+	display->inbuf[display->inbuf_bytes += bytes] = '\0';
+	return bytes;
+}
+
+/* Moves the text of a bracketed paste from the input buffer to the
+ * paste buffer, holding back what might be the start of its closing
+ * marker, and returns TRUE once that marker has been consumed.  A
+ * paste that has "stalled" ends with whatever has arrived, lest a
+ * lost marker swallow every later keystroke.
+ */
+static Boolean_t paste_collect(struct display *display, Boolean_t stalled)
+{
+	static const char end[] = CTL_PASTEEND;
+	size_t bytes = display->inbuf_bytes, used, j;
+	Boolean_t ended = stalled;
+
+	for (j = 0; !stalled && j < display->inbuf_bytes; j++) {
+		if (display->inbuf[j] != ESCCHAR)
+			continue;
+		used = display->inbuf_bytes - j;
+		if (used > sizeof end - 1)
+			used = sizeof end - 1;
+		if (!memcmp(display->inbuf + j, end, used)) {
+			bytes = j;
+			ended = used == sizeof end - 1;
+			break;
+		}
+	}
+	if (display->paste_bytes + bytes > display->paste_alloc) {
+		display->paste_alloc = (display->paste_bytes + bytes) * 3 / 2;
+		display->paste = reallocate(display->paste,
+					    display->paste_alloc);
+	}
+	memcpy(display->paste + display->paste_bytes, display->inbuf, bytes);
+	display->paste_bytes += bytes;
+	if (ended) {
+		if (!stalled)
+			bytes += sizeof end - 1;
+		display->pasting = FALSE;
+	}
+	memmove(display->inbuf, display->inbuf + bytes,
+		display->inbuf_bytes -= bytes);
+	display->inbuf[display->inbuf_bytes] = '\0';
+	return ended;
+}
+
+/* TRUE when no input has arrived for a while */
+static Boolean_t paused(unsigned seconds)
+{
+	fd_set fds;
+	struct timeval tv;
+
+	FD_ZERO(&fds);
+	FD_SET(0, &fds);
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	return !select(1, &fds, NULL, NULL, &tv);
+}
+
+/* Hands over the text of the last bracketed paste, with its line
+ * endings made newlines; the caller releases it.
+ */
+char *display_paste(struct display *display, size_t *bytes)
+{
+	char *text = display->paste;
+	size_t j, k;
+
+	*bytes = 0;
+	if (!text)
+		return NULL;
+	for (j = k = 0; j < display->paste_bytes; j++)
+		if (text[j] != '\r')
+			text[k++] = text[j];
+		else if (j + 1 == display->paste_bytes || text[j+1] != '\n')
+			text[k++] = '\n';
+	*bytes = k;
+	display->paste = NULL;
+	display->paste_bytes = display->paste_alloc = 0;
+	return text;
+}
+
 Unicode_t display_getch(struct display *display, Boolean_t block)
 {
 	Byte_t *p;
@@ -827,17 +1712,36 @@ Unicode_t display_getch(struct display *display, Boolean_t block)
 	unsigned used, vals, val[16];
 
 #define GOT_CURSORPOS FUNCTION_F(99)
+#define GOT_MODE FUNCTION_F(98)
+#define GOT_PASTE FUNCTION_F(97)
 
 	if (!display)
 		return ERROR_EOF;
 
-again:	if (display->size_changed)
+again:	if (winched) {
+		winched = 0;
+		drain(display);
+		geometry(display);
+	}
+	if (display->size_changed)
 		return ERROR_CHANGED;
-	display_sync(display);
+	/* A poll doesn't end the frame; what's been queued
+	 * goes out with the repainting that follows it.
+	 */
+	if (display->pasting) {
+		/* What arrived along with the opening marker
+		 * is collected before any wait for more.
+		 */
+		if (display->inbuf_bytes && paste_collect(display, FALSE) ||
+		    block && paused(PASTE_PAUSE) &&
+		    paste_collect(display, TRUE))
+			return FUNCTION_PASTE;
+	} else if (block)
+		display_sync(display);
 	if (display->inbuf_bytes >= sizeof display->inbuf - 1)
 		;
 	else if (!multiplexor(block)) {
-		if (!display->inbuf_bytes)
+		if (!display->inbuf_bytes || display->pasting)
 			return ERROR_EMPTY;
 	} else {
 		int n;
@@ -861,6 +1765,12 @@ again:	if (display->size_changed)
 		display->inbuf[display->inbuf_bytes += n] = '\0';
 	}
 
+	if (display->pasting) {
+		if (paste_collect(display, FALSE))
+			return FUNCTION_PASTE;
+		goto again;
+	}
+
 	p = display->inbuf;
 	key = *p;
 	if (key != ESCCHAR) {
@@ -882,7 +1792,9 @@ again:	if (display->size_changed)
 	switch (p[1]) {
 
 	case '[':
-		for (p += 2; isdigit(*p); p++) {
+		if (*(p += 2) == '?')
+			p++;  /* private mode report */
+		for (; isdigit(*p); p++) {
 			val[vals] = 0;
 			do {
 				val[vals] *= 10;
@@ -899,6 +1811,17 @@ again:	if (display->size_changed)
 			if (vals >= 2)
 				key = GOT_CURSORPOS;
 			break;
+		case '$': /* mode report */
+			if (!p[1]) {
+				if (!block)
+					return ERROR_EMPTY;
+				goto again;
+			}
+			if (p[1] == 'y' && vals >= 2) {
+				key = GOT_MODE;
+				p++;
+			}
+			break;
 		case '~':
 			if (!val[0])
 				break;
@@ -915,6 +1838,7 @@ again:	if (display->size_changed)
 			case 21: key = FUNCTION_F(10);	break;
 	/*pmk?*/	case 22: key = FUNCTION_F(11);	break;
 			case 24: key = FUNCTION_F(12);	break;
+			case 200: key = GOT_PASTE;	break;
 			}
 			break;
 		case 'A': key = FUNCTION_UP;	break;
@@ -987,15 +1911,41 @@ again:	if (display->size_changed)
 
 done:	used = ++p - display->inbuf;
 	memmove(display->inbuf, p, display->inbuf_bytes -= used);
+	if (key == GOT_PASTE) {
+		/* The text is collected until the closing marker. */
+		display->pasting = TRUE;
+		display->paste_bytes = 0;
+		goto again;
+	}
+	if (key == GOT_CURSORPOS || key == GOT_MODE)
+		drain(display);
 	if (key == GOT_CURSORPOS) {
+		/* Reports arrive in the order of the queries. */
 		if (display->get_initial_cursor_position == SOUGHT &&
 		    val[0] > 0 && val[1] > 0) {
 			display->get_initial_cursor_position = KNOWN;
 			display->initial_row = val[0] - 1;
 			display->initial_column = val[1] - 1;
+		} else if (display->size_sought) {
+			display->size_sought = FALSE;
+			set_geometry(display, val[0], val[1]);
+		} else if (display->repeat_probe == SOUGHT) {
+			display->repeat_probe = KNOWN;
+			display->can_repeat = val[1] == 3;
 		} else
 			set_geometry(display, val[0], val[1]);
 		goto again;
 	}
+	if (key == GOT_MODE) {
+		/* set or reset, not unknown or permanent */
+		if (val[0] == 2026)
+			display->can_sync = val[1] == 1 || val[1] == 2;
+		else if (val[0] == 69 && (val[1] == 1 || val[1] == 2) &&
+			 !display->can_margin) {
+			outs(display, CTL_MARGINMODE);
+			display->can_margin = TRUE;
+		}
+		goto again;
+	}
 	return key;
 }
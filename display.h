@@ -7,8 +7,13 @@
 extern struct termios original_termios;
 
 struct display;
+struct iovec;
 
 struct display *display_init(void);
+struct display *display_headless(int rows, int columns,
+				 void (*sink)(void *, const struct iovec *,
+					      int),
+				 void *arg);
 void display_reset(struct display *);
 void display_end(struct display *);
 void display_get_geometry(struct display *, int *rows, int *columns);
@@ -20,12 +25,16 @@ void display_put(struct display *, int row, int column,
 void display_beep(struct display *);
 void display_sync(struct display *);
 
-/* display_getch() implies a display_sync().
+/* A blocking display_getch() implies a display_sync().
  *
  * Once ERROR_CHANGED is returned after a window size change,
  * it will continue to be returned until display_get_geometry() is called
  */
 Unicode_t display_getch(struct display *, Boolean_t block);
+size_t display_input(struct display *, const char *, size_t);
+
+/* The text of a bracketed paste, after FUNCTION_PASTE; release it */
+char *display_paste(struct display *, size_t *bytes);
 
 /* hints */
 void display_erase(struct display *, int row, int column,
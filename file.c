@@ -125,7 +125,7 @@ static void grab_mtime(struct text *text)
 		text->mtime = 0;
 }
 
-static void scan(struct view *view)
+void view_scan(struct view *view)
 {
 	char *raw, scratch[8];
 	position_t at;
@@ -177,11 +177,63 @@ static void scan(struct view *view)
 	}
 }
 
+/*
+ *	Compressed files are recognized by their magic numbers and
+ *	streamed into their texts through a decompressor in the
+ *	background.  Saving them pipes the new content back through
+ *	the corresponding compressor.
+ */
+static struct compressor {
+	const char *magic;
+	size_t magic_bytes;
+	const char *decompress[4], *compress[4];
+} compressors[] = {
+	{ "\x1f\x8b", 2, { "gzip", "-dc", NULL }, { "gzip", "-c", NULL } },
+	{ "\xfd" "7zXZ", 6, { "xz", "-dc", NULL }, { "xz", "-c", NULL } },
+	{ "\x28\xb5\x2f\xfd", 4, { "zstd", "-dcq", NULL },
+				   { "zstd", "-cq", NULL } },
+	{ }
+};
+
+static struct compressor *compression(fd_t fd)
+{
+	char magic[8];
+	ssize_t got = pread(fd, magic, sizeof magic, 0);
+	struct compressor *c;
+
+	for (c = compressors; c->magic; c++)
+		if (got >= (ssize_t) c->magic_bytes &&
+		    !memcmp(magic, c->magic, c->magic_bytes))
+			return c;
+	return NULL;
+}
+
+static Boolean_t load_compressed(struct view *view, struct compressor *c)
+{
+	struct text *text = view->text;
+	fd_t fd;
+
+	errno = 0;
+	if ((fd = open(text->path, O_RDONLY)) < 0) {
+		message("%s: can't open", path_format(text->path));
+		return FALSE;
+	}
+	text->buffer = buffer_create(text->path);
+	if (!text_load_command(view, c->decompress, fd)) {
+		close(fd);
+		return FALSE;
+	}
+	close(fd);
+	text->compressor = c->compress;
+	return TRUE;
+}
+
 struct view *view_open(const char *path0)
 {
 	struct view *view;
 	struct text *text;
 	struct stat statbuf;
+	struct compressor *compressor;
 	char *path = fix_path(path0);
 
 	if (!path)
@@ -234,8 +286,13 @@ struct view *view_open(const char *path0)
 				goto fail;
 			}
 		}
-		clean_mmap(text, statbuf.st_size, PROT_READ);
-		if (!text->clean) {
+		if ((compressor = compression(text->fd))) {
+			if (!load_compressed(view, compressor))
+				goto fail;
+			grab_mtime(text);
+		} else
+			clean_mmap(text, statbuf.st_size, PROT_READ);
+		if (!text->clean && !text->buffer) {
 			text->buffer = buffer_create(path);
 			if (old_fashioned_read(text) < 0)
 				goto fail;
@@ -243,7 +300,7 @@ struct view *view_open(const char *path0)
 		}
 		view->bytes = text->buffer ? buffer_bytes(text->buffer) :
 					     text->clean_bytes;
-		scan(view);
+		view_scan(view);
 		text_forget_undo(text);
 	}
 	goto done;
@@ -343,6 +400,7 @@ Boolean_t text_rename(struct text *text, const char *path0)
 	text->flags |= TEXT_SAVED_ORIGINAL;
 	text->flags &= ~TEXT_RDONLY;
 	text_dirty(text);
+	text_hash_forget_saved(text);
 	close(text->fd);
 	if (text->clean) {
 		munmap(text->clean, text->clean_bytes);
@@ -360,6 +418,8 @@ Boolean_t text_rename(struct text *text, const char *path0)
 
 void text_dirty(struct text *text)
 {
+	Boolean_t saved = text->preserved == text->dirties;
+
 	if (text->path && !text->dirties && text->flags & TEXT_RDONLY)
 		message("%s: read-only, %s",
 			path_format(text->path),
@@ -373,6 +433,8 @@ void text_dirty(struct text *text)
 				      text->clean_bytes);
 		grab_mtime(text);
 	}
+	if (!text->hashes)
+		text_hash_build(text, saved);
 }
 
 static void save_original(struct text *text)
@@ -409,7 +471,102 @@ Boolean_t text_is_dirty(struct text *text)
 {
 	return	text->preserved != text->dirties &&
 		text->fd >= 0 &&
-		text->buffer;
+		text->buffer &&
+		!text_hash_is_saved(text);
+}
+
+/*
+ *	Writes a new version of a file beside it, as path+, and renames
+ *	it into place, so that the old file remains intact until the new
+ *	one is complete.  The old file is kept as path~ if asked.  A
+ *	symbolic link is resolved first, so that its target is the file
+ *	that's rewritten and the link stays in place.
+ */
+Boolean_t file_rewrite(const char *path, const struct stat *statbuf,
+		       Boolean_t (*writer)(fd_t, void *), void *arg,
+		       Boolean_t keep_original)
+{
+	char *real_path = realpath(path, NULL), *new_path, *save_path;
+	Boolean_t ok = FALSE;
+	fd_t fd;
+
+	if (real_path)
+		path = real_path;
+	new_path = allocate(strlen(path) + 2);
+	sprintf(new_path, "%s+", path);
+	errno = 0;
+	fd = open(new_path, O_CREAT|O_TRUNC|O_WRONLY,
+		  S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0) {
+		message("%s: can't create", path_format(new_path));
+		goto done;
+	}
+	if (statbuf)
+		fchmod(fd, statbuf->st_mode & 07777);
+	ok = writer(fd, arg);
+	if (close(fd))
+		ok = FALSE;
+	if (!ok) {
+		unlink(new_path);
+		goto done;
+	}
+	if (keep_original) {
+		save_path = allocate(strlen(path) + 2);
+		sprintf(save_path, "%s~", path);
+		unlink(save_path);
+		errno = 0;
+		if (link(path, save_path))
+			message("%s: can't save original text",
+				path_format(save_path));
+		RELEASE(save_path);
+	}
+	errno = 0;
+	if (rename(new_path, path)) {
+		message("%s: can't replace", path_format(path));
+		unlink(new_path);
+		ok = FALSE;
+	}
+done:	RELEASE(new_path);
+	RELEASE(real_path);
+	return ok;
+}
+
+static Boolean_t compress(fd_t fd, void *arg)
+{
+	struct text *text = arg;
+	char *raw;
+	size_t bytes = buffer_raw(text->buffer, &raw, 0, ~(size_t)0);
+
+	if (filter_write(text->compressor, raw, bytes, fd))
+		return TRUE;
+	message("%s: %s failed", path_format(text->path),
+		text->compressor[0]);
+	return FALSE;
+}
+
+static void preserve_compressed(struct text *text)
+{
+	struct stat statbuf;
+	Boolean_t keep;
+	fd_t fd;
+
+	if (text_hash_is_saved(text))
+		return;
+	keep = !no_save_originals &&
+	       !(text->flags & (TEXT_SAVED_ORIGINAL | TEXT_CREATED));
+	if (!file_rewrite(text->path,
+			  fstat(text->fd, &statbuf) ? NULL : &statbuf,
+			  compress, text, keep))
+		return;
+	if (keep)
+		text->flags |= TEXT_SAVED_ORIGINAL;
+	if ((fd = open(text->path, O_RDWR)) >= 0) {
+		close(text->fd);
+		text->fd = fd;
+	}
+	text->flags &= ~TEXT_CREATED;
+	grab_mtime(text);
+	text_hash_saved(text);
 }
 
 void text_preserve(struct text *text)
@@ -422,15 +579,18 @@ void text_preserve(struct text *text)
 	    text->fd < 0 ||
 	    !text->buffer)
 		return;
+	if (text->flags & TEXT_LOADING) {
+		message("%s: still loading, not saved",
+			path_format(text->path));
+		return;
+	}
 	text->preserved = ++text->dirties;
 	if (read_only)
 		return;
 	text_unfold_all(text);
 	if (text->clean) {
 		save_original(text);
-		bytes = buffer_raw(text->buffer, &raw, 0, ~(size_t)0);
-		if (bytes == text->clean_bytes &&
-		    !memcmp(text->clean, raw, bytes))
+		if (text_hash_is_saved(text))
 			return;
 		munmap(text->clean, text->clean_bytes);
 		text->clean = NULL;
@@ -438,10 +598,12 @@ void text_preserve(struct text *text)
 	if (text->mtime &&
 	    text->path &&
 	    !fstat(text->fd, &statbuf) &&
-	    text->mtime < statbuf.st_mtime)
+	    text->mtime < statbuf.st_mtime) {
 		message("%s: modified since read into the "
 			"editor, changes may have been overwritten.",
 			path_format(text->path));
+		text_hash_forget_saved(text);
+	}
 	text->preserved = ++text->dirties;
 	if (text->flags & TEXT_RDONLY && text->path && make_writable) {
 		char cmd[128];
@@ -474,6 +636,11 @@ void text_preserve(struct text *text)
 		RELEASE(text->path);
 		text->fd = newfd;
 		text->path = new_path;
+		text_hash_forget_saved(text);
+	}
+	if (text->compressor) {
+		preserve_compressed(text);
+		return;
 	}
 	text->flags &= ~TEXT_CREATED;
 	bytes = buffer_raw(text->buffer, &raw, 0, ~(size_t)0);
@@ -481,8 +648,11 @@ void text_preserve(struct text *text)
 		message("%s: truncation failed", path_format(text->path));
 	clean_mmap(text, bytes, PROT_READ|PROT_WRITE);
 	if (text->clean) {
-		memcpy(text->clean, raw, bytes);
+		/* Only the chunks that differ from the file are copied. */
+		if (!text_hash_refresh(text, text->clean, raw))
+			memcpy(text->clean, raw, bytes);
 		msync(text->clean, bytes, MS_SYNC);
+		text_hash_saved(text);
 	} else {
 		ssize_t wrote;
 		lseek(text->fd, 0, SEEK_SET);
@@ -490,6 +660,8 @@ void text_preserve(struct text *text)
 		wrote = write(text->fd, raw, bytes);
 		if (wrote != bytes)
 			message("%s: write failed", path_format(text->path));
+		else
+			text_hash_saved(text);
 	}
 	grab_mtime(text);
 }
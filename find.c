@@ -414,18 +414,12 @@ unsigned find_column(unsigned *row, struct view *view, position_t at,
 sposition_t find_string(struct view *view, const char *string,
 			position_t offset)
 {
-	const Byte_t *ustring = (const Byte_t *) string;
-	unsigned first = *ustring, j;
-	Unicode_t ch;
-
-	for (; IS_UNICODE(ch = view_byte(view, offset)); offset++) {
-		if (ch != first)
-			continue;
-		for (j = 1; (ch = ustring[j]); j++)
-			if (ch != view_byte(view, offset+j))
-				break;
-		if (!ch)
-			return offset;
-	}
-	return -1;
+	struct literal *literal = literal_create(string, strlen(string), FALSE);
+	struct spans spans;
+	sposition_t at;
+
+	view_spans(view, &spans);
+	at = literal_find(literal, &spans, offset, view->bytes);
+	literal_destroy(literal);
+	return at;
 }
@@ -0,0 +1,756 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+/*
+ *	Fuzzy file finder.  ^Space@ opens a "* Files *" view of the
+ *	files under the current directory whose paths contain the
+ *	characters typed since as a subsequence, best matches first.
+ *	The forward and backward commands move among them, Return opens
+ *	one in place of the list, and any other command leaves it.
+ *
+ *	The paths come from an index of the tree that's built once per
+ *	session by a pool of threads walking its directories, and saved
+ *	in ~/.aoeui so that the next session can start with it while
+ *	the tree is walked afresh in the background.  On Linux, inotify
+ *	watches the directories that were walked (up to MAX_WATCHES of
+ *	them) so that files that come and go are noticed without walking
+ *	again; directories that arrive are handed to the walkers.
+ *
+ *	Each path's entry carries a mask of the characters in it, kept
+ *	apart from the paths in one dense array, so that most paths
+ *	are rejected by a loop of AND and compare operations that the
+ *	compiler can vectorize before any of them is scored.
+ */
+
+#define FILES "* Files *"
+#define MAX_THREADS 16
+#define SHOWN 200
+#define MAX_WATCHES 4096	/* leaves most of the user's inotify quota */
+
+struct index {
+	char **path;
+	unsigned long long *mask;	/* characters present in a path */
+	unsigned paths, alloc;
+};
+
+struct dir {
+	struct dir *next;
+	char *path;
+	Boolean_t rescan;	/* came and went while watched */
+};
+
+struct watch {
+	int wd;
+	char *path;
+};
+
+struct mode_finder {
+	command command;
+	rgba_t selection_bgrgba;
+	struct mode *previous;
+	char *query;
+	size_t bytes, alloc;
+};
+
+static struct index files;		/* what's shown */
+static Boolean_t indexed, dirty, walking;
+
+/* Shared with the walkers */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_t thread[MAX_THREADS];
+static unsigned threads, running, busy;
+static struct dir *dirs;
+static struct index walked, found;	/* by the walk, by rescans */
+static fd_t wake = -1;
+static fd_t notify = -1;
+static struct watch *watch;
+static unsigned watches, watch_alloc;
+
+static struct view *finder;	/* the view in finder mode, if any */
+
+static unsigned long long mask_of(const char *path)
+{
+	unsigned long long mask = 0;
+
+	for (; *path; path++)
+		mask |= 1ull << (tolower((Byte_t) *path) & 63);
+	return mask;
+}
+
+static void index_add(struct index *index, const char *path)
+{
+	if (index->paths == index->alloc) {
+		index->alloc = index->alloc * 2 + 1024;
+		index->path = reallocate(index->path,
+					 index->alloc * sizeof *index->path);
+		index->mask = reallocate(index->mask,
+					 index->alloc * sizeof *index->mask);
+	}
+	index->path[index->paths] = strdup(path);
+	index->mask[index->paths++] = mask_of(path);
+}
+
+/* Removes a path and everything under it. */
+static void index_remove(struct index *index, const char *path)
+{
+	size_t len = strlen(path);
+	unsigned j, k;
+
+	for (j = k = 0; j < index->paths; j++)
+		if (!strncmp(index->path[j], path, len) &&
+		    (!index->path[j][len] || index->path[j][len] == '/'))
+			RELEASE(index->path[j]);
+		else {
+			index->path[k] = index->path[j];
+			index->mask[k++] = index->mask[j];
+		}
+	index->paths = k;
+}
+
+static void index_destroy(struct index *index)
+{
+	unsigned j;
+
+	for (j = 0; j < index->paths; j++)
+		RELEASE(index->path[j]);
+	RELEASE(index->path);
+	RELEASE(index->mask);
+	memset(index, 0, sizeof *index);
+}
+
+static Boolean_t ignored(const char *name)
+{
+	size_t len = strlen(name);
+	return *name == '.' || name[len-1] == '#' || name[len-1] == '~';
+}
+
+static char *join(const char *dir, const char *name)
+{
+	char *path = allocate(strlen(dir) + strlen(name) + 2);
+
+	if (*dir)
+		sprintf(path, "%s/%s", dir, name);
+	else
+		strcpy(path, name);
+	return path;
+}
+
+/* Watches a directory; the caller holds the lock. */
+static void watch_dir(const char *path)
+{
+#ifdef __linux__
+	int wd;
+
+	if (notify < 0 || watches >= MAX_WATCHES)
+		return;
+	wd = inotify_add_watch(notify, *path ? path : ".",
+			       IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+			       IN_MOVED_TO | IN_ONLYDIR);
+	if (wd < 0)
+		return;
+	if (watches == watch_alloc) {
+		watch_alloc = watch_alloc * 2 + 64;
+		watch = reallocate(watch, watch_alloc * sizeof *watch);
+	}
+	watch[watches].wd = wd;
+	watch[watches++].path = strdup(path);
+#endif
+}
+
+/* The caller holds the lock. */
+static void push_dir(const char *path, Boolean_t rescan)
+{
+	struct dir *dir = allocate(sizeof *dir);
+
+	dir->path = strdup(path);
+	dir->rescan = rescan;
+	dir->next = dirs;
+	dirs = dir;
+	pthread_cond_signal(&work);
+}
+
+/* Lists one directory's files into an index and queues its
+ * subdirectories for the walkers; symbolic links to directories
+ * aren't followed.
+ */
+static void walk(const char *path, Boolean_t rescan)
+{
+	struct index *index = rescan ? &found : &walked;
+	DIR *dir = opendir(*path ? path : ".");
+	struct dirent *dent;
+	struct stat statbuf;
+	char *full;
+	Boolean_t is_dir;
+
+	if (!dir)
+		return;
+	pthread_mutex_lock(&lock);
+	watch_dir(path);
+	pthread_mutex_unlock(&lock);
+	while ((dent = readdir(dir))) {
+		if (ignored(dent->d_name))
+			continue;
+		full = join(path, dent->d_name);
+#ifdef DT_DIR
+		if (dent->d_type == DT_DIR || dent->d_type == DT_REG)
+			is_dir = dent->d_type == DT_DIR;
+		else
+#endif
+		if (!lstat(full, &statbuf) && S_ISDIR(statbuf.st_mode))
+			is_dir = TRUE;
+		else if (!stat(full, &statbuf) && S_ISREG(statbuf.st_mode))
+			is_dir = FALSE;
+		else {
+			RELEASE(full);
+			continue;
+		}
+		pthread_mutex_lock(&lock);
+		if (is_dir)
+			push_dir(full, rescan);
+		else
+			index_add(index, full);
+		pthread_mutex_unlock(&lock);
+		RELEASE(full);
+	}
+	closedir(dir);
+}
+
+static void *walker(void *arg)
+{
+	struct dir *dir;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!dirs && busy)
+			pthread_cond_wait(&work, &lock);
+		if (!dirs)
+			break;
+		dir = dirs;
+		dirs = dir->next;
+		busy++;
+		pthread_mutex_unlock(&lock);
+		walk(dir->path, dir->rescan);
+		pthread_mutex_lock(&lock);
+		if (dir->rescan && write(wake, "", 1) < 0)
+			; /* the pipe is full, which is just as good */
+		RELEASE(dir->path);
+		RELEASE(dir);
+		busy--;
+	}
+	pthread_cond_broadcast(&work);
+	if (!--running) {
+		close(wake);
+		wake = -1;
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* The index is saved under a name derived from the directory. */
+static char *index_path(void)
+{
+	char cwd[1024];
+	const char *home = getenv("HOME"), *p;
+	unsigned hash = 2166136261u;
+	char *path;
+
+	if (!home || !getcwd(cwd, sizeof cwd))
+		return NULL;
+	for (p = cwd; *p; p++)
+		hash = (hash ^ (Byte_t) *p) * 16777619u;
+	path = allocate(strlen(home) + 32);
+	sprintf(path, "%s/.aoeui/files-%08x", home, hash);
+	return path;
+}
+
+/* The first line of a saved index names its directory. */
+static void index_load(void)
+{
+	char *path = index_path(), *line = NULL, cwd[1024];
+	size_t alloc = 0;
+	ssize_t len;
+	FILE *fp;
+
+	if (!path || !getcwd(cwd, sizeof cwd) || !(fp = fopen(path, "r"))) {
+		RELEASE(path);
+		return;
+	}
+	if ((len = getline(&line, &alloc, fp)) > 0 &&
+	    line[len-1] == '\n' && (line[len-1] = '\0', !strcmp(line, cwd)))
+		while ((len = getline(&line, &alloc, fp)) > 0) {
+			if (line[len-1] == '\n')
+				line[--len] = '\0';
+			if (len)
+				index_add(&files, line);
+		}
+	free(line);
+	fclose(fp);
+	RELEASE(path);
+}
+
+static void index_save(void)
+{
+	char *path = index_path(), *temp, cwd[1024];
+	unsigned j;
+	FILE *fp;
+
+	dirty = FALSE;
+	if (!path || !getcwd(cwd, sizeof cwd)) {
+		RELEASE(path);
+		return;
+	}
+	temp = allocate(strlen(path) + 2);
+	strcpy(temp, path);
+	*strrchr(temp, '/') = '\0';
+	mkdir(temp, S_IRUSR|S_IWUSR|S_IXUSR);
+	sprintf(temp, "%s#", path);
+	if ((fp = fopen(temp, "w"))) {
+		fprintf(fp, "%s\n", cwd);
+		for (j = 0; j < files.paths; j++)
+			fprintf(fp, "%s\n", files.path[j]);
+		if (fclose(fp) || rename(temp, path))
+			unlink(temp);
+	}
+	RELEASE(temp);
+	RELEASE(path);
+}
+
+static void show(struct view *, Boolean_t keep);
+static void start_walkers(void);
+
+static int by_path(const void *x, const void *y)
+{
+	return strcmp(*(char * const *) x, *(char * const *) y);
+}
+
+/* What rescans have found joins the index, and the walk's too if
+ * it's still under way; the caller holds the lock.
+ */
+static void gather_found(void)
+{
+	unsigned j;
+
+	for (j = 0; j < found.paths; j++) {
+		index_add(&files, found.path[j]);
+		if (walking)
+			index_add(&walked, found.path[j]);
+	}
+	if (found.paths)
+		dirty = TRUE;
+	index_destroy(&found);
+}
+
+/* A rescan is done, or all of the walkers are.  The walk's index then
+ * replaces whatever was loaded; files that were also reported by
+ * inotify while it was under way may appear twice in it.
+ */
+static Boolean_t walked_activity(struct view *view, char *received,
+				 ssize_t bytes)
+{
+	unsigned j, k;
+	Boolean_t more;
+
+	if (bytes > 0) {
+		pthread_mutex_lock(&lock);
+		gather_found();
+		pthread_mutex_unlock(&lock);
+		if (finder)
+			show(finder, TRUE);
+		return TRUE;
+	}
+	for (j = 0; j < threads; j++)
+		pthread_join(thread[j], NULL);
+	threads = 0;
+	pthread_mutex_lock(&lock);
+	gather_found();
+	more = !!dirs;	/* queued as the last walker left */
+	pthread_mutex_unlock(&lock);
+	if (more)
+		start_walkers();
+	if (!walking) {
+		if (finder)
+			show(finder, TRUE);
+		return FALSE;
+	}
+	walking = FALSE;
+	index_destroy(&files);
+	qsort(walked.path, walked.paths, sizeof *walked.path, by_path);
+	for (j = k = 0; j < walked.paths; j++)
+		if (k && !strcmp(walked.path[j], walked.path[k-1]))
+			RELEASE(walked.path[j]);
+		else
+			walked.path[k++] = walked.path[j];
+	for (walked.paths = k, j = 0; j < k; j++)
+		walked.mask[j] = mask_of(walked.path[j]);
+	files = walked;
+	memset(&walked, 0, sizeof walked);
+	index_save();
+	if (finder)
+		show(finder, TRUE);
+	return FALSE;
+}
+
+#ifdef __linux__
+static const char *watched(int wd)
+{
+	unsigned j;
+
+	for (j = 0; j < watches; j++)
+		if (watch[j].wd == wd)
+			return watch[j].path;
+	return NULL;
+}
+
+/* Forgets the watches on a directory that's gone or been renamed,
+ * and on those beneath it.
+ */
+static void unwatch(const char *path, int wd)
+{
+	size_t len = path ? strlen(path) : 0;
+	unsigned j, k;
+
+	for (j = k = 0; j < watches; j++)
+		if (path ? !strncmp(watch[j].path, path, len) &&
+			   (!watch[j].path[len] || watch[j].path[len] == '/')
+			 : watch[j].wd == wd) {
+			if (path)
+				inotify_rm_watch(notify, watch[j].wd);
+			RELEASE(watch[j].path);
+		} else
+			watch[k++] = watch[j];
+	watches = k;
+}
+
+static void changed(struct index *index, const char *path,
+		    const struct inotify_event *event)
+{
+	index_remove(index, path);
+	if (event->mask & (IN_CREATE | IN_MOVED_TO))
+		if (!(event->mask & IN_ISDIR))
+			index_add(index, path);
+}
+
+static Boolean_t notify_activity(struct view *view, char *received,
+				 ssize_t bytes)
+{
+	struct inotify_event *event;
+	const char *dir;
+	char *path;
+	ssize_t at;
+	Boolean_t start = FALSE;
+
+	if (bytes <= 0)
+		return FALSE;
+	pthread_mutex_lock(&lock);
+	for (at = 0; at + (ssize_t) sizeof *event <= bytes;
+	     at += sizeof *event + event->len) {
+		event = (struct inotify_event *) (received + at);
+		if (event->mask & IN_IGNORED)
+			unwatch(NULL, event->wd);
+		if (!event->len || ignored(event->name) ||
+		    !(dir = watched(event->wd)))
+			continue;
+		path = join(dir, event->name);
+		changed(&files, path, event);
+		if (walking)
+			changed(&walked, path, event);
+		if (event->mask & IN_ISDIR) {
+			unwatch(path, 0);
+			if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+				/* A pool that's winding down starts
+				 * another once it's done. */
+				push_dir(path, TRUE);
+				start |= !threads;
+			}
+		}
+		RELEASE(path);
+		dirty = TRUE;
+	}
+	pthread_mutex_unlock(&lock);
+	if (start)
+		start_walkers();
+	if (finder)
+		show(finder, TRUE);
+	return TRUE;
+}
+#endif
+
+/* Starts a pool of walkers on the queued directories. */
+static void start_walkers(void)
+{
+	struct dir *dir;
+	fd_t fds[2];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (pipe(fds))
+		return;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	wake = fds[1];
+	multiplex_read(fds[0], NULL, walked_activity);
+	pthread_mutex_lock(&lock);
+	for (threads = 0; threads < (cpus < 1 ? 1 : cpus > MAX_THREADS ?
+				     MAX_THREADS : cpus); threads++)
+		if (thread_create(&thread[threads], walker, NULL))
+			break;
+	running = threads;
+	if (!threads) {
+		close(wake);
+		wake = -1;
+		walking = FALSE;	/* keep what was loaded */
+		while ((dir = dirs)) {
+			dirs = dir->next;
+			RELEASE(dir->path);
+			RELEASE(dir);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Walks the tree in the background, once per session. */
+static void index_build(void)
+{
+	indexed = TRUE;
+	walking = TRUE;
+	index_load();
+#ifdef __linux__
+	if ((notify = inotify_init()) >= 0) {
+		fcntl(notify, F_SETFD, FD_CLOEXEC);
+		multiplex_read(notify, NULL, notify_activity);
+	}
+#endif
+	pthread_mutex_lock(&lock);
+	push_dir("", FALSE);
+	pthread_mutex_unlock(&lock);
+	start_walkers();
+}
+
+/* Scores one greedy left-to-right match of a (folded) query as a
+ * subsequence of a path from "start"; -1 if it isn't one.  Matches
+ * that begin words or path components, continue runs, or lie in
+ * the last component count for more.
+ */
+static int greedy(const char *path, size_t start, size_t base,
+		  const char *query, size_t bytes)
+{
+	int total = 0, run = 0;
+	size_t j = 0, at;
+	Byte_t ch, prev;
+
+	for (at = start; path[at] && j < bytes; at++) {
+		ch = path[at];
+		if (tolower(ch) != (Byte_t) query[j]) {
+			run = 0;
+			continue;
+		}
+		prev = at ? path[at-1] : '/';
+		total += 1 + 2 * run++;
+		if (!isalnum(prev))
+			total += 8;
+		else if (isupper(ch) && islower(prev))
+			total += 6;
+		if (at >= base)
+			total += 4;
+		j++;
+	}
+	return j < bytes ? -1 : total;
+}
+
+static int score(const char *path, const char *query, size_t bytes)
+{
+	const char *slash = strrchr(path, '/');
+	size_t base = slash ? slash + 1 - path : 0;
+	int whole = greedy(path, 0, base, query, bytes);
+	int last = base ? greedy(path, base, base, query, bytes) : -1;
+
+	if (whole < 0)
+		return -1;
+	return (last > whole ? last : whole) * 256 - strlen(path);
+}
+
+struct ranked {
+	int score;
+	unsigned entry;
+};
+
+static int by_score(const void *x, const void *y)
+{
+	const struct ranked *a = x, *b = y;
+	if (a->score != b->score)
+		return a->score > b->score ? -1 : 1;
+	return strcmp(files.path[a->entry], files.path[b->entry]);
+}
+
+/* Lists the best matches of the query in the finder's view; "keep"
+ * leaves the cursor on the same path, if it's still listed.
+ */
+static void show(struct view *view, Boolean_t keep)
+{
+	struct mode_finder *mode = (struct mode_finder *) view->mode;
+	position_t cursor = locus_get(view, CURSOR), at = 0;
+	unsigned long long need;
+	struct ranked *rank;
+	Byte_t *hit;
+	unsigned j, ranks = 0;
+	int s;
+	char *current = NULL;
+
+	mode->query[mode->bytes] = '\0';
+	need = mask_of(mode->query);
+	hit = allocate(files.paths + 1);
+	for (j = 0; j < files.paths; j++)
+		hit[j] = (files.mask[j] & need) == need;
+	rank = allocate((files.paths + 1) * sizeof *rank);
+	for (j = 0; j < files.paths; j++)
+		if (hit[j] &&
+		    (s = score(files.path[j], mode->query, mode->bytes)) >= 0) {
+			rank[ranks].score = s;
+			rank[ranks++].entry = j;
+		}
+	RELEASE(hit);
+	qsort(rank, ranks, sizeof *rank, by_score);
+
+	if (keep) {
+		cursor = find_line_start(view, cursor);
+		current = view_extract(view, cursor,
+				       find_line_end(view, cursor) - cursor);
+	}
+	view->text->flags &= ~TEXT_RDONLY;
+	view_delete(view, 0, view->bytes);
+	for (j = 0; j < ranks && j < SHOWN; j++) {
+		if (current && !strcmp(files.path[rank[j].entry], current)) {
+			at = view->bytes;
+			RELEASE(current);
+			current = NULL;
+		}
+		view_insert(view, files.path[rank[j].entry], view->bytes, -1);
+		view_insert(view, "\n", view->bytes, 1);
+	}
+	view->text->flags |= TEXT_RDONLY;
+	RELEASE(current);
+	locus_set(view, CURSOR, at);
+	locus_set(view, MARK, UNSET);
+	status("file: %s (%u of %u)", mode->query, ranks, files.paths);
+	RELEASE(rank);
+}
+
+static void leave(struct view *view)
+{
+	struct mode_finder *mode = (struct mode_finder *) view->mode;
+
+	view->mode = mode->previous;
+	RELEASE(mode->query);
+	RELEASE(mode);
+	finder = NULL;
+	status_hide();
+	if (dirty)
+		index_save();
+}
+
+/* Return opens the file on the cursor's line in place of the list. */
+static Boolean_t open_file(struct view *view)
+{
+	position_t cursor = locus_get(view, CURSOR);
+	position_t start = find_line_start(view, cursor);
+	char *path = view_extract(view, start,
+				  find_line_end(view, cursor) - start);
+	struct view *new_view;
+
+	if (!path || !*path) {
+		RELEASE(path);
+		return FALSE;
+	}
+	new_view = view_open(path);
+	RELEASE(path);
+	if (!new_view)
+		return FALSE;
+	if (new_view->window)
+		window_activate(new_view);
+	else
+		window_replace(view, new_view);
+	view_close(view);
+	return TRUE;
+}
+
+static void command_handler(struct view *view, Unicode_t ch)
+{
+	struct mode_finder *mode = (struct mode_finder *) view->mode;
+	static char cmdchar[][2] = {
+		{ CONTROL('H'), CONTROL('G') },
+		{ CONTROL('T'), CONTROL('H') }
+	};
+	position_t cursor = locus_get(view, CURSOR);
+
+	if (ch == 0x7f /*BCK*/) {
+		if (!mode->bytes)
+			window_beep(view);
+		else {
+			mode->bytes--;
+			show(view, FALSE);
+		}
+		return;
+	}
+	if (ch >= ' ' && ch < 0x7f) {
+		if (mode->bytes + 2 > mode->alloc) {
+			mode->alloc = mode->bytes + 64;
+			mode->query = reallocate(mode->query, mode->alloc);
+		}
+		mode->query[mode->bytes++] = tolower(ch);
+		show(view, FALSE);
+		return;
+	}
+	if (ch == cmdchar[0][is_asdfg] || ch == FUNCTION_UP) {
+		locus_set(view, CURSOR,
+			  find_line_start(view, find_line_up(view, cursor)));
+		return;
+	}
+	if (ch == cmdchar[1][is_asdfg] || ch == FUNCTION_DOWN) {
+		locus_set(view, CURSOR,
+			  find_line_start(view, find_line_down(view, cursor)));
+		return;
+	}
+	leave(view);
+	if (ch == '\r') {
+		if (!open_file(view))
+			window_beep(view);
+	} else
+		view->mode->command(view, ch);
+}
+
+void mode_finder(struct view *view)
+{
+	struct mode_finder *mode;
+	struct text *text;
+	struct view *list = NULL;
+
+	if (finder)
+		return;
+	if (!indexed)
+		index_build();
+	for (text = text_list; text; text = text->next)
+		if (text->flags & TEXT_EDITOR && !strcmp(text->path, FILES))
+			list = text->views;
+	if (!list) {
+		list = text_create(FILES, TEXT_EDITOR);
+		list->text->flags |= TEXT_RDONLY;
+	}
+	if (list->window)
+		window_activate(list);
+	else
+		window_after(view, list, -1 /*auto*/);
+
+	mode = allocate0(sizeof *mode);
+	mode->command = command_handler;
+	mode->selection_bgrgba = list->mode->selection_bgrgba;
+	mode->previous = list->mode;
+	mode->alloc = 64;
+	mode->query = allocate(mode->alloc);
+	list->mode = (struct mode *) mode;
+	finder = list;
+	show(list, FALSE);
+}
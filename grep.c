@@ -0,0 +1,1108 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	Native grep.  ^Space/ looks for the selection as a literal
+ *	string (^Space* as a regular expression) in every open text and
+ *	in every file in the tree under the current directory, and lists
+ *	each matching line as "path:line:text" in a results view that
+ *	is kept sorted by path.
+ *
+ *	Open texts are searched at once, in their current content.
+ *	The rest of the tree is read and searched by a pool of worker
+ *	threads that share a stack of directories and files to visit;
+ *	read() is used rather than mmap() so that a file that's
+ *	truncated while it's being searched can't fault.  Each file's
+ *	matching lines are queued as a block and announced to the
+ *	multiplexor through a pipe, so that results appear while the
+ *	search continues.  Files that look binary or are very large,
+ *	dot-files, working files, and the files of open texts are
+ *	skipped.  Closing the results view stops the search.
+ *
+ *	^Space/ without a selection visits the "path:line:" on the
+ *	cursor's line, so it also works in shell views that ran grep -n.
+ *
+ *	^Space% replaces the hits with the clip buffer in two steps.
+ *	First, the lines still listed in the results view are shown as
+ *	they'd become in a "* Replace *" view, whose lines can be deleted
+ *	to spare them.  ^Space% there then makes the replacements on the
+ *	lines that remain: in open texts as one undoable edit apiece,
+ *	and in other files by writing a new file and renaming it over
+ *	the old one, so that a file is never left half rewritten.  A
+ *	text or file that has changed since the preview is left alone.
+ */
+
+#define RESULTS "* Grep *"
+#define REPLACEMENTS "* Replace *"
+#define MAX_THREADS 16
+#define BINARY_PROBE 4096
+#define MAX_FILE_BYTES (64 << 20)	/* larger files aren't searched */
+
+struct job {
+	struct job *next;
+	char *path;
+	Boolean_t is_dir;
+};
+
+struct hits {			/* one file's matching lines */
+	struct hits *next;
+	char *path;
+	char *lines;
+	size_t bytes, alloc;
+	unsigned count;
+};
+
+struct block {			/* one file's lines in the results view */
+	char *path;
+	size_t bytes;
+};
+
+struct target {			/* a file's listed lines */
+	char *path;
+	unsigned *line;
+	unsigned lines, alloc;
+};
+
+struct change {			/* the replacements in one file */
+	struct hits out;	/* new bytes from the first hit to the last */
+	struct replacement *rep;
+	unsigned reps, alloc;
+	unsigned lines;
+};
+
+struct file_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct stamp {			/* a previewed text's or file's state */
+	char *path;
+	struct text *text;
+	unsigned dirties;
+	time_t mtime;
+	off_t size;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_t thread[MAX_THREADS];
+static unsigned threads, running, busy;
+static Boolean_t cancel;	/* atomic */
+static struct job *jobs;
+static struct hits *hits;
+static fd_t wake = -1;
+
+/* Read-only while the workers run */
+static char *pattern;
+static size_t pattern_bytes;
+static Boolean_t regex;
+static struct literal *literal;
+static struct file_id *open_file;
+static unsigned open_files;
+
+/* Main thread only */
+static struct block *block;
+static unsigned blocks, block_alloc;
+static unsigned total_lines;
+static char *replacement;	/* pending after a preview */
+static size_t replacement_bytes;
+static struct stamp *stamp;
+static unsigned stamps;
+
+static Boolean_t cancelled(void)
+{
+	return __atomic_load_n(&cancel, __ATOMIC_SEQ_CST);
+}
+
+static void push_job(const char *dir, const char *name, Boolean_t is_dir)
+{
+	struct job *job = allocate(sizeof *job);
+
+	job->path = allocate(strlen(dir) + strlen(name) + 2);
+	if (strcmp(dir, "."))
+		sprintf(job->path, "%s/%s", dir, name);
+	else
+		strcpy(job->path, name);
+	job->is_dir = is_dir;
+	pthread_mutex_lock(&lock);
+	job->next = jobs;
+	jobs = job;
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+}
+
+static void walk(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *dent;
+	struct stat statbuf;
+	char *full;
+	size_t len;
+
+	if (!dir)
+		return;
+	while (!cancelled() && (dent = readdir(dir))) {
+		len = strlen(dent->d_name);
+		if (*dent->d_name == '.' ||
+		    dent->d_name[len-1] == '#' || dent->d_name[len-1] == '~')
+			continue;	/* hidden, or our working files */
+#ifdef DT_DIR
+		if (dent->d_type == DT_DIR) {
+			push_job(path, dent->d_name, TRUE);
+			continue;
+		}
+		if (dent->d_type == DT_REG) {
+			push_job(path, dent->d_name, FALSE);
+			continue;
+		}
+#endif
+		/* Symbolic links to directories aren't followed. */
+		full = allocate(strlen(path) + strlen(dent->d_name) + 2);
+		sprintf(full, "%s/%s", path, dent->d_name);
+		if (!lstat(full, &statbuf) && S_ISDIR(statbuf.st_mode))
+			push_job(path, dent->d_name, TRUE);
+		else if (!stat(full, &statbuf) && S_ISREG(statbuf.st_mode))
+			push_job(path, dent->d_name, FALSE);
+		RELEASE(full);
+	}
+	closedir(dir);
+}
+
+static void add_bytes(struct hits *hits, const void *data, size_t bytes)
+{
+	if (hits->bytes + bytes > hits->alloc) {
+		hits->alloc = (hits->bytes + bytes) * 2 + 256;
+		hits->lines = reallocate(hits->lines, hits->alloc);
+	}
+	memcpy(hits->lines + hits->bytes, data, bytes);
+	hits->bytes += bytes;
+}
+
+/* Copies the bytes at [from,to) out of the spans. */
+static void add_spans(struct hits *hits, const struct spans *spans,
+		      position_t from, position_t to)
+{
+	size_t n0 = spans->bytes[0];
+
+	if (from < n0)
+		add_bytes(hits, spans->data[0] + from,
+			  (to < n0 ? to : n0) - from);
+	if (to > n0)
+		add_bytes(hits, spans->data[1] + (from > n0 ? from - n0 : 0),
+			  to - (from > n0 ? from : n0));
+}
+
+/* Counts the newlines in [from,to), noting just past the last one. */
+static unsigned newlines(const struct spans *spans, position_t from,
+			 position_t to, position_t *line_start)
+{
+	unsigned j, count = 0;
+	position_t base = 0, lo, hi;
+	const Byte_t *p, *nl;
+
+	for (j = 0; j < 2; base += spans->bytes[j++]) {
+		if (to <= base)
+			break;
+		lo = from > base ? from - base : 0;
+		hi = to - base < spans->bytes[j] ? to - base : spans->bytes[j];
+		if (lo >= hi)
+			continue;
+		for (p = spans->data[j] + lo;
+		     (nl = memchr(p, '\n', spans->data[j] + hi - p));
+		     p = nl + 1) {
+			count++;
+			*line_start = base + (nl + 1 - spans->data[j]);
+		}
+	}
+	return count;
+}
+
+static position_t line_end(const struct spans *spans, position_t at)
+{
+	size_t n0 = spans->bytes[0];
+	const Byte_t *nl;
+
+	if (at < n0) {
+		if ((nl = memchr(spans->data[0] + at, '\n', n0 - at)))
+			return nl - spans->data[0];
+		at = n0;
+	}
+	if (at < n0 + spans->bytes[1] &&
+	    (nl = memchr(spans->data[1] + at - n0, '\n',
+			 spans->bytes[1] - (at - n0))))
+		return n0 + (nl - spans->data[1]);
+	return n0 + spans->bytes[1];
+}
+
+/* Lists the lines with matches; returns NULL if there aren't any. */
+static struct hits *search(const char *path, const struct spans *spans,
+			   struct regexp *regexp)
+{
+	struct hits *hits = NULL;
+	struct submatch sub[SUBMATCHES];
+	size_t bytes = spans->bytes[0] + spans->bytes[1];
+	position_t counted = 0, start = 0, end;
+	sposition_t at;
+	unsigned line = 1;
+	char prefix[32];
+
+	for (at = 0; at < bytes && !cancelled(); at = end + 1) {
+		if (regexp)
+			at = regexp_find(regexp, spans, at, bytes, sub);
+		else
+			at = literal_find(literal, spans, at, bytes);
+		if (at < 0)
+			break;
+		line += newlines(spans, counted, at, &start);
+		end = line_end(spans, at);
+		counted = end;
+		if (!hits) {
+			hits = allocate0(sizeof *hits);
+			hits->path = strdup(path);
+		}
+		add_bytes(hits, path, strlen(path));
+		sprintf(prefix, ":%u:", line);
+		add_bytes(hits, prefix, strlen(prefix));
+		add_spans(hits, spans, start, end);
+		add_bytes(hits, "\n", 1);
+		hits->count++;
+	}
+	return hits;
+}
+
+static void post(struct hits *new)
+{
+	pthread_mutex_lock(&lock);
+	new->next = hits;
+	hits = new;
+	if (write(wake, "", 1) < 0)
+		; /* the pipe is full, which is just as good */
+	pthread_mutex_unlock(&lock);
+}
+
+static Boolean_t is_open(struct stat *statbuf)
+{
+	unsigned j;
+
+	for (j = 0; j < open_files; j++)
+		if (open_file[j].dev == statbuf->st_dev &&
+		    open_file[j].ino == statbuf->st_ino)
+			return TRUE;
+	return FALSE;
+}
+
+/* Reads as much as it can of what's asked for; a file that has
+ * shrunk just comes up short.
+ */
+static size_t read_all(fd_t fd, void *data, size_t bytes)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < bytes)
+		if ((n = read(fd, (char *) data + got, bytes - got)) > 0)
+			got += n;
+		else if (!n || errno != EINTR)
+			break;
+	return got;
+}
+
+/* Each worker reuses its buffer from one file to the next.  It's
+ * grown only for a file that doesn't look binary, and without die()
+ * when memory runs short, since that would lose the open texts.
+ */
+static void search_file(const char *path, struct regexp *regexp,
+			char **buffer, size_t *alloc)
+{
+	fd_t fd = open(path, O_RDONLY);
+	struct stat statbuf;
+	struct spans spans;
+	struct hits *hits = NULL;
+	char probe[BINARY_PROBE], *grown;
+	size_t bytes, got;
+
+	if (fd < 0)
+		return;
+	if (fstat(fd, &statbuf) || !S_ISREG(statbuf.st_mode) ||
+	    !(bytes = statbuf.st_size) || bytes > MAX_FILE_BYTES ||
+	    is_open(&statbuf)) {
+		close(fd);
+		return;
+	}
+	got = read_all(fd, probe, bytes < sizeof probe ? bytes : sizeof probe);
+	if (memchr(probe, '\0', got))
+		goto done;
+	if (bytes > *alloc) {
+		if (!(grown = realloc(*buffer, bytes)))
+			goto done;
+		*buffer = grown;
+		*alloc = bytes;
+	}
+	memcpy(*buffer, probe, got);
+	got += read_all(fd, *buffer + got, bytes - got);
+	spans.data[0] = (Byte_t *) *buffer;
+	spans.bytes[0] = got;
+	spans.data[1] = NULL;
+	spans.bytes[1] = 0;
+	hits = search(path, &spans, regexp);
+done:	close(fd);
+	if (hits)
+		post(hits);
+}
+
+static void *worker(void *arg)
+{
+	struct regexp *regexp = NULL;
+	struct job *job;
+	char *buffer = NULL;
+	size_t alloc = 0;
+
+	/* Regular expressions cache state as they run, so each
+	 * worker has its own. */
+	if (regex)
+		regexp = regexp_compile(pattern, pattern_bytes, TRUE);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!jobs && busy && !cancelled())
+			pthread_cond_wait(&work, &lock);
+		if (!jobs || cancelled())
+			break;
+		job = jobs;
+		jobs = job->next;
+		busy++;
+		pthread_mutex_unlock(&lock);
+		if (job->is_dir)
+			walk(job->path);
+		else
+			search_file(job->path, regexp, &buffer, &alloc);
+		RELEASE(job->path);
+		RELEASE(job);
+		pthread_mutex_lock(&lock);
+		busy--;
+	}
+	pthread_cond_broadcast(&work);
+	if (!--running) {
+		close(wake);
+		wake = -1;
+	}
+	pthread_mutex_unlock(&lock);
+	regexp_destroy(regexp);
+	RELEASE(buffer);
+	return NULL;
+}
+
+static void hits_destroy(struct hits *hits)
+{
+	struct hits *next;
+
+	for (; hits; hits = next) {
+		next = hits->next;
+		RELEASE(hits->path);
+		RELEASE(hits->lines);
+		RELEASE(hits);
+	}
+}
+
+static void forget_preview(void)
+{
+	unsigned j;
+
+	RELEASE(replacement);
+	replacement = NULL;
+	for (j = 0; j < stamps; j++)
+		RELEASE(stamp[j].path);
+	RELEASE(stamp);
+	stamp = NULL;
+	stamps = 0;
+}
+
+/* Cancels any search that's still running and forgets its results. */
+static void stop(void)
+{
+	struct job *job;
+	unsigned j;
+
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&cancel, TRUE, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+	for (j = 0; j < threads; j++)
+		pthread_join(thread[j], NULL);
+	threads = 0;
+	__atomic_store_n(&cancel, FALSE, __ATOMIC_SEQ_CST);
+	while ((job = jobs)) {
+		jobs = job->next;
+		RELEASE(job->path);
+		RELEASE(job);
+	}
+	hits_destroy(hits);
+	hits = NULL;
+	for (j = 0; j < blocks; j++)
+		RELEASE(block[j].path);
+	blocks = 0;
+	total_lines = 0;
+}
+
+/* ... and the search itself. */
+static void grep_stop(void)
+{
+	stop();
+	literal_destroy(literal);
+	literal = NULL;
+	RELEASE(pattern);
+	pattern = NULL;
+	forget_preview();
+	RELEASE(open_file);
+	open_file = NULL;
+	open_files = 0;
+}
+
+/* Places a file's lines in the results view, sorted by path. */
+static void show(struct view *view, struct hits *hits)
+{
+	unsigned lo = 0, hi = blocks, mid;
+	position_t offset = 0;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(block[mid].path, hits->path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (mid = 0; mid < lo; mid++)
+		offset += block[mid].bytes;
+	if (offset > view->bytes)
+		offset = view->bytes;
+
+	if (blocks == block_alloc) {
+		block_alloc = block_alloc * 2 + 16;
+		block = reallocate(block, block_alloc * sizeof *block);
+	}
+	memmove(block + lo + 1, block + lo, (blocks - lo) * sizeof *block);
+	block[lo].path = hits->path;
+	block[lo].bytes = hits->bytes;
+	blocks++;
+	hits->path = NULL;
+	total_lines += hits->count;
+
+	view->text->flags &= ~TEXT_RDONLY;
+	view_insert(view, hits->lines, offset, hits->bytes);
+	view->text->flags |= TEXT_RDONLY;
+}
+
+static Boolean_t watcher(struct view *view, char *received, ssize_t bytes)
+{
+	struct hits *new, *next;
+	unsigned j;
+
+	if (!received) {	/* the results view is closing */
+		stop();
+		return FALSE;
+	}
+	pthread_mutex_lock(&lock);
+	new = hits;
+	hits = NULL;
+	pthread_mutex_unlock(&lock);
+	for (; new; new = next) {
+		next = new->next;
+		new->next = NULL;
+		show(view, new);
+		hits_destroy(new);
+	}
+	if (bytes > 0)
+		return TRUE;
+	for (j = 0; j < threads; j++)
+		pthread_join(thread[j], NULL);
+	threads = 0;
+	status("%u line%s in %u file%s", total_lines,
+	       total_lines == 1 ? "" : "s", blocks, blocks == 1 ? "" : "s");
+	return FALSE;
+}
+
+static struct text *editor_text(const char *name)
+{
+	struct text *text;
+
+	for (text = text_list; text; text = text->next)
+		if (text->flags & TEXT_EDITOR && !strcmp(text->path, name))
+			return text;
+	return NULL;
+}
+
+/* Empties or creates a listing. */
+static struct view *results_view(const char *name)
+{
+	struct text *text = editor_text(name);
+	struct view *view;
+
+	if (text) {
+		view = text->views;
+		demultiplex_view(view);
+		text->flags &= ~TEXT_RDONLY;
+		view_delete(view, 0, view->bytes);
+		text->flags |= TEXT_RDONLY;
+		return view;
+	}
+	view = text_create(name, TEXT_EDITOR);
+	view->text->flags |= TEXT_RDONLY;
+	return view;
+}
+
+/* Paths under the current directory are shown relative to it,
+ * like those found by the workers.
+ */
+static const char *relative(const char *path, const char *cwd)
+{
+	size_t len = strlen(cwd);
+
+	if (!strncmp(path, cwd, len) && path[len] == '/')
+		return path + len + 1;
+	return path;
+}
+
+/* Searches the open texts with paths, noting their files. */
+static void search_texts(struct view *view, struct regexp *regexp)
+{
+	struct text *text;
+	struct spans spans;
+	struct stat statbuf;
+	struct hits *hits;
+	char *cwd = allocate(1024);
+
+	if (!getcwd(cwd, 1024))
+		*cwd = '\0';
+	for (text = text_list; text; text = text->next) {
+		if (!text->path || text->flags & (TEXT_EDITOR | TEXT_SCRATCH))
+			continue;
+		if (text->fd >= 0 && !fstat(text->fd, &statbuf)) {
+			open_file = reallocate(open_file, (open_files + 1) *
+					       sizeof *open_file);
+			open_file[open_files].dev = statbuf.st_dev;
+			open_file[open_files++].ino = statbuf.st_ino;
+		}
+		text_spans(text, &spans);
+		if ((hits = search(relative(text->path, cwd), &spans,
+				   regexp))) {
+			show(view, hits);
+			hits_destroy(hits);
+		}
+	}
+	RELEASE(cwd);
+}
+
+/* Finds the "path:line:" that starts a line of a listing, returning
+ * the colon that ends the path, or NULL.
+ */
+static char *listed(char *line, unsigned *number)
+{
+	char *colon, *digits, *end;
+
+	for (colon = line; (colon = strchr(colon, ':')); colon++) {
+		digits = colon + 1;
+		for (end = digits; isdigit(*end); end++)
+			;
+		if (end > digits && *end == ':') {
+			*number = strtoul(digits, NULL, 10);
+			return colon;
+		}
+	}
+	return NULL;
+}
+
+/* Visits the "path:line:" at the start of the cursor's line. */
+static Boolean_t visit(struct view *view)
+{
+	position_t cursor = locus_get(view, CURSOR);
+	position_t start = find_line_start(view, cursor);
+	char *line = view_extract(view, start,
+				  find_line_end(view, cursor) - start);
+	char *colon;
+	unsigned number;
+	struct view *new_view;
+
+	if (!line)
+		return FALSE;
+	if (!(colon = listed(line, &number))) {
+		RELEASE(line);
+		return FALSE;
+	}
+	*colon = '\0';
+	new_view = view_open(line);
+	RELEASE(line);
+	if (!new_view)
+		return FALSE;
+	if (new_view->text->flags & TEXT_CREATED) {
+		view_close(new_view);
+		return FALSE;
+	}
+	locus_set(new_view, CURSOR, find_line_number(new_view, number));
+	locus_set(new_view, MARK, UNSET);
+	if (new_view->window)
+		window_activate(new_view);
+	else
+		window_after(view, new_view, -1 /*auto*/);
+	return TRUE;
+}
+
+static int by_number(const void *x, const void *y)
+{
+	unsigned a = *(const unsigned *) x, b = *(const unsigned *) y;
+	return a < b ? -1 : a > b;
+}
+
+/* Gathers the lines of a listing by file. */
+static struct target *gather(struct view *view, unsigned *count)
+{
+	char *all = view_extract(view, 0, view->bytes), *line, *next, *colon;
+	struct target *target = NULL, *t;
+	unsigned targets = 0, number, j, k;
+
+	for (line = all; line && *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+		if (!(colon = listed(line, &number)))
+			continue;
+		*colon = '\0';
+		for (j = targets; j; j--)	/* usually the last one */
+			if (!strcmp(target[j-1].path, line))
+				break;
+		if (!j) {
+			target = reallocate(target,
+					    (targets + 1) * sizeof *target);
+			memset(&target[targets], 0, sizeof *target);
+			target[targets].path = strdup(line);
+			j = ++targets;
+		}
+		t = &target[j-1];
+		if (t->lines == t->alloc) {
+			t->alloc = t->alloc * 2 + 16;
+			t->line = reallocate(t->line,
+					     t->alloc * sizeof *t->line);
+		}
+		t->line[t->lines++] = number;
+	}
+	RELEASE(all);
+	for (t = target; t < target + targets; t++) {
+		qsort(t->line, t->lines, sizeof *t->line, by_number);
+		for (j = k = 0; j < t->lines; j++)
+			if (!k || t->line[j] != t->line[k-1])
+				t->line[k++] = t->line[j];
+		t->lines = k;
+	}
+	*count = targets;
+	return target;
+}
+
+static void targets_destroy(struct target *target, unsigned targets)
+{
+	unsigned j;
+
+	for (j = 0; j < targets; j++) {
+		RELEASE(target[j].path);
+		RELEASE(target[j].line);
+	}
+	RELEASE(target);
+}
+
+/* Appends the replacement for a hit; \0 through \9 in it stand
+ * for the groups of a regular expression, and \\ for a backslash.
+ */
+static void expand(struct hits *out, const struct spans *spans,
+		   const struct submatch *sub)
+{
+	size_t j;
+	int n;
+
+	for (j = 0; j < replacement_bytes; j++) {
+		n = j + 1 < replacement_bytes ? replacement[j+1] - '0' : -1;
+		if (sub && replacement[j] == '\\' && n == '\\' - '0')
+			add_bytes(out, replacement + ++j, 1);
+		else if (sub && replacement[j] == '\\' && n >= 0 && n <= 9) {
+			j++;
+			if (sub[n].start >= 0)
+				add_spans(out, spans, sub[n].start, sub[n].end);
+		} else
+			add_bytes(out, replacement + j, 1);
+	}
+}
+
+/* Works out the replacements of the hits that begin on a file's
+ * listed lines and end on them too, optionally adding each line's
+ * new content to a preview.
+ */
+static void substitute(struct change *change, const struct target *target,
+		       const struct spans *spans, struct regexp *regexp,
+		       struct hits *preview)
+{
+	struct submatch sub[SUBMATCHES];
+	size_t bytes = spans->bytes[0] + spans->bytes[1], mark = 0;
+	position_t start = 0, end, copied = 0, first = 0;
+	sposition_t at, stop;
+	unsigned line = 1, j;
+	char prefix[32];
+	Boolean_t hit;
+
+	for (j = 0; j < target->lines; j++) {
+		for (; line < target->line[j] && start < bytes; line++)
+			start = line_end(spans, start) + 1;
+		if (start >= bytes)
+			break;
+		end = line_end(spans, start);
+		for (hit = FALSE, at = start; at < end; at = stop) {
+			if (regexp) {
+				at = regexp_find(regexp, spans, at, end, sub);
+				if (at < 0)
+					break;
+				stop = sub[0].end;
+			} else {
+				at = literal_find(literal, spans, at, end);
+				if (at < 0)
+					break;
+				stop = at + pattern_bytes;
+			}
+			if (stop == at || stop > end) {
+				stop = at + 1;
+				continue;
+			}
+			if (change->reps)
+				add_spans(&change->out, spans, copied, at);
+			if (!hit) {
+				first = at;
+				mark = change->out.bytes;
+				hit = TRUE;
+			}
+			if (change->reps == change->alloc) {
+				change->alloc = change->alloc * 2 + 64;
+				change->rep = reallocate(change->rep,
+							 change->alloc *
+							 sizeof *change->rep);
+			}
+			change->rep[change->reps].offset = at;
+			change->rep[change->reps].bytes = stop - at;
+			change->rep[change->reps].new_bytes =
+				change->out.bytes;
+			expand(&change->out, spans, regexp ? sub : NULL);
+			change->rep[change->reps].new_bytes =
+				change->out.bytes -
+				change->rep[change->reps].new_bytes;
+			change->reps++;
+			copied = stop;
+		}
+		if (!hit)
+			continue;
+		change->lines++;
+		if (!preview)
+			continue;
+		add_bytes(preview, target->path, strlen(target->path));
+		sprintf(prefix, ":%u:", line);
+		add_bytes(preview, prefix, strlen(prefix));
+		add_spans(preview, spans, start, first);
+		add_bytes(preview, change->out.lines + mark,
+			  change->out.bytes - mark);
+		add_spans(preview, spans, copied, end);
+		add_bytes(preview, "\n", 1);
+	}
+}
+
+static struct text *open_text(const char *path, const char *cwd)
+{
+	struct text *text;
+
+	for (text = text_list; text; text = text->next)
+		if (text->path &&
+		    !(text->flags & (TEXT_EDITOR | TEXT_SCRATCH)) &&
+		    !strcmp(relative(text->path, cwd), path))
+			return text;
+	return NULL;
+}
+
+static Boolean_t write_all(fd_t fd, const void *data, size_t bytes)
+{
+	ssize_t wrote;
+
+	for (; bytes; bytes -= wrote, data = (const char *) data + wrote)
+		if ((wrote = write(fd, data, bytes)) <= 0)
+			return FALSE;
+	return TRUE;
+}
+
+struct rewrite {
+	const char *path;
+	const Byte_t *old;
+	size_t bytes;
+	const struct change *change;
+};
+
+static Boolean_t rewriter(fd_t fd, void *arg)
+{
+	struct rewrite *rw = arg;
+	const struct change *change = rw->change;
+	const struct replacement *last = &change->rep[change->reps-1];
+	position_t first = change->rep[0].offset;
+	position_t rest = last->offset + last->bytes;
+
+	errno = 0;
+	if (write_all(fd, rw->old, first) &&
+	    write_all(fd, change->out.lines, change->out.bytes) &&
+	    write_all(fd, rw->old + rest, rw->bytes - rest))
+		return TRUE;
+	message("%s: can't write", path_format(rw->path));
+	return FALSE;
+}
+
+/* The state of a text or file when its replacements are previewed,
+ * which must still hold when they're made.
+ */
+static Boolean_t stamped(const char *path, struct text *text,
+			 const struct stat *statbuf, Boolean_t commit)
+{
+	struct stamp *st;
+	unsigned j;
+
+	if (!commit) {
+		stamp = reallocate(stamp, (stamps + 1) * sizeof *stamp);
+		st = &stamp[stamps++];
+		st->path = strdup(path);
+		st->text = text;
+		st->dirties = text ? text->dirties : 0;
+		st->mtime = statbuf ? statbuf->st_mtime : 0;
+		st->size = statbuf ? statbuf->st_size : 0;
+		return TRUE;
+	}
+	for (j = 0; j < stamps; j++)
+		if (!strcmp(stamp[j].path, path))
+			break;
+	if (j < stamps &&
+	    stamp[j].text == text &&
+	    (text ? stamp[j].dirties == text->dirties
+		  : stamp[j].mtime == statbuf->st_mtime &&
+		    stamp[j].size == statbuf->st_size))
+		return TRUE;
+	message("%s: changed since the preview, not replaced",
+		path_format(path));
+	return FALSE;
+}
+
+/* Finds the replacements in an open text or a file, and makes
+ * them if "commit" is set.  Returns FALSE if it can't read the file.
+ */
+static Boolean_t change_file(struct change *change,
+			     const struct target *target, const char *cwd,
+			     struct regexp *regexp, struct hits *preview,
+			     Boolean_t commit)
+{
+	struct text *text = open_text(target->path, cwd);
+	struct spans spans;
+	struct stat statbuf;
+	struct rewrite rw;
+	size_t bytes;
+	fd_t fd;
+	Byte_t *p;
+
+	if (text) {
+		if (!stamped(target->path, text, NULL, commit))
+			return TRUE;
+		text_spans(text, &spans);
+		substitute(change, target, &spans, regexp, preview);
+		if (commit && change->reps)
+			text_replace(text, change->out.lines, change->out.bytes,
+				     change->rep, change->reps);
+		return TRUE;
+	}
+	if ((fd = open(target->path, O_RDONLY)) < 0)
+		return FALSE;
+	if (fstat(fd, &statbuf) || !S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return FALSE;
+	}
+	if (!stamped(target->path, NULL, &statbuf, commit)) {
+		close(fd);
+		return TRUE;
+	}
+	if (!(bytes = statbuf.st_size)) {
+		close(fd);
+		return TRUE;
+	}
+	p = allocate(bytes);
+	bytes = read_all(fd, p, bytes);
+	close(fd);
+	spans.data[0] = p;
+	spans.bytes[0] = bytes;
+	spans.data[1] = NULL;
+	spans.bytes[1] = 0;
+	substitute(change, target, &spans, regexp, preview);
+	if (commit && change->reps) {
+		rw.path = target->path;
+		rw.old = p;
+		rw.bytes = bytes;
+		rw.change = change;
+		if (!file_rewrite(target->path, &statbuf, rewriter, &rw,
+				  !no_save_originals))
+			change->reps = 0;	/* and it's been said why */
+	}
+	RELEASE(p);
+	return TRUE;
+}
+
+/* Replaces, or previews the replacement of, the hits on the lines of
+ * a listing.
+ */
+static void replace(struct view *view, struct view *listing,
+		    Boolean_t commit)
+{
+	struct target *target;
+	struct change change;
+	struct regexp *regexp = NULL;
+	struct hits preview;
+	struct view *results = NULL;
+	unsigned targets, j, reps = 0, lines = 0, files = 0;
+	char *cwd = allocate(1024);
+
+	if (!getcwd(cwd, 1024))
+		*cwd = '\0';
+	if (regex)
+		regexp = regexp_compile(pattern, pattern_bytes, TRUE);
+	target = gather(listing, &targets);
+	memset(&preview, 0, sizeof preview);
+	for (j = 0; j < targets; j++) {
+		memset(&change, 0, sizeof change);
+		if (!change_file(&change, &target[j], cwd, regexp,
+				 commit ? NULL : &preview, commit))
+			message("%s: can't replace",
+				path_format(target[j].path));
+		else if (change.reps) {
+			reps += change.reps;
+			lines += change.lines;
+			files++;
+		}
+		RELEASE(change.out.lines);
+		RELEASE(change.rep);
+	}
+	targets_destroy(target, targets);
+	regexp_destroy(regexp);
+	RELEASE(cwd);
+
+	if (commit) {
+		forget_preview();
+		status("%u replaced in %u file%s", reps,
+		       files, files == 1 ? "" : "s");
+		return;
+	}
+	results = results_view(REPLACEMENTS);
+	results->text->flags &= ~TEXT_RDONLY;
+	view_insert(results, preview.lines, 0, preview.bytes);
+	results->text->flags |= TEXT_RDONLY;
+	RELEASE(preview.lines);
+	locus_set(results, CURSOR, 0);
+	if (results->window)
+		window_activate(results);
+	else
+		window_after(view, results, -1 /*auto*/);
+	status("%u to replace on %u line%s in %u file%s", reps,
+	       lines, lines == 1 ? "" : "s", files, files == 1 ? "" : "s");
+}
+
+void grep_replace(struct view *view)
+{
+	struct text *text;
+	char *clip;
+
+	if (!pattern) {
+		window_beep(view);
+		return;
+	}
+	if (threads) {
+		message("the search is still running");
+		return;
+	}
+	if (view->text->flags & TEXT_EDITOR &&
+	    !strcmp(view->text->path, REPLACEMENTS)) {
+		if (!replacement)
+			window_beep(view);
+		else
+			replace(view, view, TRUE);
+		return;
+	}
+	if (!(text = editor_text(RESULTS))) {
+		window_beep(view);
+		return;
+	}
+	forget_preview();
+	replacement_bytes = clip_raw(0, &clip);
+	replacement = allocate(replacement_bytes + 1);
+	if (replacement_bytes)
+		memcpy(replacement, clip, replacement_bytes);
+	replace(view, text->views, FALSE);
+}
+
+void grep(struct view *view, Boolean_t is_regex)
+{
+	struct view *results;
+	struct regexp *regexp = NULL;
+	char *selection;
+	size_t bytes;
+	fd_t fds[2];
+	long cpus;
+
+	if (locus_get(view, MARK) == UNSET) {
+		if (!visit(view))
+			window_beep(view);
+		return;
+	}
+	if (!(selection = view_extract_selection(view)) ||
+	    !(bytes = strlen(selection))) {
+		RELEASE(selection);
+		window_beep(view);
+		return;
+	}
+	if (is_regex && !(regexp = regexp_compile(selection, bytes, TRUE))) {
+		message("bad regular expression: %s", selection);
+		RELEASE(selection);
+		return;
+	}
+	locus_set(view, MARK, UNSET);
+
+	grep_stop();
+	pattern = selection;
+	pattern_bytes = bytes;
+	regex = is_regex;
+	if (!regex)
+		literal = literal_create(pattern, bytes, TRUE);
+
+	results = results_view(RESULTS);
+	if (results->window)
+		window_activate(results);
+	else
+		window_after(view, results, -1 /*auto*/);
+	search_texts(results, regexp);
+	regexp_destroy(regexp);
+	locus_set(results, CURSOR, 0);
+
+	if (pipe(fds)) {
+		message("could not create pipes");
+		return;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	wake = fds[1];
+	multiplex_read(fds[0], results, watcher);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	push_job(".", ".", TRUE);
+	pthread_mutex_lock(&lock);
+	for (threads = 0; threads < (cpus < 1 ? 1 : cpus > MAX_THREADS ?
+				     MAX_THREADS : cpus); threads++)
+		if (thread_create(&thread[threads], worker, NULL))
+			break;
+	running = threads;
+	if (!threads) {
+		close(wake);
+		wake = -1;
+	}
+	pthread_mutex_unlock(&lock);
+}
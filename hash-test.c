@@ -0,0 +1,139 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	Edits a text at random, mirroring each edit in the content
+ *	hash tree as the undo machinery does, and checks that the tree
+ *	finds the text unchanged from its "save" exactly when it is,
+ *	however its chunks have drifted in the meantime.  Insertions
+ *	of many chunks into a text that already has several are
+ *	included, since they make the tree be laid out anew.
+ *
+ *	usage: hash-test [-n edits] [-s seed]
+ */
+
+static int failures;
+
+void die(const char *msg, ...)
+{
+	va_list ap;
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+void message(const char *msg, ...)
+{
+	va_list ap;
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void fill(char *data, size_t bytes)
+{
+	size_t j;
+
+	for (j = 0; j < bytes; j++)
+		data[j] = 'a' + random() % 26;
+}
+
+static void insert(struct text *text, position_t offset, size_t bytes)
+{
+	char *data = allocate(bytes);
+
+	fill(data, bytes);
+	buffer_insert(text->buffer, data, offset, bytes);
+	text_hash_inserted(text, offset, bytes);
+	RELEASE(data);
+}
+
+static void delete(struct text *text, position_t offset, size_t bytes)
+{
+	buffer_delete(text->buffer, offset, bytes);
+	text_hash_deleted(text, offset, bytes);
+}
+
+static void check(struct text *text, Boolean_t saved, const char *what)
+{
+	if (text_hash_is_saved(text) == saved)
+		return;
+	fprintf(stderr, "%s: text is %sthe saved content but the tree "
+		"says otherwise\n", what, saved ? "" : "not ");
+	failures++;
+}
+
+/* Big edits that leave the text as it was saved */
+static void roundtrip(struct text *text, size_t bytes)
+{
+	size_t size = buffer_bytes(text->buffer);
+	position_t offset = random() % (size + 1);
+
+	insert(text, offset, bytes);
+	check(text, FALSE, "after a big insertion");
+	delete(text, offset, bytes);
+	check(text, TRUE, "after deleting a big insertion");
+}
+
+int main(int argc, char *argv[])
+{
+	struct text text;
+	unsigned edits = 10000, j;
+	int ch;
+	position_t offset;
+	size_t size, bytes;
+	char *saved;
+
+	while ((ch = getopt(argc, argv, "n:s:")) >= 0)
+		switch (ch) {
+		case 'n':
+			edits = atoi(optarg);
+			break;
+		case 's':
+			srandom(atoi(optarg));
+			break;
+		default:
+			die("usage: hash-test [-n edits] [-s seed]");
+		}
+
+	memset(&text, 0, sizeof text);
+	text.buffer = buffer_create(NULL);
+	insert(&text, 0, 5 * 4096 + 123);
+	text_hash_build(&text, TRUE);
+	check(&text, TRUE, "after building");
+
+	roundtrip(&text, 100000);
+	roundtrip(&text, 2 * 4096 + 1);
+	roundtrip(&text, 1 << 20);
+
+	/* Random edits, then a return to the saved content */
+	size = buffer_bytes(text.buffer);
+	saved = allocate(size);
+	buffer_get(text.buffer, saved, 0, size);
+	for (j = 0; j < edits; j++) {
+		bytes = random() % 8 ? random() % 64 : random() % 40000;
+		offset = random() % (buffer_bytes(text.buffer) + 1);
+		if (random() & 1)
+			insert(&text, offset, bytes);
+		else
+			delete(&text, offset, bytes);
+	}
+	delete(&text, 0, buffer_bytes(text.buffer));
+	buffer_insert(text.buffer, saved, 0, size);
+	text_hash_inserted(&text, 0, size);
+	check(&text, TRUE, "after restoring the content");
+
+	RELEASE(saved);
+
+	text_hash_destroy(&text);
+	buffer_destroy(text.buffer);
+	if (failures) {
+		fprintf(stderr, "hash-test: %d failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("hash-test: ok\n");
+	return EXIT_SUCCESS;
+}
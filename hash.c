@@ -0,0 +1,364 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	Modified texts carry a tree of hashes over chunks of their
+ *	content.  Chunks are contiguous extents whose sizes drift as
+ *	edits occur; each leaf of the tree holds the length and the
+ *	polynomial hash (modulo 2**61-1) of one chunk, and interior
+ *	nodes combine their children so that the root is the hash of
+ *	the whole text, independent of how it happens to be chunked.
+ *	An edit rehashes only the chunks that it touched and the path
+ *	from them up to the root.
+ *
+ *	The root and the leaves as of the last save are retained.
+ *	Comparing the root against them tells whether the text differs
+ *	from its file in constant time, and comparing the leaves lets
+ *	a save rewrite only the extents that have changed.
+ */
+
+typedef unsigned long long hash_t;
+
+#define MODULUS ((1ULL << 61) - 1)
+#define BASE 0x1234567891ULL
+#define CHUNK 4096
+
+struct node {
+	size_t bytes;
+	hash_t hash, power;	/* power is BASE**bytes */
+};
+
+struct saved {
+	size_t bytes;
+	hash_t hash;
+};
+
+struct hashes {
+	struct node *tree;	/* [1] is the root, leaves start at [leaves] */
+	unsigned leaves, chunks;
+	struct saved *saved;	/* leaves at the last save */
+	unsigned saved_chunks;
+	struct node saved_root;
+	Boolean_t saved_valid;
+};
+
+static hash_t reduce(hash_t x)
+{
+	x = (x & MODULUS) + (x >> 61);
+	return x >= MODULUS ? x - MODULUS : x;
+}
+
+static hash_t multiply(hash_t a, hash_t b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 product = (unsigned __int128) a * b;
+	return reduce(((hash_t) product & MODULUS) + (hash_t) (product >> 61));
+#else
+	hash_t a_hi = a >> 31, a_lo = a & 0x7fffffff;
+	hash_t b_hi = b >> 31, b_lo = b & 0x7fffffff;
+	hash_t mid = a_hi * b_lo + a_lo * b_hi;
+	return reduce(reduce((a_hi * b_hi << 1) + (mid >> 30) +
+			     (mid << 31 & MODULUS)) + a_lo * b_lo);
+#endif
+}
+
+static hash_t power(size_t bytes)
+{
+	hash_t result = 1, base = BASE;
+
+	for (; bytes; bytes >>= 1) {
+		if (bytes & 1)
+			result = multiply(result, base);
+		base = multiply(base, base);
+	}
+	return result;
+}
+
+static void combine(struct node *node, const struct node *left,
+		    const struct node *right)
+{
+	node->bytes = left->bytes + right->bytes;
+	node->hash = reduce(multiply(left->hash, right->power) + right->hash);
+	node->power = multiply(left->power, right->power);
+}
+
+static void hash_chunk(struct node *leaf, struct text *text,
+		       position_t offset, size_t bytes)
+{
+	Byte_t data[2*CHUNK];
+	hash_t hash = 0;
+	size_t j, got;
+
+	leaf->bytes = bytes;
+	leaf->power = power(bytes);
+	while (bytes) {
+		if (text->buffer)
+			got = buffer_get(text->buffer, data, offset,
+					 bytes < sizeof data ? bytes
+							     : sizeof data);
+		else {
+			got = bytes < sizeof data ? bytes : sizeof data;
+			memcpy(data, text->clean + offset, got);
+		}
+		if (!got)
+			break;
+		for (j = 0; j < got; j++)
+			hash = reduce(multiply(hash, BASE) + data[j]);
+		offset += got;
+		bytes -= got;
+	}
+	leaf->hash = hash;
+}
+
+static void update_path(struct hashes *hashes, unsigned leaf)
+{
+	struct node *tree = hashes->tree;
+	unsigned node;
+
+	for (node = leaf >> 1; node; node >>= 1)
+		combine(&tree[node], &tree[2*node], &tree[2*node+1]);
+}
+
+static void update_all(struct hashes *hashes)
+{
+	struct node *tree = hashes->tree;
+	unsigned node;
+
+	for (node = hashes->leaves; node-- > 1; )
+		combine(&tree[node], &tree[2*node], &tree[2*node+1]);
+}
+
+/* Lays out a fresh tree for the given chunk sizes, reusing
+ * the hashes of chunks that are intact (leaf[j].power != 0).
+ */
+static void plant(struct hashes *hashes, struct text *text,
+		  struct node *leaf, unsigned chunks)
+{
+	unsigned j, leaves = 1;
+	position_t offset = 0;
+
+	while (leaves < chunks)
+		leaves <<= 1;
+	RELEASE(hashes->tree);
+	hashes->tree = allocate0(2 * leaves * sizeof *hashes->tree);
+	hashes->leaves = leaves;
+	hashes->chunks = chunks;
+	for (j = 0; j < leaves; j++) {
+		struct node *node = &hashes->tree[leaves+j];
+		if (j >= chunks)
+			node->power = 1;
+		else if (leaf[j].power)
+			*node = leaf[j];
+		else
+			hash_chunk(node, text, offset, leaf[j].bytes);
+		offset += node->bytes;
+	}
+	update_all(hashes);
+}
+
+/* Splits oversized chunks and discards empty ones. */
+static void replant(struct hashes *hashes, struct text *text)
+{
+	struct node *leaf, *old = hashes->tree + hashes->leaves;
+	unsigned j, chunks = 0;
+	size_t bytes = 0;
+
+	/* The leaves may already hold bytes that the root doesn't. */
+	for (j = 0; j < hashes->chunks; j++)
+		bytes += old[j].bytes;
+	leaf = allocate((bytes / CHUNK + hashes->chunks + 1) * sizeof *leaf);
+	for (j = 0; j < hashes->chunks; j++) {
+		if (!(bytes = old[j].bytes))
+			continue;
+		if (bytes <= 2*CHUNK) {
+			leaf[chunks++] = old[j];
+			continue;
+		}
+		for (; bytes; bytes -= leaf[chunks++].bytes) {
+			leaf[chunks].bytes = bytes < 2*CHUNK ? bytes : CHUNK;
+			leaf[chunks].power = 0;
+		}
+	}
+	if (!chunks) {
+		/* an empty text still has its one (empty) chunk */
+		leaf[chunks].bytes = 0;
+		leaf[chunks++].power = 0;
+	}
+	plant(hashes, text, leaf, chunks);
+	RELEASE(leaf);
+}
+
+void text_hash_build(struct text *text, Boolean_t saved)
+{
+	struct hashes *hashes = allocate0(sizeof *hashes);
+	size_t bytes = text->buffer ? buffer_bytes(text->buffer)
+				    : text->clean_bytes;
+	unsigned j, chunks = bytes / CHUNK + 1;
+	struct node *leaf = allocate(chunks * sizeof *leaf);
+
+	for (j = 0; j < chunks; j++) {
+		leaf[j].bytes = j+1 < chunks ? CHUNK : bytes % CHUNK;
+		leaf[j].power = 0;
+	}
+	plant(hashes, text, leaf, chunks);
+	RELEASE(leaf);
+	text->hashes = hashes;
+	if (saved)
+		text_hash_saved(text);
+}
+
+/* Finds the chunk that contains an offset, preferring the
+ * earlier chunk when the offset lies on a boundary.
+ */
+static unsigned locate(struct hashes *hashes, position_t offset,
+		       position_t *start)
+{
+	struct node *tree = hashes->tree;
+	unsigned node = 1;
+
+	*start = 0;
+	while (node < hashes->leaves) {
+		node <<= 1;
+		if (offset > tree[node].bytes || !tree[node].bytes) {
+			offset -= tree[node].bytes;
+			*start += tree[node].bytes;
+			node++;
+		}
+	}
+	if (node >= hashes->leaves + hashes->chunks) {
+		/* past the last chunk, into the empty padding */
+		node = hashes->leaves + hashes->chunks - 1;
+		*start -= tree[node].bytes;
+	}
+	return node;
+}
+
+static Boolean_t crowded(struct hashes *hashes)
+{
+	return hashes->chunks > 2 * (hashes->tree[1].bytes / CHUNK) + 16;
+}
+
+void text_hash_inserted(struct text *text, position_t offset, size_t bytes)
+{
+	struct hashes *hashes = text->hashes;
+	position_t start;
+	unsigned leaf;
+
+	if (!hashes || !bytes)
+		return;
+	leaf = locate(hashes, offset, &start);
+	hashes->tree[leaf].bytes += bytes;
+	if (hashes->tree[leaf].bytes > 2*CHUNK) {
+		hashes->tree[leaf].power = 0;
+		replant(hashes, text);
+		return;
+	}
+	hash_chunk(&hashes->tree[leaf], text, start, hashes->tree[leaf].bytes);
+	update_path(hashes, leaf);
+}
+
+void text_hash_deleted(struct text *text, position_t offset, size_t bytes)
+{
+	struct hashes *hashes = text->hashes;
+	struct node *tree;
+	position_t start, end;
+	unsigned leaf;
+	size_t take;
+
+	if (!hashes || !bytes)
+		return;
+	tree = hashes->tree;
+	leaf = locate(hashes, offset, &start);
+	while (bytes && leaf < 2 * hashes->leaves) {
+		end = start + tree[leaf].bytes;
+		take = end > offset ? end - offset : 0;
+		if (take > bytes)
+			take = bytes;
+		if (take) {
+			bytes -= take;
+			tree[leaf].bytes -= take;
+			hash_chunk(&tree[leaf], text, start, tree[leaf].bytes);
+			update_path(hashes, leaf);
+		}
+		start = offset;
+		leaf++;
+	}
+	if (crowded(hashes))
+		replant(hashes, text);
+}
+
+/* The current content is now what is in the file. */
+void text_hash_saved(struct text *text)
+{
+	struct hashes *hashes = text->hashes;
+	unsigned j;
+
+	if (!hashes)
+		return;
+	RELEASE(hashes->saved);
+	hashes->saved = allocate((hashes->chunks + 1) * sizeof *hashes->saved);
+	for (j = 0; j < hashes->chunks; j++) {
+		hashes->saved[j].bytes = hashes->tree[hashes->leaves+j].bytes;
+		hashes->saved[j].hash = hashes->tree[hashes->leaves+j].hash;
+	}
+	hashes->saved_chunks = hashes->chunks;
+	hashes->saved_root = hashes->tree[1];
+	hashes->saved_valid = TRUE;
+}
+
+/* The file no longer holds the last saved content. */
+void text_hash_forget_saved(struct text *text)
+{
+	if (text->hashes) {
+		RELEASE(text->hashes->saved);
+		text->hashes->saved_chunks = 0;
+		text->hashes->saved_valid = FALSE;
+	}
+}
+
+Boolean_t text_hash_is_saved(struct text *text)
+{
+	struct hashes *hashes = text->hashes;
+
+	return	hashes &&
+		hashes->saved_valid &&
+		hashes->tree[1].bytes == hashes->saved_root.bytes &&
+		hashes->tree[1].hash == hashes->saved_root.hash;
+}
+
+/* Brings an image of the last saved content up to date with the
+ * raw current content by copying only the chunks that differ.
+ */
+Boolean_t text_hash_refresh(struct text *text, char *image, const char *raw)
+{
+	struct hashes *hashes = text->hashes;
+	struct node *leaf;
+	position_t offset = 0, saved_offset = 0;
+	unsigned j, k = 0;
+
+	if (!hashes || !hashes->saved_valid)
+		return FALSE;
+	leaf = hashes->tree + hashes->leaves;
+	for (j = 0; j < hashes->chunks; offset += leaf[j++].bytes) {
+		while (k < hashes->saved_chunks && saved_offset < offset)
+			saved_offset += hashes->saved[k++].bytes;
+		while (k < hashes->saved_chunks && !hashes->saved[k].bytes)
+			k++;
+		if (k < hashes->saved_chunks &&
+		    saved_offset == offset &&
+		    hashes->saved[k].bytes == leaf[j].bytes &&
+		    hashes->saved[k].hash == leaf[j].hash)
+			continue;
+		memcpy(image + offset, raw + offset, leaf[j].bytes);
+	}
+	return TRUE;
+}
+
+void text_hash_destroy(struct text *text)
+{
+	if (text->hashes) {
+		RELEASE(text->hashes->tree);
+		RELEASE(text->hashes->saved);
+		RELEASE(text->hashes);
+	}
+}
@@ -50,7 +50,13 @@ Command summary:
 ^Sp^_  incremental regular expression search mode with POSIX regexps.
          In search mode, use ^cmd(H,G) and ^cmd(T,H) to move from one
          instance of the search target to another and any other command,
-         or Return, to resume editing.
+         or Return, to resume editing.  Insert replaces all hits with
+         the clip buffer (\1-\9 are regular expression groups, \\ is \).
+^Sp/   search all open texts and files below this directory for selection
+^Sp*   same, with selection as a regular expression
+^Sp/   without selection: visit file:line: named on the current line
+^Sp%   preview replacing those hits with the clip buffer; again to replace
+^Sp@   find a file below this directory by typing some of its path's letters
 
    ^cmd(X,E)  open file named by selection in new window
          insert current path as selection if none
@@ -0,0 +1,283 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	Literal string search, used by incremental search and
+ *	the other places that look for exact strings.
+ *
+ *	Longer patterns use the Boyer-Moore-Horspool algorithm, with
+ *	skip tables built over case-folded bytes when case is being
+ *	ignored.  Short patterns can't skip far, so they instead test
+ *	a word's worth of candidate positions at a time for the first
+ *	and last bytes of the pattern before comparing any further.
+ *
+ *	Texts are scanned in place as the (at most two) contiguous
+ *	extents on either side of the gap in their buffers, without
+ *	moving the gap; the few candidate positions whose matches would
+ *	straddle the gap are checked in a small copy of its surroundings.
+ */
+
+struct literal {
+	Byte_t *pattern;	/* folded if ignoring case */
+	size_t bytes;
+	Byte_t fold[0x100];
+	size_t skip[0x100];	/* for forward scans */
+	size_t skip_back[0x100];
+};
+
+typedef unsigned long word_t;
+#define ONES (~(word_t)0 / 0xff)
+#define HIGHS (ONES << 7)
+#define SHORT (sizeof(word_t))
+
+struct literal *literal_create(const char *pattern, size_t bytes,
+			       Boolean_t ignore_case)
+{
+	struct literal *literal = allocate(sizeof *literal);
+	size_t j;
+
+	for (j = 0; j < 0x100; j++) {
+		literal->fold[j] = j;
+		if (ignore_case && j >= 'a' && j <= 'z')
+			literal->fold[j] += 'A' - 'a';
+	}
+	literal->pattern = allocate(bytes + 1);
+	for (j = 0; j < bytes; j++)
+		literal->pattern[j] = literal->fold[(Byte_t) pattern[j]];
+	literal->bytes = bytes;
+
+	for (j = 0; j < 0x100; j++)
+		literal->skip[j] = literal->skip_back[j] = bytes;
+	for (j = 0; j + 1 < bytes; j++)
+		literal->skip[literal->pattern[j]] = bytes - 1 - j;
+	for (j = bytes; j-- > 1; )
+		literal->skip_back[literal->pattern[j]] = j;
+	for (j = 0; j < 0x100; j++) {
+		literal->skip[j] = literal->skip[literal->fold[j]];
+		literal->skip_back[j] = literal->skip_back[literal->fold[j]];
+	}
+	return literal;
+}
+
+void literal_destroy(struct literal *literal)
+{
+	if (literal) {
+		RELEASE(literal->pattern);
+		RELEASE(literal);
+	}
+}
+
+static Boolean_t matches(const struct literal *literal, const Byte_t *p)
+{
+	const Byte_t *fold = literal->fold;
+	size_t j;
+
+	for (j = 0; j < literal->bytes; j++)
+		if (fold[p[j]] != literal->pattern[j])
+			return FALSE;
+	return TRUE;
+}
+
+/* Flags (at least) the bytes of a word that equal either
+ * of two byte values with their high bits.
+ */
+static word_t equal(word_t word, word_t x, word_t y)
+{
+	word_t xs = word ^ x, ys = word ^ y;
+	return ((xs - ONES) & ~xs | (ys - ONES) & ~ys) & HIGHS;
+}
+
+static word_t load(const Byte_t *p)
+{
+	word_t word;
+	memcpy(&word, p, sizeof word);
+	return word;
+}
+
+/* The candidates for the first and last pattern bytes,
+ * in both cases when appropriate.
+ */
+static void ends(const struct literal *literal, word_t end[4])
+{
+	Byte_t first = literal->pattern[0];
+	Byte_t last = literal->pattern[literal->bytes-1];
+
+	end[0] = end[1] = ONES * first;
+	end[2] = end[3] = ONES * last;
+	if (literal->fold['a'] != 'a') {
+		if (first >= 'A' && first <= 'Z')
+			end[1] = ONES * (first + 'a' - 'A');
+		if (last >= 'A' && last <= 'Z')
+			end[3] = ONES * (last + 'a' - 'A');
+	}
+}
+
+/* First match in p[0..n) whose start lies in [from,to) */
+static sposition_t forward(const struct literal *literal,
+			   const Byte_t *p, size_t n,
+			   size_t from, size_t to)
+{
+	size_t m = literal->bytes, last = m - 1, at, j;
+	Byte_t lastch = literal->pattern[last];
+	word_t end[4];
+
+	if (n < m)
+		return -1;
+	if (to > n - m + 1)
+		to = n - m + 1;
+	at = from;
+
+	if (m < SHORT) {
+		ends(literal, end);
+		for (; at + SHORT <= to; at += SHORT)
+			if (equal(load(p + at), end[0], end[1]) &
+			    equal(load(p + at + last), end[2], end[3]))
+				for (j = 0; j < SHORT; j++)
+					if (matches(literal, p + at + j))
+						return at + j;
+		for (; at < to; at++)
+			if (matches(literal, p + at))
+				return at;
+		return -1;
+	}
+
+	while (at < to) {
+		Byte_t ch = p[at + last];
+		if (literal->fold[ch] == lastch && matches(literal, p + at))
+			return at;
+		at += literal->skip[ch];
+	}
+	return -1;
+}
+
+/* Last match in p[0..n) whose start lies in [from,to) */
+static sposition_t backward(const struct literal *literal,
+			    const Byte_t *p, size_t n,
+			    size_t from, size_t to)
+{
+	size_t m = literal->bytes, last = m - 1, at, j;
+	Byte_t firstch = literal->pattern[0];
+	word_t end[4];
+
+	if (n < m)
+		return -1;
+	if (to > n - m + 1)
+		to = n - m + 1;
+	if (to <= from)
+		return -1;
+	at = to - 1;
+
+	if (m < SHORT) {
+		ends(literal, end);
+		for (; at >= from + SHORT; at -= SHORT)
+			if (equal(load(p + at + 1 - SHORT), end[0], end[1]) &
+			    equal(load(p + at + 1 - SHORT + last),
+				  end[2], end[3]))
+				for (j = 0; j < SHORT; j++)
+					if (matches(literal, p + at - j))
+						return at - j;
+		for (; at + 1 > from; at--)
+			if (matches(literal, p + at))
+				return at;
+		return -1;
+	}
+
+	for (;;) {
+		Byte_t ch = p[at];
+		if (literal->fold[ch] == firstch && matches(literal, p + at))
+			return at;
+		if (at < from + literal->skip_back[ch])
+			return -1;
+		at -= literal->skip_back[ch];
+	}
+}
+
+/* Matches whose starts are in [from,to) that straddle the
+ * boundary between the two spans are found in a copy.
+ */
+static sposition_t straddle(const struct literal *literal,
+			    const struct spans *spans,
+			    position_t from, position_t to,
+			    Boolean_t backwards)
+{
+	size_t m = literal->bytes, n0 = spans->bytes[0], lo, n1;
+	Byte_t *copy;
+	sposition_t at;
+
+	if (m < 2 || !n0 || !spans->bytes[1])
+		return -1;
+	lo = n0 > m - 1 ? n0 - (m - 1) : 0;
+	n1 = spans->bytes[1] < m - 1 ? spans->bytes[1] : m - 1;
+	if (from < lo)
+		from = lo;
+	if (to > n0)
+		to = n0;
+	if (from >= to)
+		return -1;
+	copy = allocate(n0 - lo + n1);
+	memcpy(copy, spans->data[0] + lo, n0 - lo);
+	memcpy(copy + n0 - lo, spans->data[1], n1);
+	if (backwards)
+		at = backward(literal, copy, n0 - lo + n1, from - lo, to - lo);
+	else
+		at = forward(literal, copy, n0 - lo + n1, from - lo, to - lo);
+	RELEASE(copy);
+	return at < 0 ? -1 : at + lo;
+}
+
+static sposition_t second(const struct literal *literal,
+			  const struct spans *spans,
+			  position_t from, position_t to,
+			  Boolean_t backwards)
+{
+	size_t n0 = spans->bytes[0];
+	sposition_t at;
+
+	if (to <= n0)
+		return -1;
+	from = from > n0 ? from - n0 : 0;
+	if (backwards)
+		at = backward(literal, spans->data[1], spans->bytes[1],
+			      from, to - n0);
+	else
+		at = forward(literal, spans->data[1], spans->bytes[1],
+			     from, to - n0);
+	return at < 0 ? -1 : at + n0;
+}
+
+/* Returns the offset of the first match that starts in [from,to). */
+sposition_t literal_find(const struct literal *literal,
+			 const struct spans *spans,
+			 position_t from, position_t to)
+{
+	sposition_t at;
+
+	if (!literal->bytes)
+		return from < to ? from : -1;
+	if (from < spans->bytes[0] &&
+	    (at = forward(literal, spans->data[0], spans->bytes[0],
+			  from, to)) >= 0)
+		return at;
+	if ((at = straddle(literal, spans, from, to, FALSE)) >= 0)
+		return at;
+	return second(literal, spans, from, to, FALSE);
+}
+
+/* Returns the offset of the last match that starts in [from,to). */
+sposition_t literal_find_prior(const struct literal *literal,
+			       const struct spans *spans,
+			       position_t from, position_t to)
+{
+	sposition_t at;
+
+	if (!literal->bytes)
+		return from < to ? to - 1 : -1;
+	if ((at = second(literal, spans, from, to, TRUE)) >= 0)
+		return at;
+	if ((at = straddle(literal, spans, from, to, TRUE)) >= 0)
+		return at;
+	if (from < spans->bytes[0])
+		return backward(literal, spans->data[0], spans->bytes[0],
+				from, to);
+	return -1;
+}
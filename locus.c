@@ -7,8 +7,6 @@
  *	automatic adjustments to the byte offset of a locus.
  */
 
-#define DELETED (UNSET-1)
-
 locus_t locus_create(struct view *view, position_t offset)
 {
 	locus_t locus;
@@ -15,6 +15,7 @@ typedef unsigned locus_t;
 #define DEFAULT_LOCI (MARK+1)
 
 #define UNSET (~0)
+#define DELETED (UNSET-1)
 
 struct view;
 
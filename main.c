@@ -46,16 +46,13 @@ static void save_all(void)
 {
 	struct text *text;
 	Boolean_t msg = FALSE;
-	char *raw;
 
 	for (text = text_list; text; text = text->next) {
 		if (!text->path || !text->buffer || !text->buffer->path)
 			continue;
 		text_unfold_all(text);
-		if (text->clean &&
-		    buffer_raw(text->buffer, &raw, 0, ~(size_t)0) ==
-			text->clean_bytes &&
-		    !memcmp(text->clean, raw, text->clean_bytes)) {
+		if (text_hash_is_saved(text) ||
+		    text->compressor && text->preserved == text->dirties) {
 			unlink(text->buffer->path);
 			continue;
 		}
@@ -85,7 +82,7 @@ int main(int argc, char *const *argv)
 	if (!make_writable)
 		make_writable = getenv("AOEUI_WRITABLE");
 
-	while ((ch = getopt(argc, argv, "dkoqrsSt:uUw:")) >= 0)
+	while ((ch = getopt(argc, argv, "dkl:oqrsSt:uUw:")) >= 0)
 		switch (ch) {
 		case 'd':
 			is_asdfg = FALSE;
@@ -93,6 +90,13 @@ int main(int argc, char *const *argv)
 		case 'k':
 			no_keywords = TRUE;
 			break;
+		case 'l':
+			value = atoi(optarg);
+			if (value >= 0 && value <= 1000)
+				max_latency = value;
+			else
+				message("bad latency setting: %s", optarg);
+			break;
 		case 'o':
 			no_save_originals = TRUE;
 			break;
@@ -0,0 +1,428 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	While a search is under way, the matches of its pattern in a
+ *	text are cached as intervals, together with the ranges of the
+ *	text that have been scanned for them, so that windows can
+ *	highlight every visible match without searching anew on each
+ *	repaint.  Edits are reported with the offsets that go into the
+ *	undo log; they shift the cached intervals and discard only the
+ *	matches that could have seen the bytes that they touched, which
+ *	is as far back as the pattern's longest match can reach, or to
+ *	the start of the line if that's nearer or the length unbounded.
+ *	(Patterns that can match a newline and that have no bound on
+ *	their length lose the whole cache instead, and its serial
+ *	changes, since any match may have.)  A span known to lie
+ *	within a line is kept so that the start of a long line need
+ *	not be looked for anew on each edit and repaint.
+ *
+ *	The cache also serves to count all of the matches in the
+ *	background, a slice at a time.  When a literal pattern grows
+ *	by a character, its new matches are among the old ones, which
+ *	are just filtered instead of being found anew.
+ */
+
+struct matches {
+	char *pattern;
+	size_t bytes;
+	Boolean_t regex, multiline;
+	sposition_t longest;		/* -1 when unbounded */
+	unsigned serial;
+	struct literal *literal;
+	struct regexp *regexp;
+	struct interval *match;		/* sorted by start */
+	unsigned matches, match_alloc;
+	struct interval *scanned;	/* sorted and disjoint */
+	unsigned ranges, range_alloc;
+	position_t line, line_end;	/* no newline in [line,line_end),
+					 * and line starts one */
+};
+
+static size_t text_bytes(struct text *text)
+{
+	if (text->buffer)
+		return buffer_bytes(text->buffer);
+	return text->clean ? text->clean_bytes : 0;
+}
+
+/* Returns the start of the line that contains "offset", or
+ * offset-limit if that's later.
+ */
+static position_t line_start(struct text *text, position_t offset,
+			     size_t limit)
+{
+	struct matches *matches = text->matches;
+	position_t at = offset, stop = 0;
+
+	if (offset >= matches->line && offset <= matches->line_end)
+		at = matches->line;
+	else if (offset > matches->line_end)
+		stop = matches->line_end;
+	for (; at > stop && offset - at < limit; at--)
+		if (text_byte(text, at-1) == '\n')
+			break;
+	if (at > stop && text_byte(text, at-1) != '\n')
+		return at;
+	if (at == stop && stop)
+		at = matches->line;
+	if (at < matches->line || offset > matches->line_end) {
+		matches->line = at;
+		matches->line_end = offset;
+	}
+	return offset - at > limit ? offset - limit : at;
+}
+
+void text_matches_destroy(struct text *text)
+{
+	struct matches *matches = text->matches;
+
+	if (!matches)
+		return;
+	RELEASE(matches->pattern);
+	literal_destroy(matches->literal);
+	regexp_destroy(matches->regexp);
+	RELEASE(matches->match);
+	RELEASE(matches->scanned);
+	RELEASE(matches);
+	text->matches = NULL;
+}
+
+static unsigned serial;
+
+/* Keeps the matches of a literal pattern that are also
+ * matches of its extension by one more character.
+ */
+static void narrow(struct text *text, const char *pattern, size_t bytes)
+{
+	struct matches *matches = text->matches;
+	struct literal *literal = literal_create(pattern, bytes, TRUE);
+	struct spans spans;
+	struct interval *x;
+	unsigned j, k;
+
+	text_spans(text, &spans);
+	for (j = k = 0; j < matches->matches; j++) {
+		x = &matches->match[j];
+		if (literal_find(literal, &spans, x->start, x->start + 1) < 0)
+			continue;
+		x->end = x->start + bytes;
+		matches->match[k++] = *x;
+	}
+	matches->matches = k;
+	literal_destroy(matches->literal);
+	matches->literal = literal;
+	matches->pattern = reallocate(matches->pattern, bytes);
+	memcpy(matches->pattern, pattern, bytes);
+	matches->bytes = bytes;
+	matches->longest = bytes;
+	matches->serial = ++serial;
+}
+
+/* Sets the pattern whose matches are to be cached; a null
+ * or empty pattern discards the cache.
+ */
+void text_matches_use(struct text *text, const char *pattern, size_t bytes,
+		      Boolean_t regex)
+{
+	struct matches *matches = text->matches;
+	struct literal *literal = NULL;
+	struct regexp *regexp = NULL;
+
+	if (matches &&
+	    matches->regex == regex &&
+	    matches->bytes == bytes &&
+	    !memcmp(matches->pattern, pattern, bytes))
+		return;
+	if (matches && !regex && !matches->regex &&
+	    bytes == matches->bytes + 1 &&
+	    !memcmp(matches->pattern, pattern, matches->bytes)) {
+		narrow(text, pattern, bytes);
+		return;
+	}
+	text_matches_destroy(text);
+	if (!pattern || !bytes)
+		return;
+	if (regex) {
+		if (!(regexp = regexp_compile(pattern, bytes, TRUE)))
+			return;
+	} else
+		literal = literal_create(pattern, bytes, TRUE);
+
+	matches = text->matches = allocate0(sizeof *matches);
+	matches->pattern = allocate(bytes);
+	memcpy(matches->pattern, pattern, bytes);
+	matches->bytes = bytes;
+	matches->regex = regex;
+	matches->multiline = regexp && regexp_multiline(regexp);
+	matches->longest = regexp ? regexp_longest(regexp) : (sposition_t) bytes;
+	matches->serial = ++serial;
+	matches->literal = literal;
+	matches->regexp = regexp;
+}
+
+/* Changes whenever the cached pattern does. */
+unsigned text_matches_serial(struct text *text)
+{
+	return text->matches ? text->matches->serial : 0;
+}
+
+/* Index of the first match that starts at or after an offset */
+static unsigned first_match(struct matches *matches, position_t offset)
+{
+	unsigned lo = 0, hi = matches->matches, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (matches->match[mid].start < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void insert_match(struct matches *matches, unsigned at,
+			 position_t start, position_t end)
+{
+	if (matches->matches == matches->match_alloc) {
+		matches->match_alloc = matches->match_alloc * 2 + 64;
+		matches->match = reallocate(matches->match,
+					    matches->match_alloc *
+					    sizeof *matches->match);
+	}
+	memmove(matches->match + at + 1, matches->match + at,
+		(matches->matches - at) * sizeof *matches->match);
+	matches->match[at].start = start;
+	matches->match[at].end = end;
+	matches->matches++;
+}
+
+/* Records that [start,end) has been scanned. */
+static void covered(struct matches *matches, position_t start, position_t end)
+{
+	struct interval *range;
+	unsigned j, k;
+
+	for (j = 0; j < matches->ranges; j++)
+		if (matches->scanned[j].end >= start)
+			break;
+	for (k = j; k < matches->ranges; k++) {
+		range = &matches->scanned[k];
+		if (range->start > end)
+			break;
+		if (range->start < start)
+			start = range->start;
+		if (range->end > end)
+			end = range->end;
+	}
+	if (k == j) {
+		if (matches->ranges == matches->range_alloc) {
+			matches->range_alloc = matches->range_alloc * 2 + 16;
+			matches->scanned = reallocate(matches->scanned,
+						      matches->range_alloc *
+						      sizeof *matches->scanned);
+		}
+		memmove(matches->scanned + j + 1, matches->scanned + j,
+			(matches->ranges - j) * sizeof *matches->scanned);
+		matches->ranges++;
+	} else {
+		memmove(matches->scanned + j + 1, matches->scanned + k,
+			(matches->ranges - k) * sizeof *matches->scanned);
+		matches->ranges -= k - j - 1;
+	}
+	matches->scanned[j].start = start;
+	matches->scanned[j].end = end;
+}
+
+/* Finds all of the matches that start in [start,end). */
+static void scan(struct text *text, position_t start, position_t end)
+{
+	struct matches *matches = text->matches;
+	struct submatch sub[SUBMATCHES];
+	struct spans spans;
+	unsigned j = first_match(matches, start);
+	sposition_t at;
+
+	text_spans(text, &spans);
+	for (at = start; ; at++) {
+		if (matches->regexp) {
+			at = regexp_find(matches->regexp, &spans,
+					 at, end, sub);
+			if (at < 0)
+				break;
+			if (sub[0].end > at)
+				insert_match(matches, j++, at, sub[0].end);
+		} else {
+			at = literal_find(matches->literal, &spans, at, end);
+			if (at < 0)
+				break;
+			insert_match(matches, j++, at, at + matches->bytes);
+		}
+	}
+	covered(matches, start, end);
+}
+
+/* Returns the cached matches that may overlap [from,to),
+ * after scanning any part of it that hasn't been scanned.
+ */
+const struct interval *text_matches(struct text *text, position_t from,
+				    position_t to, unsigned *count)
+{
+	struct matches *matches = text->matches;
+	size_t bytes = text_bytes(text);
+	position_t at, gap;
+	unsigned j;
+
+	*count = 0;
+	if (!matches)
+		return NULL;
+	if (to > bytes)
+		to = bytes;
+	if (!matches->multiline)
+		from = line_start(text, from, matches->longest < 0 ?
+				  ~(size_t)0 : matches->longest);
+	else if (matches->longest >= 0)
+		from -= from < matches->longest ? from : matches->longest;
+	for (at = from; at < to; at = gap) {
+		for (j = 0; j < matches->ranges; j++)
+			if (matches->scanned[j].end > at)
+				break;
+		if (j < matches->ranges && matches->scanned[j].start <= at) {
+			gap = matches->scanned[j].end;
+			continue;
+		}
+		gap = j < matches->ranges && matches->scanned[j].start < to ?
+			matches->scanned[j].start : to;
+		scan(text, at, gap);
+	}
+	j = first_match(matches, from);
+	*count = first_match(matches, to) - j;
+	return matches->match + j;
+}
+
+/* Scans up to "budget" more bytes of [from,to) for matches.  Once
+ * all of it has been scanned, returns TRUE with the number of matches
+ * that start in [from,to) and the number of those that precede "at".
+ */
+Boolean_t text_matches_count(struct text *text, position_t from,
+			     position_t to, position_t at, size_t budget,
+			     unsigned *before, unsigned *total)
+{
+	struct matches *matches = text->matches;
+	position_t offset, gap, end;
+	unsigned j, first;
+
+	if (!matches)
+		return FALSE;
+	for (j = 0, offset = from; offset < to; offset = gap) {
+		for (; j < matches->ranges; j++)
+			if (matches->scanned[j].end > offset)
+				break;
+		if (j < matches->ranges &&
+		    matches->scanned[j].start <= offset) {
+			gap = matches->scanned[j].end;
+			continue;
+		}
+		if (!budget)
+			return FALSE;
+		gap = j < matches->ranges && matches->scanned[j].start < to ?
+			matches->scanned[j].start : to;
+		end = gap - offset > budget ? offset + budget : gap;
+		scan(text, offset, end);
+		budget -= end - offset;
+		j = 0;
+		gap = end;
+	}
+	first = first_match(matches, from);
+	*before = first_match(matches, at) - first;
+	*total = first_match(matches, to) - first;
+	return TRUE;
+}
+
+/* The bytes at [offset,offset+removed) have been replaced
+ * with the "added" bytes now at [offset,offset+added).
+ */
+static void edited(struct text *text, position_t offset,
+		   size_t removed, size_t added)
+{
+	struct matches *matches = text->matches;
+	size_t reach;
+	position_t lo, hi;
+	struct interval *x, *ranges;
+	unsigned j, k;
+
+	if (!matches)
+		return;
+	if (matches->line > offset)
+		matches->line = matches->line_end = 0;
+	else if (matches->line_end > offset)
+		matches->line_end = offset;
+	if (!matches->ranges)
+		return;
+	if (matches->multiline && matches->longest < 0) {
+		matches->matches = matches->ranges = 0;
+		matches->serial = ++serial;
+		return;
+	}
+
+	/* Discard the matches that could have seen the touched bytes
+	 * or the one before them, in old offsets [lo,hi); there are
+	 * none before the first range that has been scanned.
+	 */
+	reach = matches->longest < 0 ? ~(size_t)0 : matches->longest + 1;
+	if (offset < matches->scanned[0].start)
+		reach = 0;
+	else if (reach > offset - matches->scanned[0].start)
+		reach = offset - matches->scanned[0].start;
+	if (matches->multiline)
+		lo = offset - reach;
+	else
+		lo = line_start(text, offset, reach);
+	hi = offset + removed + 1;
+
+	for (j = k = 0; j < matches->matches; j++) {
+		x = &matches->match[j];
+		if (x->start >= hi) {
+			x->start += added - removed;
+			x->end += added - removed;
+		} else if (x->start >= lo)
+			continue;
+		matches->match[k++] = *x;
+	}
+	matches->matches = k;
+
+	ranges = allocate((matches->ranges + 1) * sizeof *ranges);
+	for (j = k = 0; j < matches->ranges; j++) {
+		x = &matches->scanned[j];
+		if (x->end <= lo)
+			ranges[k++] = *x;
+		else if (x->start >= hi) {
+			ranges[k].start = x->start + added - removed;
+			ranges[k++].end = x->end + added - removed;
+		} else {
+			if (x->start < lo) {
+				ranges[k].start = x->start;
+				ranges[k++].end = lo;
+			}
+			if (x->end > hi) {
+				ranges[k].start = hi + added - removed;
+				ranges[k++].end = x->end + added - removed;
+			}
+		}
+	}
+	RELEASE(matches->scanned);
+	matches->scanned = ranges;
+	matches->range_alloc = matches->ranges + 1;
+	matches->ranges = k;
+}
+
+void text_matches_inserted(struct text *text, position_t offset, size_t bytes)
+{
+	edited(text, offset, 0, bytes);
+}
+
+void text_matches_deleted(struct text *text, position_t offset, size_t bytes)
+{
+	edited(text, offset, bytes, 0);
+}
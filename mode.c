@@ -173,6 +173,65 @@ static position_t self_insert(struct view *view, Unicode_t ch,
 	return cursor + len;
 }
 
+/* A bracketed paste is inserted as it came, without the indentation
+ * that typing its newlines would add, and as a single edit, save in
+ * a shell window, whose lines must be sent as they're completed.
+ */
+static void paste_text(struct view *view, position_t mark,
+		       position_t old_cursor)
+{
+	size_t bytes, j, n, len = 0;
+	char *text = window_paste(&bytes), *out = text;
+	position_t cursor = old_cursor;
+	Unicode_t ch;
+
+	if (!text)
+		return;
+	if (view->shell_std_in >= 0) {
+		for (j = 0; j < bytes; j += n) {
+			n = utf8_length(text + j, bytes - j);
+			cursor = self_insert(view, utf8_unicode(text + j, n),
+					     mark, cursor);
+			mark = locus_get(view, MARK);
+		}
+		RELEASE(text);
+		return;
+	}
+	if (mark != UNSET && mark > cursor) {
+		cursor = cut(view, 1);
+		mark = UNSET;
+	}
+	if (view->text->flags & (TEXT_CRNL | TEXT_NO_UTF8)) {
+		out = allocate(bytes * 2);
+		for (j = 0; j < bytes; j += n) {
+			n = utf8_length(text + j, bytes - j);
+			if (text[j] == '\n' &&
+			    view->text->flags & TEXT_CRNL) {
+				memcpy(out + len, "\r\n", 2);
+				len += 2;
+			} else if (view->text->flags & TEXT_NO_UTF8) {
+				ch = utf8_unicode(text + j, n);
+				if (ch >> 24)
+					out[len++] = ch >> 24;
+				if (ch >> 16)
+					out[len++] = ch >> 16;
+				if (ch >> 8)
+					out[len++] = ch >> 8;
+				out[len++] = ch;
+			} else {
+				memcpy(out + len, text + j, n);
+				len += n;
+			}
+		}
+		RELEASE(text);
+	} else
+		len = bytes;
+	view_insert(view, out, cursor, len);
+	if (mark == old_cursor)
+		locus_set(view, MARK, old_cursor);
+	RELEASE(out);
+}
+
 static void command_handler(struct view *view, Unicode_t ch0)
 {
 	struct mode_default *mode = (struct mode_default *) view->mode;
@@ -230,6 +289,9 @@ delete:		if (IS_UNICODE(view_char_prior(view, cursor, &mark)))
 		case FUNCTION_INSERT:
 			paste(view);
 			break;
+		case FUNCTION_PASTE:
+			paste_text(view, mark, cursor);
+			break;
 		case FUNCTION_DELETE:
 			goto delete;
 		default:
@@ -312,6 +374,16 @@ delete:		if (IS_UNICODE(view_char_prior(view, cursor, &mark)))
 						locus_set(view, MARK, mark);
 				}
 				goto done;
+			case '/':
+			case '*':
+				grep(view, ch == '*');
+				goto done;
+			case '%':
+				grep_replace(view);
+				goto done;
+			case '@':
+				mode_finder(view);
+				goto done;
 			case '#':
 				status("%s line %d", view->text->path,
 				       current_line_number(view, cursor));
@@ -14,5 +14,6 @@ struct mode {
 extern Boolean_t is_asdfg;
 struct mode *mode_default(void);
 void mode_search(struct view *, Boolean_t regex);
+void mode_finder(struct view *);
 
 #endif
@@ -0,0 +1,1028 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	Regular expressions
+ *
+ *	POSIX extended regular expressions, optionally ignoring case,
+ *	with the semantics of REG_NEWLINE (. and [^...] never match a
+ *	newline, ^ and $ match at line boundaries) are compiled into a
+ *	program for a Thompson NFA.
+ *
+ *	A search first runs a DFA whose states are sets of NFA threads;
+ *	the states and their transitions are built only as the text
+ *	calls for them and are cached with the expression, so repeated
+ *	searches get cheaper.  That finds whether a match begins in the
+ *	range of interest and also the last point before it at which no
+ *	partial match was pending.  From that point the NFA is simulated
+ *	with capture positions (a "Pike VM") to find the leftmost-longest
+ *	match and its subexpressions.  When every match must begin with
+ *	some literal string, the DFA skips over the text between its
+ *	occurrences with the literal searcher.
+ *
+ *	Texts are read in place from their spans on either side of the
+ *	gap of their buffers.
+ */
+
+enum opcode { CLASS, SPLIT, JUMP, SAVE, ASSERT, MATCH };
+enum assertion { BOL, EOL, WORD_EDGE, NOT_WORD_EDGE, WORD_BEGIN, WORD_END };
+enum context { LINE, WORD, OTHER };	/* sorts of adjacent characters */
+
+struct inst {
+	enum opcode op;
+	unsigned x, y;		/* class, targets, save slot, assertion */
+};
+
+typedef Byte_t set_t[0x20];
+
+#define SAVES (2*SUBMATCHES)
+#define MAX_INSTS 4096
+#define MAX_REPEAT 255
+#define STATES 1024
+#define BUCKETS 1024
+
+struct state {
+	struct state *next[0x100];
+	set_t matched;		/* a match ends just before the byte */
+	signed char at_end;	/* a match ends at the end; -1 if unknown */
+	Byte_t context, anchored;
+	unsigned count, hash;
+	unsigned *set;		/* sorted pcs of pending threads */
+	struct state *chain, *link;
+};
+
+struct regexp {
+	struct inst *prog;
+	unsigned insts, alloc;
+	set_t *class;
+	unsigned classes;
+	Boolean_t ignore_case;
+	struct literal *prefix;
+	sposition_t longest;	/* bytes in a match at most; -1 unbounded */
+
+	/* scratch space */
+	unsigned *stack, *work, *mark, generation;
+	unsigned *pcs[2];
+	sposition_t *saves[2];
+
+	/* DFA cache */
+	struct state *bucket[BUCKETS], *states;
+	unsigned cached, flushes;
+};
+
+/* Parse trees */
+enum kind { K_CLASS, K_ASSERT, K_EMPTY, K_CAT, K_ALT, K_REPEAT, K_GROUP };
+
+struct node {
+	enum kind kind;
+	unsigned x;		/* class, assertion, group */
+	int min, max;		/* repetition; max < 0 is unbounded */
+	int left, right;
+};
+
+struct parser {
+	const Byte_t *p, *end;
+	struct regexp *re;
+	struct node *node;
+	unsigned nodes, alloc, groups;
+	Boolean_t error;
+};
+
+INLINE Boolean_t in_set(const Byte_t *set, unsigned ch)
+{
+	return (set[ch >> 3] >> (ch & 7)) & 1;
+}
+
+INLINE void add_to_set(Byte_t *set, unsigned ch)
+{
+	set[ch >> 3] |= 1 << (ch & 7);
+}
+
+static int is_word(unsigned ch)
+{
+	return ch < 0x80 && (isalnum(ch) || ch == '_');
+}
+
+static enum context context(unsigned ch)
+{
+	if (ch == '\n')
+		return LINE;
+	return is_word(ch) ? WORD : OTHER;
+}
+
+INLINE unsigned byte_at(const struct spans *spans, position_t pos)
+{
+	if (pos < spans->bytes[0])
+		return spans->data[0][pos];
+	return spans->data[1][pos - spans->bytes[0]];
+}
+
+static enum context context_before(const struct spans *spans, position_t pos)
+{
+	return pos ? context(byte_at(spans, pos-1)) : LINE;
+}
+
+static Boolean_t holds(enum assertion assertion, enum context prev,
+		       enum context next)
+{
+	switch (assertion) {
+	case BOL:
+		return prev == LINE;
+	case EOL:
+		return next == LINE;
+	case WORD_EDGE:
+		return (prev == WORD) != (next == WORD);
+	case NOT_WORD_EDGE:
+		return (prev == WORD) == (next == WORD);
+	case WORD_BEGIN:
+		return prev != WORD && next == WORD;
+	case WORD_END:
+		return prev == WORD && next != WORD;
+	}
+	return FALSE;
+}
+
+/* Parsing */
+
+static int node(struct parser *ps, enum kind kind, int left, int right)
+{
+	struct node *node;
+
+	if (ps->nodes == ps->alloc) {
+		ps->alloc = ps->alloc * 2 + 16;
+		ps->node = reallocate(ps->node, ps->alloc * sizeof *ps->node);
+	}
+	node = &ps->node[ps->nodes];
+	memset(node, 0, sizeof *node);
+	node->kind = kind;
+	node->left = left;
+	node->right = right;
+	return ps->nodes++;
+}
+
+static int class_node(struct parser *ps, const Byte_t *set, Boolean_t negate)
+{
+	struct regexp *re = ps->re;
+	Byte_t *class;
+	unsigned ch;
+	int n;
+
+	re->class = reallocate(re->class, (re->classes+1) * sizeof *re->class);
+	class = re->class[re->classes];
+	memcpy(class, set, sizeof *re->class);
+	if (re->ignore_case)
+		for (ch = 'a'; ch <= 'z'; ch++)
+			if (in_set(class, ch) || in_set(class, ch + 'A' - 'a')) {
+				add_to_set(class, ch);
+				add_to_set(class, ch + 'A' - 'a');
+			}
+	if (negate) {
+		for (ch = 0; ch < sizeof *re->class; ch++)
+			class[ch] ^= 0xff;
+		class['\n' >> 3] &= ~(1 << ('\n' & 7));
+	}
+	n = node(ps, K_CLASS, -1, -1);
+	ps->node[n].x = re->classes++;
+	return n;
+}
+
+static int char_node(struct parser *ps, unsigned ch)
+{
+	set_t set;
+
+	memset(set, 0, sizeof set);
+	add_to_set(set, ch);
+	return class_node(ps, set, FALSE);
+}
+
+static int assert_node(struct parser *ps, enum assertion assertion)
+{
+	int n = node(ps, K_ASSERT, -1, -1);
+	ps->node[n].x = assertion;
+	return n;
+}
+
+static Boolean_t named_class(Byte_t *set, const char *name, size_t bytes)
+{
+	static struct {
+		const char *name;
+		int (*test)(int);
+	} classes[] = {
+		{ "alnum", isalnum }, { "alpha", isalpha },
+		{ "blank", isblank }, { "cntrl", iscntrl },
+		{ "digit", isdigit }, { "graph", isgraph },
+		{ "lower", islower }, { "print", isprint },
+		{ "punct", ispunct }, { "space", isspace },
+		{ "upper", isupper }, { "xdigit", isxdigit },
+		{ NULL, NULL }
+	};
+	int j;
+	unsigned ch;
+
+	for (j = 0; classes[j].name; j++)
+		if (strlen(classes[j].name) == bytes &&
+		    !strncmp(classes[j].name, name, bytes)) {
+			for (ch = 0; ch < 0x80; ch++)
+				if (classes[j].test(ch))
+					add_to_set(set, ch);
+			return TRUE;
+		}
+	return FALSE;
+}
+
+static int bracket(struct parser *ps)
+{
+	set_t set;
+	Boolean_t negate = FALSE, first = TRUE;
+	const Byte_t *name;
+	unsigned lo, hi;
+
+	memset(set, 0, sizeof set);
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = TRUE;
+		ps->p++;
+	}
+	for (;;) {
+		if (ps->p >= ps->end) {
+			ps->error = TRUE;
+			return -1;
+		}
+		lo = *ps->p++;
+		if (lo == ']' && !first)
+			break;
+		first = FALSE;
+		if (lo == '[' && ps->p < ps->end && *ps->p == ':') {
+			for (name = ++ps->p; ps->p + 1 < ps->end; ps->p++)
+				if (ps->p[0] == ':' && ps->p[1] == ']')
+					break;
+			if (ps->p + 1 >= ps->end ||
+			    !named_class(set, (const char *) name,
+					 ps->p - name)) {
+				ps->error = TRUE;
+				return -1;
+			}
+			ps->p += 2;
+			continue;
+		}
+		if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+			hi = ps->p[1];
+			ps->p += 2;
+			if (hi < lo) {
+				ps->error = TRUE;
+				return -1;
+			}
+		} else
+			hi = lo;
+		for (; lo <= hi; lo++)
+			add_to_set(set, lo);
+	}
+	return class_node(ps, set, negate);
+}
+
+/* \W and \S, unlike [^...] and ".", match a newline, as they do
+ * in glibc's regexec() even with REG_NEWLINE.
+ */
+static int escape(struct parser *ps)
+{
+	set_t set;
+	unsigned ch;
+
+	if (ps->p >= ps->end) {
+		ps->error = TRUE;
+		return -1;
+	}
+	switch (ch = *ps->p++) {
+	case 'b':
+		return assert_node(ps, WORD_EDGE);
+	case 'B':
+		return assert_node(ps, NOT_WORD_EDGE);
+	case '<':
+		return assert_node(ps, WORD_BEGIN);
+	case '>':
+		return assert_node(ps, WORD_END);
+	case 'w':
+	case 'W':
+		memset(set, 0, sizeof set);
+		for (ch = 0; ch < 0x80; ch++)
+			if (is_word(ch))
+				add_to_set(set, ch);
+		break;
+	case 's':
+	case 'S':
+		memset(set, 0, sizeof set);
+		named_class(set, "space", 5);
+		break;
+	default:
+		return char_node(ps, ch);
+	}
+	if (isupper(ps->p[-1]))
+		for (ch = 0; ch < sizeof set; ch++)
+			set[ch] ^= 0xff;
+	return class_node(ps, set, FALSE);
+}
+
+static int alternation(struct parser *);
+
+static int primary(struct parser *ps)
+{
+	unsigned ch = *ps->p++, group;
+	set_t set;
+	int n;
+
+	switch (ch) {
+	case '(':
+		group = ++ps->groups;
+		n = alternation(ps);
+		if (ps->p >= ps->end || *ps->p != ')') {
+			ps->error = TRUE;
+			return n;
+		}
+		ps->p++;
+		n = node(ps, K_GROUP, n, -1);
+		ps->node[n].x = group;
+		return n;
+	case '.':
+		memset(set, 0, sizeof set);
+		add_to_set(set, '\n');
+		return class_node(ps, set, TRUE);
+	case '^':
+		return assert_node(ps, BOL);
+	case '$':
+		return assert_node(ps, EOL);
+	case '[':
+		return bracket(ps);
+	case '\\':
+		return escape(ps);
+	}
+	return char_node(ps, ch);
+}
+
+/* Parses a {min,max} bound, if there is one. */
+static Boolean_t bound(struct parser *ps, int *min, int *max)
+{
+	const Byte_t *p = ps->p + 1;
+
+	if (p >= ps->end || !isdigit(*p))
+		return FALSE;
+	for (*min = 0; p < ps->end && isdigit(*p); p++)
+		if ((*min = *min * 10 + *p - '0') > MAX_REPEAT)
+			break;
+	*max = *min;
+	if (p < ps->end && *p == ',') {
+		*max = -1;
+		if (++p < ps->end && isdigit(*p))
+			for (*max = 0; p < ps->end && isdigit(*p); p++)
+				if ((*max = *max * 10 + *p - '0') > MAX_REPEAT)
+					break;
+	}
+	if (p >= ps->end || *p != '}' ||
+	    *min > MAX_REPEAT || *max > MAX_REPEAT ||
+	    *max >= 0 && *max < *min)
+		ps->error = TRUE;
+	else
+		ps->p = p + 1;
+	return TRUE;
+}
+
+static int repetition(struct parser *ps)
+{
+	int n = primary(ps), min, max;
+
+	while (!ps->error && ps->p < ps->end) {
+		switch (*ps->p) {
+		case '*':
+			min = 0, max = -1;
+			break;
+		case '+':
+			min = 1, max = -1;
+			break;
+		case '?':
+			min = 0, max = 1;
+			break;
+		case '{':
+			if (bound(ps, &min, &max))
+				goto repeat;
+			/* fall through */
+		default:
+			return n;
+		}
+		ps->p++;
+repeat:		n = node(ps, K_REPEAT, n, -1);
+		ps->node[n].min = min;
+		ps->node[n].max = max;
+	}
+	return n;
+}
+
+static int concatenation(struct parser *ps)
+{
+	int n = -1, next;
+
+	while (!ps->error && ps->p < ps->end &&
+	       *ps->p != '|' && *ps->p != ')') {
+		next = repetition(ps);
+		n = n < 0 ? next : node(ps, K_CAT, n, next);
+	}
+	return n < 0 ? node(ps, K_EMPTY, -1, -1) : n;
+}
+
+static int alternation(struct parser *ps)
+{
+	int n = concatenation(ps);
+
+	while (!ps->error && ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		n = node(ps, K_ALT, n, concatenation(ps));
+	}
+	return n;
+}
+
+/* Code generation */
+
+static unsigned emit(struct regexp *re, enum opcode op, unsigned x, unsigned y)
+{
+	if (re->insts == re->alloc) {
+		re->alloc = re->alloc * 2 + 32;
+		re->prog = reallocate(re->prog, re->alloc * sizeof *re->prog);
+	}
+	re->prog[re->insts].op = op;
+	re->prog[re->insts].x = x;
+	re->prog[re->insts].y = y;
+	return re->insts++;
+}
+
+static Boolean_t generate(struct regexp *re, const struct node *tree, int n)
+{
+	const struct node *node = &tree[n];
+	unsigned split, jump, *pending;
+	int j;
+
+	if (re->insts > MAX_INSTS)
+		return FALSE;
+	switch (node->kind) {
+	case K_CLASS:
+		emit(re, CLASS, node->x, 0);
+		break;
+	case K_ASSERT:
+		emit(re, ASSERT, node->x, 0);
+		break;
+	case K_EMPTY:
+		break;
+	case K_CAT:
+		return	generate(re, tree, node->left) &&
+			generate(re, tree, node->right);
+	case K_ALT:
+		split = emit(re, SPLIT, re->insts+1, 0);
+		if (!generate(re, tree, node->left))
+			return FALSE;
+		jump = emit(re, JUMP, 0, 0);
+		re->prog[split].y = re->insts;
+		if (!generate(re, tree, node->right))
+			return FALSE;
+		re->prog[jump].x = re->insts;
+		break;
+	case K_GROUP:
+		if (node->x < SUBMATCHES)
+			emit(re, SAVE, 2*node->x, 0);
+		if (!generate(re, tree, node->left))
+			return FALSE;
+		if (node->x < SUBMATCHES)
+			emit(re, SAVE, 2*node->x+1, 0);
+		break;
+	case K_REPEAT:
+		for (j = 0; j < node->min; j++) {
+			if (node->max < 0 && j+1 == node->min) {
+				/* e+ */
+				split = re->insts;
+				if (!generate(re, tree, node->left))
+					return FALSE;
+				emit(re, SPLIT, split, re->insts+1);
+				return TRUE;
+			}
+			if (!generate(re, tree, node->left))
+				return FALSE;
+		}
+		if (node->max < 0) {
+			/* e* */
+			split = emit(re, SPLIT, re->insts+1, 0);
+			if (!generate(re, tree, node->left))
+				return FALSE;
+			emit(re, JUMP, split, 0);
+			re->prog[split].y = re->insts;
+			break;
+		}
+		pending = allocate((node->max - node->min + 1) *
+				   sizeof *pending);
+		for (j = node->min; j < node->max; j++) {
+			pending[j - node->min] = emit(re, SPLIT,
+						      re->insts+1, 0);
+			if (!generate(re, tree, node->left)) {
+				RELEASE(pending);
+				return FALSE;
+			}
+		}
+		for (j = node->min; j < node->max; j++)
+			re->prog[pending[j - node->min]].y = re->insts;
+		RELEASE(pending);
+		break;
+	}
+	return re->insts <= MAX_INSTS;
+}
+
+#define MAX_LONGEST (1 << 20)	/* treated as unbounded beyond */
+
+/* The length of the longest match of a subtree, or -1 */
+static sposition_t longest(const struct node *tree, int n)
+{
+	const struct node *node = &tree[n];
+	sposition_t left, right;
+
+	switch (node->kind) {
+	case K_CLASS:
+		return 1;
+	case K_ASSERT:
+	case K_EMPTY:
+		return 0;
+	case K_GROUP:
+		return longest(tree, node->left);
+	case K_CAT:
+	case K_ALT:
+		left = longest(tree, node->left);
+		right = longest(tree, node->right);
+		if (left < 0 || right < 0)
+			return -1;
+		if (node->kind == K_ALT)
+			return left > right ? left : right;
+		left += right;
+		break;
+	case K_REPEAT:
+		if ((left = longest(tree, node->left)) < 0 || node->max < 0)
+			return left && node->max ? -1 : 0;
+		left *= node->max;
+		break;
+	default:
+		return -1;
+	}
+	return left > MAX_LONGEST ? -1 : left;
+}
+
+/* Returns the byte that a class matches, if it matches only one
+ * (or only the two cases of one letter when case is ignored).
+ */
+static int single(struct regexp *re, unsigned class)
+{
+	unsigned ch, count = 0;
+	int found = -1;
+
+	for (ch = 0; ch < 0x100; ch++)
+		if (in_set(re->class[class], ch)) {
+			count++;
+			if (found < 0)
+				found = ch;
+		}
+	if (count == 1)
+		return found;
+	if (count == 2 && re->ignore_case && found >= 'A' && found <= 'Z' &&
+	    in_set(re->class[class], found + 'a' - 'A'))
+		return found;
+	return -1;
+}
+
+static void find_prefix(struct regexp *re)
+{
+	char prefix[64];
+	size_t bytes = 0;
+	unsigned pc = 0;
+	int ch;
+
+	while (bytes < sizeof prefix) {
+		if (re->prog[pc].op == SAVE)
+			pc++;
+		else if (re->prog[pc].op == CLASS &&
+			 (ch = single(re, re->prog[pc].x)) >= 0) {
+			prefix[bytes++] = ch;
+			pc++;
+		} else
+			break;
+	}
+	if (bytes)
+		re->prefix = literal_create(prefix, bytes, re->ignore_case);
+}
+
+struct regexp *regexp_compile(const char *pattern, size_t bytes,
+			      Boolean_t ignore_case)
+{
+	struct regexp *re = allocate0(sizeof *re);
+	struct parser ps;
+	int root;
+
+	memset(&ps, 0, sizeof ps);
+	ps.p = (const Byte_t *) pattern;
+	ps.end = ps.p + bytes;
+	ps.re = re;
+	re->ignore_case = ignore_case;
+	root = alternation(&ps);
+	if (ps.p < ps.end)
+		ps.error = TRUE;	/* unmatched ) */
+	if (!ps.error) {
+		emit(re, SAVE, 0, 0);
+		if (!generate(re, ps.node, root))
+			ps.error = TRUE;
+		re->longest = longest(ps.node, root);
+		emit(re, SAVE, 1, 0);
+		emit(re, MATCH, 0, 0);
+	}
+	RELEASE(ps.node);
+	if (ps.error) {
+		regexp_destroy(re);
+		return NULL;
+	}
+
+	find_prefix(re);
+	re->stack = allocate(3 * re->insts * sizeof *re->stack);
+	re->work = allocate(re->insts * sizeof *re->work);
+	re->mark = allocate0(re->insts * sizeof *re->mark);
+	re->pcs[0] = allocate((re->insts+1) * sizeof *re->pcs[0]);
+	re->pcs[1] = allocate((re->insts+1) * sizeof *re->pcs[1]);
+	re->saves[0] = allocate((re->insts+1) * SAVES * sizeof *re->saves[0]);
+	re->saves[1] = allocate((re->insts+1) * SAVES * sizeof *re->saves[1]);
+	return re;
+}
+
+static void flush(struct regexp *re)
+{
+	struct state *state;
+
+	while ((state = re->states)) {
+		re->states = state->link;
+		RELEASE(state->set);
+		RELEASE(state);
+	}
+	memset(re->bucket, 0, sizeof re->bucket);
+	re->cached = 0;
+	re->flushes++;
+}
+
+void regexp_destroy(struct regexp *re)
+{
+	if (!re)
+		return;
+	flush(re);
+	literal_destroy(re->prefix);
+	RELEASE(re->prog);
+	RELEASE(re->class);
+	RELEASE(re->stack);
+	RELEASE(re->work);
+	RELEASE(re->mark);
+	RELEASE(re->pcs[0]);
+	RELEASE(re->pcs[1]);
+	RELEASE(re->saves[0]);
+	RELEASE(re->saves[1]);
+	RELEASE(re);
+}
+
+static void new_generation(struct regexp *re)
+{
+	if (!++re->generation) {
+		memset(re->mark, 0, re->insts * sizeof *re->mark);
+		re->generation = 1;
+	}
+}
+
+/* The DFA */
+
+/* Follows the empty transitions from a set of threads, given the
+ * characters on either side, to the threads that await a character;
+ * also notes whether any thread has matched.
+ */
+static unsigned closure(struct regexp *re, const unsigned *set,
+			unsigned count, enum context prev,
+			enum context next, Boolean_t *matched)
+{
+	unsigned *stack = re->stack, sp = 0, pc, n = 0;
+	struct inst *inst;
+
+	new_generation(re);
+	while (count)
+		stack[sp++] = set[--count];
+	while (sp) {
+		pc = stack[--sp];
+		if (re->mark[pc] == re->generation)
+			continue;
+		re->mark[pc] = re->generation;
+		inst = &re->prog[pc];
+		switch (inst->op) {
+		case CLASS:
+			re->work[n++] = pc;
+			break;
+		case MATCH:
+			*matched = TRUE;
+			break;
+		case JUMP:
+			stack[sp++] = inst->x;
+			break;
+		case SPLIT:
+			stack[sp++] = inst->y;
+			stack[sp++] = inst->x;
+			break;
+		case SAVE:
+			stack[sp++] = pc+1;
+			break;
+		case ASSERT:
+			if (holds(inst->x, prev, next))
+				stack[sp++] = pc+1;
+			break;
+		}
+	}
+	return n;
+}
+
+static struct state *lookup(struct regexp *re, const unsigned *set,
+			    unsigned count, enum context context,
+			    Boolean_t anchored)
+{
+	struct state *state;
+	unsigned hash = context * 3 + anchored, j;
+
+	for (j = 0; j < count; j++)
+		hash = hash * 31 + set[j];
+	for (state = re->bucket[hash % BUCKETS]; state; state = state->chain)
+		if (state->hash == hash &&
+		    state->count == count &&
+		    state->context == context &&
+		    state->anchored == anchored &&
+		    !memcmp(state->set, set, count * sizeof *set))
+			return state;
+
+	if (re->cached >= STATES)
+		flush(re);
+	state = allocate0(sizeof *state);
+	state->at_end = -1;
+	state->context = context;
+	state->anchored = anchored;
+	state->count = count;
+	state->hash = hash;
+	state->set = allocate((count+1) * sizeof *set);
+	memcpy(state->set, set, count * sizeof *set);
+	state->chain = re->bucket[hash % BUCKETS];
+	re->bucket[hash % BUCKETS] = state;
+	state->link = re->states;
+	re->states = state;
+	re->cached++;
+	return state;
+}
+
+static struct state *start_state(struct regexp *re, enum context context)
+{
+	static const unsigned start = 0;
+	return lookup(re, &start, 1, context, FALSE);
+}
+
+static Boolean_t is_start(const struct state *state)
+{
+	return !state->anchored && state->count == 1 && !state->set[0];
+}
+
+/* The state that no longer admits new threads */
+static struct state *anchor(struct regexp *re, struct state *state)
+{
+	Boolean_t skip = state->count && !state->set[0];
+	unsigned count = state->count - skip;
+
+	/* copied, since the lookup might flush the cache */
+	memcpy(re->work, state->set + skip, count * sizeof *re->work);
+	return lookup(re, re->work, count, state->context, TRUE);
+}
+
+static int compare(const void *x, const void *y)
+{
+	unsigned a = *(const unsigned *) x, b = *(const unsigned *) y;
+	return a < b ? -1 : a > b;
+}
+
+static struct state *step(struct regexp *re, struct state *state,
+			  unsigned ch, Boolean_t *matched)
+{
+	enum context next = context(ch);
+	unsigned *set, j, n, count = 0, flushes = re->flushes;
+	struct state *to;
+	Boolean_t anchored = state->anchored;
+
+	*matched = FALSE;
+	n = closure(re, state->set, state->count, state->context, next,
+		    matched);
+	set = re->stack;	/* free again once the closure is done */
+	if (!anchored)
+		set[count++] = 0;
+	for (j = 0; j < n; j++)
+		if (in_set(re->class[re->prog[re->work[j]].x], ch))
+			set[count++] = re->work[j] + 1;
+	qsort(set, count, sizeof *set, compare);
+	to = lookup(re, set, count, next, anchored);
+	if (flushes == re->flushes) {	/* else "state" is gone */
+		state->next[ch] = to;
+		if (*matched)
+			add_to_set(state->matched, ch);
+	}
+	return to;
+}
+
+static Boolean_t ends(struct regexp *re, struct state *state)
+{
+	Boolean_t matched = FALSE;
+
+	if (state->at_end < 0) {
+		closure(re, state->set, state->count, state->context, LINE,
+			&matched);
+		state->at_end = matched;
+	}
+	return state->at_end;
+}
+
+/* Runs the DFA from "from" and returns the place from which the NFA
+ * must be simulated to find the first match that begins in [from,to),
+ * or -1 if there is none.
+ */
+static sposition_t prescan(struct regexp *re, const struct spans *spans,
+			   position_t from, position_t to)
+{
+	position_t pos = from, total = spans->bytes[0] + spans->bytes[1];
+	position_t begin = from;
+	struct state *state = start_state(re, context_before(spans, from));
+	struct state *next;
+	Boolean_t matched;
+	sposition_t at;
+	unsigned ch;
+
+	for (;;) {
+		if (!state->anchored && pos >= to)
+			state = anchor(re, state);
+		if (state->anchored && !state->count)
+			return -1;
+		if (is_start(state)) {
+			begin = pos;
+			if (re->prefix) {
+				at = literal_find(re->prefix, spans, pos, to);
+				if (at < 0)
+					return -1;
+				if (at > pos) {
+					begin = pos = at;
+					state = start_state(re,
+						context_before(spans, pos));
+				}
+			}
+		}
+		if (pos >= total)
+			return ends(re, state) ? begin : -1;
+		ch = byte_at(spans, pos);
+		if ((next = state->next[ch]))
+			matched = in_set(state->matched, ch);
+		else
+			next = step(re, state, ch, &matched);
+		if (matched)
+			return begin;
+		state = next;
+		pos++;
+	}
+}
+
+/* The NFA simulation */
+
+struct list {
+	unsigned *pc, count;
+	sposition_t *save;
+};
+
+static void add(struct regexp *re, struct list *list, unsigned pc,
+		sposition_t *save, position_t pos,
+		enum context prev, enum context next)
+{
+	struct inst *inst = &re->prog[pc];
+	sposition_t old;
+
+	if (re->mark[pc] == re->generation)
+		return;
+	re->mark[pc] = re->generation;
+	switch (inst->op) {
+	case JUMP:
+		add(re, list, inst->x, save, pos, prev, next);
+		break;
+	case SPLIT:
+		add(re, list, inst->x, save, pos, prev, next);
+		add(re, list, inst->y, save, pos, prev, next);
+		break;
+	case SAVE:
+		old = save[inst->x];
+		save[inst->x] = pos;
+		add(re, list, pc+1, save, pos, prev, next);
+		save[inst->x] = old;
+		break;
+	case ASSERT:
+		if (holds(inst->x, prev, next))
+			add(re, list, pc+1, save, pos, prev, next);
+		break;
+	default:
+		list->pc[list->count] = pc;
+		memcpy(list->save + list->count * SAVES, save,
+		       SAVES * sizeof *save);
+		list->count++;
+	}
+}
+
+/* Finds the leftmost-longest match that begins in [pos,to).
+ * Threads are kept in the order of their starting positions.
+ */
+static sposition_t simulate(struct regexp *re, const struct spans *spans,
+			    position_t pos, position_t to,
+			    struct submatch *sub)
+{
+	position_t total = spans->bytes[0] + spans->bytes[1];
+	struct list run, wait;
+	sposition_t save[SAVES], best[SAVES], *thread;
+	enum context prev = context_before(spans, pos), next;
+	unsigned j;
+	int ch;
+
+	run.pc = re->pcs[0], run.save = re->saves[0];
+	wait.pc = re->pcs[1], wait.save = re->saves[1], wait.count = 0;
+	best[0] = -1;
+	for (;; pos++, prev = next) {
+		ch = pos < total ? (int) byte_at(spans, pos) : -1;
+		next = ch < 0 ? LINE : context(ch);
+		new_generation(re);
+		run.count = 0;
+		for (j = 0; j < wait.count; j++) {
+			memcpy(save, wait.save + j * SAVES, sizeof save);
+			add(re, &run, wait.pc[j], save, pos, prev, next);
+		}
+		if (best[0] < 0 && pos < to) {
+			for (j = 0; j < SAVES; j++)
+				save[j] = -1;
+			add(re, &run, 0, save, pos, prev, next);
+		}
+		if (!run.count)
+			break;
+		wait.count = 0;
+		for (j = 0; j < run.count; j++) {
+			thread = run.save + j * SAVES;
+			if (best[0] >= 0 && thread[0] > best[0])
+				continue;
+			if (re->prog[run.pc[j]].op == MATCH) {
+				if (best[0] < 0 || thread[0] < best[0] ||
+				    thread[1] > best[1])
+					memcpy(best, thread, sizeof best);
+				continue;
+			}
+			if (ch >= 0 &&
+			    in_set(re->class[re->prog[run.pc[j]].x], ch)) {
+				wait.pc[wait.count] = run.pc[j] + 1;
+				memcpy(wait.save + wait.count * SAVES, thread,
+				       sizeof save);
+				wait.count++;
+			}
+		}
+		if (ch < 0)
+			break;
+	}
+	if (best[0] < 0)
+		return -1;
+	for (j = 0; j < SUBMATCHES; j++) {
+		sub[j].start = best[2*j];
+		sub[j].end = best[2*j+1];
+		if (sub[j].start < 0 || sub[j].end < sub[j].start)
+			sub[j].start = sub[j].end = -1;
+	}
+	return best[0];
+}
+
+/* The length of the longest possible match, or -1 if it's unbounded */
+sposition_t regexp_longest(struct regexp *re)
+{
+	return re->longest;
+}
+
+/* Whether a match might span lines */
+Boolean_t regexp_multiline(struct regexp *re)
+{
+	unsigned j;
+
+	for (j = 0; j < re->classes; j++)
+		if (in_set(re->class[j], '\n'))
+			return TRUE;
+	return FALSE;
+}
+
+/* Finds the leftmost-longest match that begins in [from,to);
+ * sub[0] is the whole match and sub[1..9] its subexpressions.
+ */
+sposition_t regexp_find(struct regexp *re, const struct spans *spans,
+			position_t from, position_t to, struct submatch *sub)
+{
+	sposition_t begin;
+
+	if (from > spans->bytes[0] + spans->bytes[1] || from >= to)
+		return -1;
+	if ((begin = prescan(re, spans, from, to)) < 0)
+		return -1;
+	return simulate(re, spans, begin, to, sub);
+}
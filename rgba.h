@@ -34,5 +34,6 @@ typedef unsigned rgba_t;
 #define LAMESPACE_BGRGBA	MAGENTA_RGBA
 #define BADCHAR_BGRGBA		MAGENTA_RGBA
 #define SEARCH_BGRGBA		YELLOW_RGBA
+#define MATCH_BGRGBA		PALE_RGBA(YELLOW_RGBA)
 
 #endif
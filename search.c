@@ -13,109 +13,274 @@ struct mode_search {
 	size_t bytes, alloc, last_bytes;
 	Boolean_t backward;
 	position_t start, mark;
-	regex_t *regex;
-	Boolean_t regex_ready;
+	Boolean_t regex;
+	struct regexp *regexp;
+	struct literal *literal;
+	size_t compiled;	/* pattern bytes of regexp or literal */
 };
 
-static Boolean_t match_char(Unicode_t x, Unicode_t y)
+static void capture(struct view *view, struct submatch *sub)
 {
-	if (!IS_UNICODE(x) || !IS_UNICODE(y))
-		return FALSE;
-	if (x >= 'a' && x <= 'z')
-		x += 'A' - 'a';
-	if (y >= 'a' && y <= 'z')
-		y += 'A' - 'a';
-	return x == y;
+	int j;
+
+	for (j = 1; j < SUBMATCHES; j++) {
+		if (sub[j].start < 0)
+			continue;
+		clip_init(j);
+		clip(j, view, sub[j].start, sub[j].end - sub[j].start, 0);
+	}
+}
+
+/*
+ *	Forward searches over a long stretch of a huge text are split
+ *	into chunks of starting positions that are taken in order by
+ *	worker threads, each with its own compiled regular expression
+ *	(literals can be shared).  Matches may run past the end of their
+ *	chunk, so chunks overlap in what they read but not in where their
+ *	matches start.  The hit in the earliest chunk wins; once one is
+ *	found, no later chunk is begun.
+ */
+
+#define CHUNK ((size_t) 1 << 20)
+#define PARALLEL (4 * CHUNK)	/* smallest stretch worth splitting */
+#define MAX_HUNTERS 16
+
+struct hunt {
+	struct mode_search *mode;
+	const struct spans *spans;
+	position_t from, to;
+	pthread_mutex_t lock;
+	size_t next, chunks, found;
+	sposition_t at;
+};
+
+static void hunt(struct hunt *hunt, struct regexp *regexp)
+{
+	struct submatch sub[SUBMATCHES];
+	position_t from, to;
+	sposition_t at;
+	size_t chunk;
+	Boolean_t done;
+
+	for (;;) {
+		pthread_mutex_lock(&hunt->lock);
+		chunk = hunt->next++;
+		done = chunk >= hunt->chunks || chunk > hunt->found;
+		pthread_mutex_unlock(&hunt->lock);
+		if (done)
+			break;
+		from = hunt->from + chunk * CHUNK;
+		to = hunt->to - from > CHUNK ? from + CHUNK : hunt->to;
+		if (regexp)
+			at = regexp_find(regexp, hunt->spans, from, to, sub);
+		else
+			at = literal_find(hunt->mode->literal, hunt->spans,
+					  from, to);
+		if (at < 0)
+			continue;
+		pthread_mutex_lock(&hunt->lock);
+		if (chunk < hunt->found) {
+			hunt->found = chunk;
+			hunt->at = at;
+		}
+		pthread_mutex_unlock(&hunt->lock);
+	}
+}
+
+static void *hunter(void *arg)
+{
+	struct hunt *h = arg;
+	struct regexp *regexp = NULL;
+
+	if (h->mode->regex)
+		regexp = regexp_compile((char *) h->mode->pattern,
+					h->mode->bytes, TRUE);
+	hunt(h, regexp);
+	regexp_destroy(regexp);
+	return NULL;
 }
 
-static size_t match_pattern(struct view *view, position_t offset)
+/* The first hit that starts in [from,to), with its groups when the
+ * pattern is a regular expression.
+ */
+static sposition_t find(struct view *view, const struct spans *spans,
+			position_t from, position_t to, struct submatch *sub)
 {
 	struct mode_search *mode = (struct mode_search *) view->mode;
-	size_t j;
+	struct hunt h;
+	pthread_t thread[MAX_HUNTERS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned j, threads = 0;
 
-	for (j = 0; j < mode->bytes; j++)
-		if (!match_char(mode->pattern[j],
-				view_byte(view, offset++)))
-			return 0;
-	return mode->bytes;
+	if (to > from && to - from >= PARALLEL && cpus > 1) {
+		h.mode = mode;
+		h.spans = spans;
+		h.from = from;
+		h.to = to;
+		pthread_mutex_init(&h.lock, NULL);
+		h.next = 0;
+		h.chunks = (to - from + CHUNK - 1) / CHUNK;
+		h.found = h.chunks;
+		h.at = -1;
+		if (cpus > MAX_HUNTERS)
+			cpus = MAX_HUNTERS;
+		while (threads + 1 < cpus && threads + 1 < h.chunks &&
+		       !thread_create(&thread[threads], hunter, &h))
+			threads++;
+		hunt(&h, mode->regexp);
+		for (j = 0; j < threads; j++)
+			pthread_join(thread[j], NULL);
+		pthread_mutex_destroy(&h.lock);
+		if (h.at < 0 || !mode->regex)
+			return h.at;
+		from = h.at;	/* now just for the groups */
+	}
+	if (mode->regex)
+		return regexp_find(mode->regexp, spans, from, to, sub);
+	return literal_find(mode->literal, spans, from, to);
 }
 
-static int match_regex(struct view *view, position_t *offset, Boolean_t advance)
+static int match_regex(struct view *view, size_t *length,
+		       position_t offset, position_t max_offset)
+{
+	struct submatch sub[SUBMATCHES];
+	struct spans spans;
+	sposition_t at;
+
+	view_spans(view, &spans);
+	at = find(view, &spans, offset, max_offset, sub);
+	if (at < 0 || sub[0].end == at)
+		return -1;
+	capture(view, sub);
+	*length = sub[0].end - at;
+	return at;
+}
+
+/* Backward regular expression searches run forward through chunks
+ * that end where the last one began, doubling in size each time,
+ * and keep the last hit in a chunk.  Each search stops at its
+ * leftmost match, so the whole search is linear in the distance
+ * covered rather than quadratic, and the clip registers are set
+ * only from the hit that is finally returned.
+ */
+static int match_regex_prior(struct view *view, size_t *length,
+			     position_t offset, position_t min_offset)
 {
-	int j, err;
-	char *raw;
-	size_t bytes = view_raw(view, &raw, *offset, ~(size_t)0);
-	unsigned flags = 0;
-	regmatch_t match[10];
 	struct mode_search *mode = (struct mode_search *) view->mode;
+	struct submatch sub[SUBMATCHES], hit[SUBMATCHES];
+	struct spans spans;
+	position_t lo, hi = offset + 1;
+	size_t chunk = 4096;
+	sposition_t at;
 
-	if (view_char_prior(view, *offset, NULL) != '\n')
-		flags |= REG_NOTBOL;
-	err = regexec(mode->regex, raw, 10, match, flags);
-	if (err && err != REG_NOMATCH)
-		window_beep(view);
-	if (err)
-		return 0;
-	if (!advance && match[0].rm_so)
-		return 0;
-	if (match[0].rm_so >= bytes)
-		return 0;
-	if (match[0].rm_eo > bytes)
-		match[0].rm_eo = bytes;
-	for (j = 1; j < 10; j++) {
-		if (match[j].rm_so < 0 ||
-		    match[j].rm_so >= bytes)
-			continue;
-		if (match[j].rm_eo > bytes)
-			match[j].rm_eo = bytes;
-		clip_init(j);
-		clip(j, view, *offset + match[j].rm_so,
-		     match[j].rm_eo - match[j].rm_so, 0);
+	view_spans(view, &spans);
+	hit[0].start = -1;
+	while (hit[0].start < 0 && hi > min_offset) {
+		lo = hi - min_offset > chunk ? hi - chunk : min_offset;
+		for (at = lo;
+		     (at = regexp_find(mode->regexp, &spans, at, hi, sub)) >= 0;
+		     at++)
+			if (sub[0].end > at)
+				memcpy(hit, sub, sizeof hit);
+		hi = lo;
+		chunk <<= 1;
 	}
-	*offset += match[0].rm_so;
-	return match[0].rm_eo - match[0].rm_so;
+	if (hit[0].start < 0)
+		return -1;
+	capture(view, hit);
+	*length = hit[0].end - hit[0].start;
+	return hit[0].start;
 }
 
 static int scan_forward(struct view *view, size_t *length,
 			position_t offset, position_t max_offset)
 {
 	struct mode_search *mode = (struct mode_search *) view->mode;
+	struct spans spans;
+	sposition_t at;
 
+	if (mode->regex)
+		return match_regex(view, length, offset, max_offset);
 	if (mode->bytes > view->bytes)
 		return -1;
 	if (max_offset > view->bytes - mode->bytes)
 		max_offset = view->bytes - mode->bytes;
 	if (offset + mode->bytes > max_offset)
 		return -1;
-	if (mode->regex) {
-		if ((*length = match_regex(view, &offset, 1)) &&
-		    offset < max_offset)
-			return offset;
-	} else
-		for (; offset < max_offset; offset++)
-			if ((*length = match_pattern(view, offset)))
-				return offset;
-	return -1;
+	view_spans(view, &spans);
+	if ((at = find(view, &spans, offset, max_offset, NULL)) >= 0)
+		*length = mode->bytes;
+	return at;
 }
 
 static int scan_backward(struct view *view, size_t *length,
 			 position_t offset, position_t min_offset)
 {
 	struct mode_search *mode = (struct mode_search *) view->mode;
+	struct spans spans;
+	sposition_t at;
 
+	if (mode->regex)
+		return match_regex_prior(view, length, offset, min_offset);
 	if (min_offset + mode->bytes > view->bytes)
 		return -1;
 	if (offset + mode->bytes > view->bytes)
 		offset = view->bytes - mode->bytes;
-	if (mode->regex) {
-		for (; offset+1 > min_offset; offset--)
-			if ((*length = match_regex(view, &offset, 0)))
-				return offset;
-	} else
-		for (; offset+1 > min_offset; offset--)
-			if ((*length = match_pattern(view, offset)))
-				return offset;
-	return -1;
+	view_spans(view, &spans);
+	if ((at = literal_find_prior(mode->literal, &spans,
+				     min_offset, offset+1)) >= 0)
+		*length = mode->bytes;
+	return at;
+}
+
+/*
+ *	All of the hits in the view are counted in the background by
+ *	the multiplexor's idle loop, a slice at a time, with the
+ *	text's match cache, so that "match k of n" can be reported.
+ */
+
+#define COUNT_SLICE ((size_t) 256 << 10)
+
+static struct view *counting;
+
+/* Returns TRUE while the hits remain to be counted. */
+static Boolean_t tally(struct view *view, size_t budget)
+{
+	struct mode_search *mode = (struct mode_search *) view->mode;
+	unsigned before, total;
+
+	if (!text_matches_count(view->text, view->start,
+				view->start + view->bytes,
+				view->start + locus_get(view, MARK),
+				budget, &before, &total))
+		return TRUE;
+	mode->pattern[mode->bytes] = '\0';
+	if (mode->regex)
+		status("regular expression: %s (match %u of %u)",
+		       mode->pattern, before + 1, total);
+	else
+		status("match %u of %u", before + 1, total);
+	return FALSE;
+}
+
+static Boolean_t count_slice(void)
+{
+	if (counting && tally(counting, COUNT_SLICE))
+		return TRUE;
+	counting = NULL;
+	return FALSE;
+}
+
+static void count(struct view *view)
+{
+	struct mode_search *mode = (struct mode_search *) view->mode;
+
+	if (!tally(view, 0))
+		return;
+	if (!mode->regex)
+		status_hide();
+	counting = view;
+	multiplex_idle(count_slice);
 }
 
 static Boolean_t search(struct view *view, int backward, int new)
@@ -125,28 +290,37 @@ static Boolean_t search(struct view *view, int backward, int new)
 	size_t length = 0;
 	int at;
 
+	counting = NULL;
+	multiplex_idle(NULL);
 	if (!mode->bytes) {
+		mode->compiled = 0;
+		text_matches_use(view->text, NULL, 0, FALSE);
 		locus_set(view, CURSOR, mode->start);
 		locus_set(view, MARK, UNSET);
 		return TRUE;
 	}
 
+	if (new || mode->compiled != mode->bytes) {
+		regexp_destroy(mode->regexp);
+		mode->regexp = NULL;
+		literal_destroy(mode->literal);
+		mode->literal = NULL;
+		mode->compiled = mode->bytes;
+	}
 	if (mode->regex) {
-		int err;
-		if (new && mode->regex_ready) {
-			regfree(mode->regex);
-			mode->regex_ready = FALSE;
-		}
-		if (!mode->regex_ready) {
+		if (!mode->regexp) {
 			mode->pattern[mode->bytes] = '\0';
 			status("regular expression: %s", mode->pattern);
-			err = regcomp(mode->regex, (char *) mode->pattern,
-				      REG_EXTENDED | REG_ICASE | REG_NEWLINE);
-			if (err)
+			mode->regexp = regexp_compile((char *) mode->pattern,
+						      mode->bytes, TRUE);
+			if (!mode->regexp)
 				return FALSE;
-			mode->regex_ready = TRUE;
 		}
-	}
+	} else if (!mode->literal)
+		mode->literal = literal_create((char *) mode->pattern,
+					       mode->bytes, TRUE);
+	text_matches_use(view->text, (char *) mode->pattern, mode->bytes,
+			 mode->regex);
 
 	mark = locus_get(view, MARK);
 	if (mark == UNSET)
@@ -173,9 +347,104 @@ static Boolean_t search(struct view *view, int backward, int new)
 	locus_set(view, MARK, at);
 	locus_set(view, CURSOR, at + length);
 	mode->last_bytes = mode->bytes;
+	count(view);
 	return TRUE;
 }
 
+static void emit(char **out, size_t *bytes, size_t *alloc, size_t more)
+{
+	if (*bytes + more > *alloc) {
+		*alloc = (*bytes + more) * 2 + 1024;
+		*out = reallocate(*out, *alloc);
+	}
+}
+
+/* Insert replaces every hit in the view with the clip buffer, in
+ * which \1 through \9 stand for the groups of regular expressions
+ * and \\ for a backslash.
+ * The new content is built in one pass over the view and swapped
+ * in as a single undoable edit.
+ */
+static void replace_all(struct view *view, struct mode_search *mode)
+{
+	struct submatch sub[SUBMATCHES];
+	struct spans spans;
+	struct replacement *rep = NULL;
+	unsigned reps = 0, rep_alloc = 0;
+	char *clip, *out = NULL;
+	size_t clip_bytes = clip_raw(0, &clip), bytes = 0, alloc = 0;
+	size_t j, was;
+	position_t copied = 0, end;
+	sposition_t at;
+	int n;
+
+	if (!mode->bytes || mode->compiled != mode->bytes ||
+	    !mode->regexp && !mode->literal) {
+		window_beep(view);
+		return;
+	}
+	view_spans(view, &spans);
+	for (at = 0; at < view->bytes; at = end) {
+		if (mode->regexp) {
+			at = regexp_find(mode->regexp, &spans,
+					 at, view->bytes, sub);
+			if (at < 0)
+				break;
+			if ((end = sub[0].end) == at) {
+				end++;
+				continue;
+			}
+		} else {
+			at = literal_find(mode->literal, &spans,
+					  at, view->bytes);
+			if (at < 0)
+				break;
+			end = at + mode->bytes;
+		}
+		if (reps) {
+			emit(&out, &bytes, &alloc, at - copied);
+			bytes += view_get(view, out + bytes, copied,
+					  at - copied);
+		}
+		was = bytes;
+		for (j = 0; j < clip_bytes; j++) {
+			n = j + 1 < clip_bytes ? clip[j+1] - '0' : -1;
+			if (mode->regexp && clip[j] == '\\' &&
+			    n == '\\' - '0') {
+				emit(&out, &bytes, &alloc, 1);
+				out[bytes++] = clip[++j];
+			} else if (mode->regexp && clip[j] == '\\' &&
+				   n >= 0 && n <= 9) {
+				j++;
+				if (sub[n].start < 0)
+					continue;
+				emit(&out, &bytes, &alloc,
+				     sub[n].end - sub[n].start);
+				bytes += view_get(view, out + bytes,
+						  sub[n].start,
+						  sub[n].end - sub[n].start);
+			} else {
+				emit(&out, &bytes, &alloc, 1);
+				out[bytes++] = clip[j];
+			}
+		}
+		if (reps == rep_alloc) {
+			rep_alloc = rep_alloc * 2 + 64;
+			rep = reallocate(rep, rep_alloc * sizeof *rep);
+		}
+		rep[reps].offset = view->start + at;
+		rep[reps].bytes = end - at;
+		rep[reps++].new_bytes = bytes - was;
+		copied = end;
+	}
+
+	if (reps)
+		text_replace(view->text, out, bytes, rep, reps);
+	status("%u replaced", reps);
+	RELEASE(out);
+	RELEASE(rep);
+}
+
 static void command_handler(struct view *view, Unicode_t ch)
 {
 	struct mode_search *mode = (struct mode_search *) view->mode;
@@ -200,6 +469,10 @@ static void command_handler(struct view *view, Unicode_t ch)
 			return;
 		}
 
+	/* Insert replaces all hits */
+	if (ch == FUNCTION_INSERT)
+		goto done;
+
 	/* Non-control characters are appended to the search target and
 	 * we proceed to the next hit if the current position does not
 	 * match the extended target.
@@ -259,8 +532,11 @@ done:	if (mode->bytes) {
 		last_search[mode->bytes] = '\0';
 	}
 
+	counting = NULL;
+	multiplex_idle(NULL);
 	view->mode = mode->previous;
 	status_hide();
+	text_matches_use(view->text, NULL, 0, FALSE);
 
 	if (ch == cmdchar[2][is_asdfg]) {
 		/* ^V: keep target as selection */
@@ -268,17 +544,19 @@ done:	if (mode->bytes) {
 		/* restore mark, if any */
 		locus_set(view, MARK, mode->mark);
 		if (ch != '\r' &&
+		    ch != FUNCTION_INSERT &&
 		    ch != CONTROL('A') &&
 		    ch != CONTROL('_') &&
 		    ch != 0x7f /*BCK*/)
 			view->mode->command(view, ch);
 	}
+	if (ch == FUNCTION_INSERT)
+		replace_all(view, mode);
 
 	/* Release search mode resources */
 	RELEASE(mode->pattern);
-	if (mode->regex_ready)
-		regfree(mode->regex);
-	RELEASE(mode->regex);
+	regexp_destroy(mode->regexp);
+	literal_destroy(mode->literal);
 	RELEASE(mode);
 }
 
@@ -290,7 +568,6 @@ void mode_search(struct view *view, Boolean_t regex)
 	mode->selection_bgrgba = SEARCH_BGRGBA;
 	mode->start = locus_get(view, CURSOR);
 	mode->mark = locus_get(view, MARK);
-	if (regex)
-		mode->regex = allocate0(sizeof *mode->regex);
+	mode->regex = regex;
 	view->mode = (struct mode *) mode;
 }
@@ -72,16 +72,22 @@ static char *word_complete(const char *string)
 	struct view *hit_view = NULL;
 	size_t hit_offset = 0, hit_length = 0;
 	size_t length = strlen(string);
+	struct literal *literal;
+	char *result = NULL;
 
 	if (!length)
 		return NULL;
+	literal = literal_create(string, length, FALSE);
 	for (text = text_list; text; text = text->next) {
 		struct view *view = text->views;
+		struct spans spans;
 		sposition_t offset;
 		if (!view)
 			continue;
+		view_spans(view, &spans);
 		for (offset = 0;
-		     (offset = find_string(view, string, offset)) >= 0;
+		     (offset = literal_find(literal, &spans, offset,
+					    view->bytes)) >= 0;
 		     offset++) {
 			size_t old_hit_length;
 			position_t last = offset + length - 1;
@@ -104,14 +110,16 @@ static char *word_complete(const char *string)
 							hit_length))
 						break;
 				if (!hit_length)
-					return NULL;
+					goto done;
 			}
 		}
 	}
 
-	if (!hit_length)
-		return NULL;
-	return view_extract(hit_view, hit_offset, length + hit_length);
+	if (hit_length)
+		result = view_extract(hit_view, hit_offset,
+				      length + hit_length);
+done:	literal_destroy(literal);
+	return result;
 }
 
 char *tab_complete(const char *string, Boolean_t selection)
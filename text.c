@@ -122,10 +122,13 @@ static void text_close(struct text *text)
 			break;
 		}
 
+	demultiplex_text(text);
 	if (text->clean)
 		munmap(text->clean, text->clean_bytes);
 	buffer_destroy(text->buffer);
 	text_forget_undo(text);
+	text_hash_destroy(text);
+	text_matches_destroy(text);
 	if (text->fd >= 0)
 		close(text->fd);
 	if (text->flags & (TEXT_SCRATCH | TEXT_CREATED))
@@ -264,6 +267,46 @@ size_t view_raw(struct view *view, char **out, position_t offset, size_t bytes)
 	return text_raw(view->text, out, view->start + offset, bytes);
 }
 
+void text_spans(struct text *text, struct spans *spans)
+{
+	if (text->buffer)
+		buffer_spans(text->buffer, spans);
+	else {
+		memset(spans, 0, sizeof *spans);
+		spans->data[0] = (Byte_t *) text->clean;
+		spans->bytes[0] = text->clean ? text->clean_bytes : 0;
+	}
+}
+
+void view_spans(struct view *view, struct spans *spans)
+{
+	size_t skip = view->start, bytes = view->bytes, n;
+	int j;
+
+	text_spans(view->text, spans);
+	for (j = 0; j < 2; j++) {
+		n = spans->bytes[j];
+		if (skip >= n) {
+			skip -= n;
+			n = 0;
+		} else {
+			spans->data[j] += skip;
+			n -= skip;
+			skip = 0;
+		}
+		if (n > bytes)
+			n = bytes;
+		bytes -= n;
+		spans->bytes[j] = n;
+	}
+	if (!spans->bytes[0]) {
+		spans->data[0] = spans->data[1];
+		spans->bytes[0] = spans->bytes[1];
+		spans->data[1] = NULL;
+		spans->bytes[1] = 0;
+	}
+}
+
 size_t view_delete(struct view *view, position_t offset, size_t bytes)
 {
 	return text_delete(view->text, view->start + offset, bytes);
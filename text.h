@@ -12,6 +12,8 @@ struct text {
 	fd_t fd;
 	struct buffer *buffer;		/* modified content */
 	struct undo *undo;		/* undo/redo state */
+	struct hashes *hashes;		/* content hash tree */
+	struct matches *matches;	/* cached search matches */
 	char *path;
 	unsigned dirties;		/* number of modifications */
 	unsigned preserved;		/* "dirties" at last save */
@@ -22,6 +24,7 @@ struct text {
 	sposition_t (*comment_end)(struct view *, position_t);
 	sposition_t (*string_end)(struct view *, position_t);
 	const char *brackets;
+	const char **compressor;	/* command to recompress, if any */
 	unsigned foldings;
 	unsigned flags;
 #define TEXT_SAVED_ORIGINAL (1<<0)
@@ -32,6 +35,7 @@ struct text {
 #define TEXT_NO_TABS (1<<5)
 #define TEXT_NO_UTF8 (1<<6)
 #define TEXT_CRNL (1<<7)
+#define TEXT_LOADING (1<<8)
 };
 
 struct view {
@@ -79,6 +83,8 @@ struct view *view_selection(struct view *, position_t, size_t);
 void text_adjust_loci(struct text *, position_t, int delta);
 size_t view_get(struct view *, void *, position_t, size_t);
 size_t view_raw(struct view *, char **, position_t, size_t);
+void text_spans(struct text *, struct spans *);
+void view_spans(struct view *, struct spans *);
 size_t view_delete(struct view *, position_t, size_t);
 size_t view_insert(struct view *, const void *, position_t, ssize_t);
 
@@ -103,20 +109,55 @@ INLINE Unicode_t view_byte(struct view *view, position_t offset)
 
 /* file.c */
 struct view *view_open(const char *path);
+void view_scan(struct view *);
 Boolean_t text_rename(struct text *, const char *path);
 void text_dirty(struct text *);
 Boolean_t text_is_dirty(struct text *);
 void text_preserve(struct text *);
 void texts_preserve(void);
 void texts_uncreate(void);
+Boolean_t file_rewrite(const char *path, const struct stat *,
+		       Boolean_t (*writer)(fd_t, void *), void *,
+		       Boolean_t keep_original);
 
 /* undo.c */
+struct replacement {
+	position_t offset;		/* of a match in the old content */
+	size_t bytes, new_bytes;
+};
 size_t text_delete(struct text *, position_t, size_t);
 size_t text_insert(struct text *, const void *, position_t, size_t);
+void text_replace(struct text *, const void *, size_t,
+		  const struct replacement *, unsigned);
 sposition_t text_undo(struct text *);
 sposition_t text_redo(struct text *);
 void text_forget_undo(struct text *);
 
+/* hash.c */
+void text_hash_build(struct text *, Boolean_t saved);
+void text_hash_inserted(struct text *, position_t, size_t);
+void text_hash_deleted(struct text *, position_t, size_t);
+void text_hash_saved(struct text *);
+void text_hash_forget_saved(struct text *);
+Boolean_t text_hash_is_saved(struct text *);
+Boolean_t text_hash_refresh(struct text *, char *image, const char *raw);
+void text_hash_destroy(struct text *);
+
+/* match.c */
+struct interval {
+	position_t start, end;
+};
+void text_matches_use(struct text *, const char *, size_t, Boolean_t regex);
+unsigned text_matches_serial(struct text *);
+Boolean_t text_matches_count(struct text *, position_t from, position_t to,
+			     position_t at, size_t budget,
+			     unsigned *before, unsigned *total);
+const struct interval *text_matches(struct text *, position_t from,
+				    position_t to, unsigned *count);
+void text_matches_inserted(struct text *, position_t, size_t);
+void text_matches_deleted(struct text *, position_t, size_t);
+void text_matches_destroy(struct text *);
+
 /* bookmark.c */
 void bookmark_set(unsigned, struct view *, position_t cursor, position_t mark);
 Boolean_t bookmark_get(struct view **, position_t *cursor, position_t *mark,
@@ -125,6 +166,7 @@ void bookmark_unset(unsigned);
 void bookmark_unset_view(struct view *);
 
 void demultiplex_view(struct view *);		/* child.c */
+void demultiplex_text(struct text *);		/* child.c */
 struct view *view_help(void);			/* help.c */
 char *tab_complete(const char *, Boolean_t);	/* tab.c */
 Boolean_t tab_completion_command(struct view *);
@@ -0,0 +1,79 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include "all.h"
+
+/*
+ *	Replaces matches in a text with text_replace() as the search
+ *	and grep commands do, follows each replacement with an edit
+ *	at the place where it ended, and checks that undoing and
+ *	redoing restore the content and the extent of the view.
+ *	An edit must not be merged into a replacement's, whose undo
+ *	remaps the views through a table that fits it alone.
+ *
+ *	usage: undo-test
+ */
+
+static int failures;
+
+static void expect(struct view *view, const char *want, const char *what)
+{
+	size_t bytes = strlen(want);
+	char *raw;
+
+	if (view->bytes == bytes &&
+	    view_raw(view, &raw, 0, bytes) == bytes &&
+	    !memcmp(raw, want, bytes))
+		return;
+	fprintf(stderr, "%s: the view has %lu bytes, not \"%s\"\n",
+		what, (unsigned long) view->bytes, want);
+	failures++;
+}
+
+/* A replacement of "foo" by nothing, then a forward deletion there */
+static void deleted(void)
+{
+	struct view *view = text_create("deleted", 0);
+	struct replacement rep = { 2, 3, 0 };
+
+	view_insert(view, "abfoocdefgh", 0, 11);
+	text_replace(view->text, "", 0, &rep, 1);
+	expect(view, "abcdefgh", "after replacing");
+	text_delete(view->text, 2, 1);
+	expect(view, "abdefgh", "after deleting");
+	text_undo(view->text);
+	expect(view, "abcdefgh", "after undoing the deletion");
+	text_undo(view->text);
+	expect(view, "abfoocdefgh", "after undoing the replacement");
+	text_redo(view->text);
+	expect(view, "abcdefgh", "after redoing the replacement");
+	text_redo(view->text);
+	expect(view, "abdefgh", "after redoing the deletion");
+}
+
+/* An insertion into nothing, then typing just after it */
+static void inserted(void)
+{
+	struct view *view = text_create("inserted", 0);
+	struct replacement rep = { 2, 0, 1 };
+
+	view_insert(view, "abcd", 0, 4);
+	text_replace(view->text, "X", 1, &rep, 1);
+	expect(view, "abXcd", "after replacing");
+	text_insert(view->text, "Y", 3, 1);
+	expect(view, "abXYcd", "after inserting");
+	text_undo(view->text);
+	expect(view, "abXcd", "after undoing the insertion");
+	text_undo(view->text);
+	expect(view, "abcd", "after undoing the replacement");
+}
+
+int main(void)
+{
+	deleted();
+	inserted();
+	if (failures) {
+		fprintf(stderr, "undo-test: %d failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("undo-test: ok\n");
+	return EXIT_SUCCESS;
+}
@@ -4,11 +4,14 @@
 struct edit {
 	position_t offset;
 	ssize_t bytes; /* negative means "inserted" */
+	Boolean_t group; /* undone and redone with the prior edit */
+	unsigned reps; /* of a text_replace(), whose table is kept;
+			* such an edit is never merged with a later one */
 };
 
 struct undo {
-	struct buffer *edits, *deleted;
-	position_t redo, saved;
+	struct buffer *edits, *deleted, *tables;
+	position_t redo, saved, tabled;
 };
 
 static struct edit *get_raw_edit(void *raw)
@@ -20,6 +23,14 @@ static struct edit *get_raw_edit(void *raw)
 	return raw;
 }
 
+static struct edit *edit_at(struct text *text, position_t offset)
+{
+	char *raw;
+
+	buffer_raw(text->undo->edits, &raw, offset, sizeof(struct edit));
+	return get_raw_edit(raw);
+}
+
 static struct edit *last_edit(struct text *text)
 {
 	char *raw = NULL;
@@ -39,11 +50,14 @@ static void resume_editing(struct text *text)
 		text->undo = allocate0(sizeof *text->undo);
 		text->undo->edits = buffer_create(NULL);
 		text->undo->deleted = buffer_create(NULL);
+		text->undo->tables = buffer_create(NULL);
 	}
 	buffer_delete(text->undo->edits, text->undo->redo,
 		      buffer_bytes(text->undo->edits) - text->undo->redo);
 	buffer_delete(text->undo->deleted, text->undo->saved,
 		      buffer_bytes(text->undo->deleted) - text->undo->saved);
+	buffer_delete(text->undo->tables, text->undo->tabled,
+		      buffer_bytes(text->undo->tables) - text->undo->tabled);
 }
 
 static Boolean_t in_view(struct view *view, position_t *offset, size_t *bytes)
@@ -77,96 +91,290 @@ static void view_hint_inserted(struct view *view, position_t offset,
 		window_hint_inserted(view->window, offset, bytes);
 }
 
-size_t text_delete(struct text *text, position_t offset, size_t bytes)
+static void record(struct text *text, position_t offset, ssize_t bytes,
+		   Boolean_t group)
+{
+	struct edit edit;
+
+	resume_editing(text);
+	edit.offset = offset;
+	edit.bytes = bytes;
+	edit.group = group;
+	edit.reps = 0;
+	buffer_insert(text->undo->edits, &edit, text->undo->redo, sizeof edit);
+	text->undo->redo += sizeof edit;
+}
+
+/* "alone" keeps a deletion from being merged with a prior one. */
+static size_t delete(struct text *text, position_t offset, size_t bytes,
+		     Boolean_t alone)
 {
 	char *old;
-	struct edit edit, *last;
+	struct edit *last;
 	struct view *view;
 
 	if (!bytes)
 		return 0;
 	text_dirty(text);
-	edit.offset = offset;
-	edit.bytes = buffer_raw(text->buffer, &old, offset, bytes);
-	bytes = edit.bytes;
+	bytes = buffer_raw(text->buffer, &old, offset, bytes);
 
-	if ((last = last_edit(text)) &&
+	if (!alone &&
+	    (last = last_edit(text)) &&
 	    last->bytes >= 0 &&
+	    !last->group &&
+	    !last->reps &&
 	    last->offset == offset)
 		last->bytes += bytes;
-	else {
-		resume_editing(text);
-		buffer_insert(text->undo->edits, &edit,
-			      text->undo->redo, sizeof edit);
-		text->undo->redo += sizeof edit;
-	}
+	else
+		record(text, offset, bytes, FALSE);
 	for (view = text->views; view; view = view->next)
 		view_hint_deleting(view, offset, bytes);
 	buffer_move(text->undo->deleted, text->undo->saved,
 		    text->buffer, offset, bytes);
 	text->undo->saved += bytes;
+	text_hash_deleted(text, offset, bytes);
+	text_matches_deleted(text, offset, bytes);
 	text_adjust_loci(text, offset, -bytes);
 	return bytes;
 }
 
-size_t text_insert(struct text *text, const void *in,
-		   position_t offset, size_t bytes)
+/* A "group" insertion is undone and redone with the prior edit. */
+static size_t insert(struct text *text, const void *in,
+		     position_t offset, size_t bytes, Boolean_t group)
 {
-	struct edit edit, *last;
+	struct edit *last;
 	struct view *view;
 
 	if (!bytes)
 		return 0;
 	text_dirty(text);
 	bytes = buffer_insert(text->buffer, in, offset, bytes);
-	if ((last = last_edit(text)) &&
+	text_hash_inserted(text, offset, bytes);
+	text_matches_inserted(text, offset, bytes);
+	if (!group &&
+	    (last = last_edit(text)) &&
 	    last->bytes < 0 &&
+	    !last->group &&
+	    !last->reps &&
 	    last->offset - last->bytes == offset)
 		last->bytes -= bytes;
-	else {
-		resume_editing(text);
-		edit.offset = offset;
-		edit.bytes = -bytes;
-		buffer_insert(text->undo->edits, &edit, text->undo->redo,
-			      sizeof edit);
-		text->undo->redo += sizeof edit;
-	}
+	else
+		record(text, offset, -bytes, group);
 	text_adjust_loci(text, offset, bytes);
 	for (view = text->views; view; view = view->next)
 		view_hint_inserted(view, offset, bytes);
 	return bytes;
 }
 
-sposition_t text_undo(struct text *text)
+size_t text_delete(struct text *text, position_t offset, size_t bytes)
+{
+	return delete(text, offset, bytes, FALSE);
+}
+
+size_t text_insert(struct text *text, const void *in,
+		   position_t offset, size_t bytes)
+{
+	return insert(text, in, offset, bytes, FALSE);
+}
+
+/* Where an offset in the old text lies after the replacements:
+ * positions within a replaced match keep their distance from its
+ * start, up to the length of its replacement.
+ */
+static position_t remap(position_t offset, const struct replacement *rep,
+			unsigned reps, const ssize_t *shift)
+{
+	unsigned lo = 0, hi = reps, mid;
+	position_t within;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (rep[mid].offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo--)
+		return offset;
+	if (offset >= rep[lo].offset + rep[lo].bytes)
+		return offset + shift[lo+1];
+	within = offset - rep[lo].offset;
+	if (within > rep[lo].new_bytes)
+		within = rep[lo].new_bytes;
+	return rep[lo].offset + shift[lo] + within;
+}
+
+/* The starts and ends of the views, and their loci */
+static position_t *save_loci(struct text *text)
+{
+	position_t *old;
+	size_t loci = 0;
+	struct view *view;
+	unsigned j, k;
+
+	for (view = text->views; view; view = view->next)
+		loci += 2 + view->loci;
+	old = allocate(loci * sizeof *old);
+	for (k = 0, view = text->views; view; view = view->next) {
+		old[k++] = view->start;
+		old[k++] = view->start + view->bytes;
+		for (j = 0; j < view->loci; j++)
+			old[k++] = view->start + locus_get(view, j);
+	}
+	return old;
+}
+
+/* Moves what save_loci() saw through a table of replacements. */
+static void remap_loci(struct text *text, position_t *old,
+		       const struct replacement *rep, unsigned reps)
+{
+	position_t start, end, at;
+	ssize_t *shift;
+	struct view *view;
+	unsigned j, k;
+
+	shift = allocate((reps + 1) * sizeof *shift);
+	for (shift[0] = 0, j = 0; j < reps; j++)
+		shift[j+1] = shift[j] + rep[j].new_bytes - rep[j].bytes;
+	for (k = 0, view = text->views; view; view = view->next) {
+		start = remap(old[k++], rep, reps, shift);
+		end = remap(old[k++], rep, reps, shift);
+		view->start = start;
+		view->bytes = end - start;
+		for (j = 0; j < view->loci; j++, k++) {
+			if (view->locus[j] == UNSET ||
+			    view->locus[j] == DELETED)
+				continue;
+			at = remap(old[k], rep, reps, shift);
+			view->locus[j] = at < start ? 0 : at - start;
+		}
+	}
+	RELEASE(shift);
+	RELEASE(old);
+}
+
+/*
+ *	Replaces many matches at once.  The new content of the text
+ *	from the start of the first match to the end of the last has
+ *	been built in a single pass by the caller; it's swapped in with
+ *	one deletion and one insertion that are undone together, and
+ *	the views and their loci are then remapped through the table
+ *	of (sorted, disjoint) replacements instead of collapsing onto
+ *	the replaced region.  The table is kept with the undo state
+ *	so that undoing and redoing the replacement can remap them too.
+ */
+void text_replace(struct text *text, const void *in, size_t bytes,
+		  const struct replacement *rep, unsigned reps)
+{
+	position_t offset, *old;
+	size_t deleted;
+
+	if (!reps)
+		return;
+	offset = rep[0].offset;
+	old = save_loci(text);
+	deleted = delete(text, offset, rep[reps-1].offset +
+			 rep[reps-1].bytes - offset, TRUE);
+	if (deleted)
+		last_edit(text)->reps = reps;
+	if (insert(text, in, offset, bytes, deleted != 0))
+		last_edit(text)->reps = reps;
+	else if (!deleted) {
+		RELEASE(old);
+		return;
+	}
+	buffer_insert(text->undo->tables, rep, text->undo->tabled,
+		      reps * sizeof *rep);
+	text->undo->tabled += reps * sizeof *rep;
+	remap_loci(text, old, rep, reps);
+}
+
+/*
+ *	Fetches the table of the replacement about to be undone, turned
+ *	around so that it maps the replaced text back to the original,
+ *	or of the one about to be redone, as it was.
+ */
+static struct replacement *table(struct text *text, unsigned reps,
+				 Boolean_t inverse)
+{
+	struct replacement *rep = allocate(reps * sizeof *rep);
+	size_t bytes = reps * sizeof *rep;
+	ssize_t shift = 0;
+	unsigned j;
+
+	if (inverse)
+		text->undo->tabled -= bytes;
+	buffer_get(text->undo->tables, rep, text->undo->tabled, bytes);
+	if (!inverse) {
+		text->undo->tabled += bytes;
+		return rep;
+	}
+	for (j = 0; j < reps; j++) {
+		size_t new_bytes = rep[j].bytes;
+		rep[j].offset += shift;
+		rep[j].bytes = rep[j].new_bytes;
+		rep[j].new_bytes = new_bytes;
+		shift += rep[j].bytes - rep[j].new_bytes;
+	}
+	return rep;
+}
+
+static sposition_t undo(struct text *text, Boolean_t *group)
 {
 	char *raw;
 	struct edit *edit;
 
-	if (!text->undo || !text->undo->redo)
-		return -1;
-	text_dirty(text);
 	buffer_raw(text->undo->edits, &raw, text->undo->redo -= sizeof *edit,
 		   sizeof *edit);
 	edit = get_raw_edit(raw);
-	if (edit->bytes >= 0)
+	if (edit->bytes >= 0) {
 		buffer_move(text->buffer, edit->offset, text->undo->deleted,
 			    text->undo->saved -= edit->bytes, edit->bytes);
-	else
+		text_hash_inserted(text, edit->offset, edit->bytes);
+		text_matches_inserted(text, edit->offset, edit->bytes);
+	} else {
 		buffer_move(text->undo->deleted, text->undo->saved,
 			    text->buffer, edit->offset, -edit->bytes);
+		text_hash_deleted(text, edit->offset, -edit->bytes);
+		text_matches_deleted(text, edit->offset, -edit->bytes);
+	}
 	text_adjust_loci(text, edit->offset, edit->bytes);
+	*group = edit->group;
 	return edit->offset;
 }
 
-sposition_t text_redo(struct text *text)
+sposition_t text_undo(struct text *text)
 {
-	char *raw;
-	struct edit *edit;
+	sposition_t offset;
+	Boolean_t group;
+	struct edit *last;
+	struct replacement *rep = NULL;
+	position_t *old = NULL;
+	unsigned reps;
 
-	if (!text->undo ||
-	    text->undo->redo == buffer_bytes(text->undo->edits))
+	if (!text->undo || !text->undo->redo)
 		return -1;
 	text_dirty(text);
+	last = edit_at(text, text->undo->redo - sizeof *last);
+	if ((reps = last->reps)) {
+		rep = table(text, reps, TRUE);
+		old = save_loci(text);
+	}
+	do
+		offset = undo(text, &group);
+	while (group && text->undo->redo);
+	if (reps) {
+		remap_loci(text, old, rep, reps);
+		RELEASE(rep);
+	}
+	return offset;
+}
+
+static sposition_t redo(struct text *text)
+{
+	char *raw;
+	struct edit *edit;
+
 	buffer_raw(text->undo->edits, &raw, text->undo->redo, sizeof *edit);
 	edit = get_raw_edit(raw);
 	text->undo->redo += sizeof *edit;
@@ -174,18 +382,61 @@ sposition_t text_redo(struct text *text)
 		buffer_move(text->undo->deleted, text->undo->saved,
 			    text->buffer, edit->offset, edit->bytes);
 		text->undo->saved += edit->bytes;
-	} else
+		text_hash_deleted(text, edit->offset, edit->bytes);
+		text_matches_deleted(text, edit->offset, edit->bytes);
+	} else {
 		buffer_move(text->buffer, edit->offset, text->undo->deleted,
 			    text->undo->saved, -edit->bytes);
+		text_hash_inserted(text, edit->offset, -edit->bytes);
+		text_matches_inserted(text, edit->offset, -edit->bytes);
+	}
 	text_adjust_loci(text, edit->offset, -edit->bytes);
 	return edit->offset;
 }
 
+/* Is the next edit to be redone part of a group? */
+static Boolean_t grouped(struct text *text)
+{
+	char *raw;
+
+	if (text->undo->redo == buffer_bytes(text->undo->edits))
+		return FALSE;
+	buffer_raw(text->undo->edits, &raw, text->undo->redo,
+		   sizeof(struct edit));
+	return get_raw_edit(raw)->group;
+}
+
+sposition_t text_redo(struct text *text)
+{
+	sposition_t offset;
+	struct replacement *rep = NULL;
+	position_t *old = NULL;
+	unsigned reps;
+
+	if (!text->undo ||
+	    text->undo->redo == buffer_bytes(text->undo->edits))
+		return -1;
+	text_dirty(text);
+	if ((reps = edit_at(text, text->undo->redo)->reps)) {
+		rep = table(text, reps, FALSE);
+		old = save_loci(text);
+	}
+	do
+		offset = redo(text);
+	while (grouped(text));
+	if (reps) {
+		remap_loci(text, old, rep, reps);
+		RELEASE(rep);
+	}
+	return offset;
+}
+
 void text_forget_undo(struct text *text)
 {
 	if (text->undo) {
 		buffer_destroy(text->undo->edits);
 		buffer_destroy(text->undo->deleted);
+		buffer_destroy(text->undo->tables);
 		RELEASE(text->undo);
 	}
 }
@@ -29,6 +29,7 @@
 #define FUNCTION_END	FUNCTION_KEY(8)
 #define FUNCTION_INSERT	FUNCTION_KEY(9)
 #define FUNCTION_DELETE	FUNCTION_KEY(10)
+#define FUNCTION_PASTE	FUNCTION_KEY(11)	/* see display_paste() */
 #define FUNCTION_F(k)	FUNCTION_KEY(20+(k))
 #define FUNCTION_FKEYS	12
 
@@ -32,9 +32,31 @@ unsigned find_column(unsigned *row, struct view *, position_t linestart,
 		     position_t offset, unsigned start_column);
 sposition_t find_string(struct view *, const char *, position_t);
 
+/* literal.c */
+struct literal *literal_create(const char *, size_t, Boolean_t ignore_case);
+void literal_destroy(struct literal *);
+sposition_t literal_find(const struct literal *, const struct spans *,
+			 position_t from, position_t to);
+sposition_t literal_find_prior(const struct literal *, const struct spans *,
+			       position_t from, position_t to);
+
+/* regexp.c */
+#define SUBMATCHES 10
+struct submatch {
+	sposition_t start, end;
+};
+struct regexp *regexp_compile(const char *, size_t, Boolean_t ignore_case);
+void regexp_destroy(struct regexp *);
+Boolean_t regexp_multiline(struct regexp *);
+sposition_t regexp_longest(struct regexp *);
+sposition_t regexp_find(struct regexp *, const struct spans *,
+			position_t from, position_t to, struct submatch *);
+
 const char *path_format(const char *);	/* file.c */
 
 void find_tag(struct view *);	/* tags.c */
+void grep(struct view *, Boolean_t regex);	/* grep.c */
+void grep_replace(struct view *);
 
 ssize_t view_vprintf(struct view *, const char *, va_list);
 ssize_t view_printf(struct view *, const char *, ...);
@@ -0,0 +1,574 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "utf8.h"
+#include "mem.h"
+#include "vt.h"
+
+/*
+ *	A model of a terminal, to which the display's output can
+ *	be sent in place of a real one so that what it would show
+ *	can be checked.  It follows xterm in what the display uses
+ *	of it: cursor motion with pending wraps, erasure with the
+ *	current background, insertion and deletion of characters
+ *	and lines, scrolling regions and left and right margins,
+ *	repetition, indexed colors and a redefinable palette.  The
+ *	replies to queries are kept to be fed back to the display.
+ *	The optional features can be withheld to model less capable
+ *	terminals, which then answer as if they didn't know them.
+ */
+
+#define SEQ_SIZE	256
+#define REPLY_SIZE	256
+#define PARAMS		16
+
+enum vt_state {
+	GROUND, ESCAPE, DESIGNATE, SEQUENCE, STRING, STRING_ESCAPE
+};
+
+struct vt {
+	int rows, columns;
+	struct vt_cell *cell;
+	int row, column;
+	Boolean_t wrap;			/* pending at the right edge */
+	int top, bottom, left, right;	/* scrolling region, margins */
+	Boolean_t margins;		/* mode 69 */
+	Boolean_t synced;		/* mode 2026 */
+	unsigned features;
+	rgba_t fgrgba, bgrgba;
+	rgba_t palette[256];
+	Unicode_t last;			/* for REP */
+	enum vt_state state;
+	char seq[SEQ_SIZE];
+	size_t seq_bytes;
+	char utf8[8];
+	size_t utf8_bytes;
+	char reply[REPLY_SIZE];
+	size_t reply_bytes;
+};
+
+static void reset(struct vt *vt)
+{
+	static const rgba_t bright[] = {
+		BLACK_RGBA, RED_RGBA, GREEN_RGBA, YELLOW_RGBA,
+		BLUE_RGBA, MAGENTA_RGBA, CYAN_RGBA, WHITE_RGBA,
+	};
+	static const Byte_t level[] = { 0, 95, 135, 175, 215, 255 };
+	int j;
+
+	for (j = 0; j < 8; j++) {
+		vt->palette[j] = PALE_RGBA(bright[j]);
+		vt->palette[j+8] = bright[j];
+	}
+	for (j = 0; j < 216; j++)
+		vt->palette[j+16] = level[j / 36] << 24 |
+				    level[j / 6 % 6] << 16 |
+				    level[j % 6] << 8;
+	for (j = 0; j < 24; j++)
+		vt->palette[j+232] = (8 + 10*j) * 0x01010100u;
+
+	vt->fgrgba = DEFAULT_FGRGBA;
+	vt->bgrgba = DEFAULT_BGRGBA;
+	for (j = 0; j < vt->rows * vt->columns; j++) {
+		vt->cell[j].unicode = ' ';
+		vt->cell[j].fgrgba = vt->fgrgba;
+		vt->cell[j].bgrgba = vt->bgrgba;
+	}
+	vt->row = vt->column = 0;
+	vt->wrap = FALSE;
+	vt->top = vt->left = 0;
+	vt->bottom = vt->rows - 1;
+	vt->right = vt->columns - 1;
+	vt->margins = vt->synced = FALSE;
+	vt->last = 0;
+}
+
+struct vt *vt_create(int rows, int columns, unsigned features)
+{
+	struct vt *vt = allocate0(sizeof *vt);
+
+	vt->rows = rows;
+	vt->columns = columns;
+	vt->features = features;
+	vt->cell = allocate(rows * columns * sizeof *vt->cell);
+	reset(vt);
+	return vt;
+}
+
+void vt_destroy(struct vt *vt)
+{
+	if (vt) {
+		RELEASE(vt->cell);
+		RELEASE(vt);
+	}
+}
+
+const struct vt_cell *vt_cell(struct vt *vt, int row, int column)
+{
+	return &vt->cell[row*vt->columns + column];
+}
+
+void vt_cursor(struct vt *vt, int *row, int *column)
+{
+	*row = vt->row;
+	*column = vt->column;
+}
+
+/* Takes up to "max" bytes of the replies. */
+size_t vt_replies(struct vt *vt, char *buf, size_t max)
+{
+	if (max > vt->reply_bytes)
+		max = vt->reply_bytes;
+	memcpy(buf, vt->reply, max);
+	memmove(vt->reply, vt->reply + max, vt->reply_bytes -= max);
+	return max;
+}
+
+static void reply(struct vt *vt, const char *str)
+{
+	size_t bytes = strlen(str);
+
+	if (vt->reply_bytes + bytes <= sizeof vt->reply) {
+		memcpy(vt->reply + vt->reply_bytes, str, bytes);
+		vt->reply_bytes += bytes;
+	}
+}
+
+/* The columns that scrolling and wrapping affect */
+static int left_edge(struct vt *vt)
+{
+	return vt->margins ? vt->left : 0;
+}
+
+static int right_edge(struct vt *vt)
+{
+	return vt->margins ? vt->right : vt->columns - 1;
+}
+
+/* Is the cursor within the left and right margins? */
+static Boolean_t inside(struct vt *vt)
+{
+	return vt->column >= left_edge(vt) && vt->column <= right_edge(vt);
+}
+
+static void blank(struct vt *vt, int row, int column, int columns)
+{
+	struct vt_cell *cell = &vt->cell[row*vt->columns + column];
+
+	for (; columns-- > 0; cell++) {
+		cell->unicode = ' ';
+		cell->fgrgba = vt->fgrgba;
+		cell->bgrgba = vt->bgrgba;
+	}
+}
+
+/* Moves the lines [top,bottom] of the margins up by "lines",
+ * or down when negative, and blanks what they leave behind.
+ */
+static void scroll(struct vt *vt, int top, int bottom, int lines)
+{
+	int left = left_edge(vt), columns = right_edge(vt) - left + 1;
+	int rows = bottom - top + 1, row;
+
+	if (lines > rows)
+		lines = rows;
+	if (lines < -rows)
+		lines = -rows;
+	if (lines > 0) {
+		for (row = top; row + lines <= bottom; row++)
+			memmove(&vt->cell[row*vt->columns + left],
+				&vt->cell[(row+lines)*vt->columns + left],
+				columns * sizeof *vt->cell);
+		for (; row <= bottom; row++)
+			blank(vt, row, left, columns);
+	} else if (lines < 0) {
+		for (row = bottom; row + lines >= top; row--)
+			memmove(&vt->cell[row*vt->columns + left],
+				&vt->cell[(row+lines)*vt->columns + left],
+				columns * sizeof *vt->cell);
+		for (; row >= top; row--)
+			blank(vt, row, left, columns);
+	}
+}
+
+static void linefeed(struct vt *vt)
+{
+	if (vt->row == vt->bottom)
+		scroll(vt, vt->top, vt->bottom, 1);
+	else if (vt->row < vt->rows - 1)
+		vt->row++;
+}
+
+static void print(struct vt *vt, Unicode_t unicode)
+{
+	struct vt_cell *cell;
+	int edge;
+
+	if (vt->wrap) {
+		vt->column = left_edge(vt);
+		linefeed(vt);
+		vt->wrap = FALSE;
+	}
+	cell = &vt->cell[vt->row*vt->columns + vt->column];
+	cell->unicode = unicode;
+	cell->fgrgba = vt->fgrgba;
+	cell->bgrgba = vt->bgrgba;
+	vt->last = unicode;
+	edge = inside(vt) ? right_edge(vt) : vt->columns - 1;
+	if (vt->column >= edge)
+		vt->wrap = TRUE;
+	else
+		vt->column++;
+}
+
+static void control(struct vt *vt, int ch)
+{
+	switch (ch) {
+	case '\b':
+		if (vt->column > (inside(vt) ? left_edge(vt) : 0))
+			vt->column--;
+		break;
+	case '\t':
+		vt->column = (vt->column | 7) + 1;
+		if (vt->column >= vt->columns)
+			vt->column = vt->columns - 1;
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		linefeed(vt);
+		break;
+	case '\r':
+		vt->column = inside(vt) ? left_edge(vt) : 0;
+		break;
+	default:
+		return;
+	}
+	vt->wrap = FALSE;
+}
+
+static int clamp(int n, int lo, int hi)
+{
+	return n < lo ? lo : n > hi ? hi : n;
+}
+
+static rgba_t sgr_color(struct vt *vt, const unsigned *param, int params,
+			int *j)
+{
+	if (*j + 2 < params && param[*j+1] == 5) {
+		*j += 2;
+		return vt->palette[param[*j] & 0xff];
+	}
+	if (*j + 4 < params && param[*j+1] == 2) {
+		*j += 4;
+		return (param[*j-2] & 0xff) << 24 |
+		       (param[*j-1] & 0xff) << 16 |
+		       (param[*j] & 0xff) << 8;
+	}
+	*j = params;
+	return 0;
+}
+
+static void sgr(struct vt *vt, const unsigned *param, int params)
+{
+	int j;
+	unsigned p;
+
+	for (j = 0; j < params || !j; j++) {
+		p = params ? param[j] : 0;
+		if (!p) {
+			vt->fgrgba = DEFAULT_FGRGBA;
+			vt->bgrgba = DEFAULT_BGRGBA;
+		} else if (p >= 30 && p <= 37)
+			vt->fgrgba = vt->palette[p - 30];
+		else if (p >= 90 && p <= 97)
+			vt->fgrgba = vt->palette[p - 90 + 8];
+		else if (p == 38)
+			vt->fgrgba = sgr_color(vt, param, params, &j);
+		else if (p == 39)
+			vt->fgrgba = DEFAULT_FGRGBA;
+		else if (p >= 40 && p <= 47)
+			vt->bgrgba = vt->palette[p - 40];
+		else if (p >= 100 && p <= 107)
+			vt->bgrgba = vt->palette[p - 100 + 8];
+		else if (p == 48)
+			vt->bgrgba = sgr_color(vt, param, params, &j);
+		else if (p == 49)
+			vt->bgrgba = DEFAULT_BGRGBA;
+	}
+}
+
+/* Private modes: reports 1 if set, 2 if reset, 0 if unknown */
+static int mode(struct vt *vt, unsigned n, int set)
+{
+	Boolean_t *flag;
+
+	if (n == 69 && vt->features & VT_MARGINS)
+		flag = &vt->margins;
+	else if (n == 2026 && vt->features & VT_SYNC)
+		flag = &vt->synced;
+	else
+		return 0;
+	if (set >= 0)
+		*flag = set;
+	if (n == 69 && !vt->margins) {
+		vt->left = 0;
+		vt->right = vt->columns - 1;
+	}
+	return *flag ? 1 : 2;
+}
+
+static void command(struct vt *vt, int final)
+{
+	unsigned param[PARAMS], n;
+	int params = 0, j, lo, hi;
+	char private = 0, intermediate = 0, buf[32];
+	const char *p = vt->seq, *end = vt->seq + vt->seq_bytes;
+
+	if (p < end && *p >= '<' && *p <= '?')
+		private = *p++;
+	while (p < end && (*p >= '0' && *p <= '9' || *p == ';')) {
+		for (n = 0; p < end && *p >= '0' && *p <= '9'; p++)
+			n = n*10 + *p - '0';
+		if (params < PARAMS)
+			param[params++] = n;
+		if (p < end && *p == ';')
+			p++;
+	}
+	if (p < end)
+		intermediate = *p;
+	n = params && param[0] ? param[0] : 1;
+
+	if (private == '?') {
+		if (final == 'h' || final == 'l')
+			for (j = 0; j < params; j++)
+				mode(vt, param[j], final == 'h');
+		else if (final == 'p' && intermediate == '$' && params) {
+			sprintf(buf, "\x1b[?%u;%d$y", param[0],
+				mode(vt, param[0], -1));
+			reply(vt, buf);
+		}
+		return;
+	}
+	if (private || intermediate)
+		return;
+
+	switch (final) {
+	case 'H':
+	case 'f':
+		vt->row = clamp(n - 1, 0, vt->rows - 1);
+		vt->column = clamp(params > 1 && param[1] ? param[1] - 1 : 0,
+				   0, vt->columns - 1);
+		break;
+	case 'A':
+		vt->row = clamp(vt->row - (int) n,
+				vt->row >= vt->top ? vt->top : 0, vt->row);
+		break;
+	case 'B':
+		vt->row = clamp(vt->row + n, vt->row,
+				vt->row <= vt->bottom ? vt->bottom
+						      : vt->rows - 1);
+		break;
+	case 'C':
+		vt->column = clamp(vt->column + n, vt->column,
+				   inside(vt) ? right_edge(vt)
+					      : vt->columns - 1);
+		break;
+	case 'D':
+		vt->column = clamp(vt->column - (int) n,
+				   inside(vt) ? left_edge(vt) : 0,
+				   vt->column);
+		break;
+	case 'G':
+		vt->column = clamp(n - 1, 0, vt->columns - 1);
+		break;
+	case 'd':
+		vt->row = clamp(n - 1, 0, vt->rows - 1);
+		break;
+	case 'K':
+		n = params ? param[0] : 0;
+		lo = n ? 0 : vt->column;
+		hi = n == 1 ? vt->column : vt->columns - 1;
+		blank(vt, vt->row, lo, hi - lo + 1);
+		break;
+	case 'J':
+		n = params ? param[0] : 0;
+		if (n == 0) {
+			blank(vt, vt->row, vt->column,
+			      vt->columns - vt->column);
+			for (j = vt->row + 1; j < vt->rows; j++)
+				blank(vt, j, 0, vt->columns);
+		} else if (n == 1) {
+			for (j = 0; j < vt->row; j++)
+				blank(vt, j, 0, vt->columns);
+			blank(vt, vt->row, 0, vt->column + 1);
+		} else
+			for (j = 0; j < vt->rows; j++)
+				blank(vt, j, 0, vt->columns);
+		break;
+	case 'X':
+		blank(vt, vt->row, vt->column,
+		      clamp(n, 0, vt->columns - vt->column));
+		break;
+	case '@':
+	case 'P':
+		if (!inside(vt))
+			break;
+		hi = right_edge(vt) + 1;
+		n = clamp(n, 0, hi - vt->column);
+		lo = vt->row*vt->columns;
+		if (final == '@') {
+			memmove(&vt->cell[lo + vt->column + n],
+				&vt->cell[lo + vt->column],
+				(hi - vt->column - n) * sizeof *vt->cell);
+			blank(vt, vt->row, vt->column, n);
+		} else {
+			memmove(&vt->cell[lo + vt->column],
+				&vt->cell[lo + vt->column + n],
+				(hi - vt->column - n) * sizeof *vt->cell);
+			blank(vt, vt->row, hi - n, n);
+		}
+		break;
+	case 'L':
+	case 'M':
+		if (vt->row < vt->top || vt->row > vt->bottom || !inside(vt))
+			break;
+		scroll(vt, vt->row, vt->bottom,
+		       final == 'M' ? (int) n : -(int) n);
+		vt->column = left_edge(vt);
+		break;
+	case 'S':
+		scroll(vt, vt->top, vt->bottom, n);
+		break;
+	case 'T':
+		scroll(vt, vt->top, vt->bottom, -(int) n);
+		break;
+	case 'b':
+		if (!(vt->features & VT_REP) || !vt->last)
+			return;
+		while (n--)
+			print(vt, vt->last);
+		return;
+	case 'r':
+		lo = params && param[0] ? param[0] - 1 : 0;
+		hi = params > 1 && param[1] ? param[1] - 1 : vt->rows - 1;
+		if (lo >= hi || hi >= vt->rows)
+			return;
+		vt->top = lo;
+		vt->bottom = hi;
+		vt->row = vt->column = 0;
+		break;
+	case 's':
+		if (!vt->margins)
+			return;
+		lo = params && param[0] ? param[0] - 1 : 0;
+		hi = params > 1 && param[1] ? param[1] - 1 : vt->columns - 1;
+		if (lo >= hi || hi >= vt->columns)
+			return;
+		vt->left = lo;
+		vt->right = hi;
+		vt->row = vt->column = 0;
+		break;
+	case 'm':
+		sgr(vt, param, params);
+		return;
+	case 'n':
+		if (n == 6) {
+			sprintf(buf, "\x1b[%d;%dR", vt->row + 1,
+				vt->column + 1);
+			reply(vt, buf);
+		}
+		return;
+	default:
+		return;
+	}
+	vt->wrap = FALSE;
+}
+
+/* Operating system commands; only palette changes matter. */
+static void osc(struct vt *vt)
+{
+	unsigned idx, r, g, b;
+
+	vt->seq[vt->seq_bytes] = '\0';
+	if (sscanf(vt->seq, "4;%u;rgb:%x/%x/%x", &idx, &r, &g, &b) == 4 &&
+	    idx < 256)
+		vt->palette[idx] = (r & 0xff) << 24 | (g & 0xff) << 16 |
+				   (b & 0xff) << 8;
+}
+
+static void escape(struct vt *vt, int ch)
+{
+	vt->state = GROUND;
+	if (ch == '[' || ch == ']') {
+		vt->state = ch == '[' ? SEQUENCE : STRING;
+		vt->seq_bytes = 0;
+	} else if (ch >= ' ' && ch < '0')
+		vt->state = DESIGNATE;
+	else if (ch == 'c')
+		reset(vt);
+}
+
+void vt_write(struct vt *vt, const char *str, size_t bytes)
+{
+	int ch;
+
+	for (; bytes--; str++) {
+		ch = (Byte_t) *str;
+		switch (vt->state) {
+		case GROUND:
+			if (ch == '\x1b')
+				vt->state = ESCAPE;
+			else if (ch < ' ')
+				control(vt, ch);
+			else if (ch < 0x7f)
+				print(vt, ch);
+			else if (ch >= 0x80) {
+				if (vt->utf8_bytes && (ch & 0xc0) != 0x80 ||
+				    !vt->utf8_bytes && utf8_bytes[ch] < 2)
+					vt->utf8_bytes = 0;
+				vt->utf8[vt->utf8_bytes++] = ch;
+				if (vt->utf8_bytes ==
+				    utf8_bytes[(Byte_t) vt->utf8[0]]) {
+					print(vt, utf8_unicode(vt->utf8,
+							       vt->utf8_bytes));
+					vt->utf8_bytes = 0;
+				}
+			}
+			continue;
+		case ESCAPE:
+			escape(vt, ch);
+			continue;
+		case DESIGNATE:
+			vt->state = GROUND;
+			continue;
+		case SEQUENCE:
+			if (ch == '\x1b')
+				vt->state = ESCAPE;
+			else if (ch >= '@' && ch <= '~') {
+				vt->state = GROUND;
+				command(vt, ch);
+			} else if (vt->seq_bytes < sizeof vt->seq - 1)
+				vt->seq[vt->seq_bytes++] = ch;
+			continue;
+		case STRING:
+			if (ch == '\a') {
+				vt->state = GROUND;
+				osc(vt);
+			} else if (ch == '\x1b')
+				vt->state = STRING_ESCAPE;
+			else if (vt->seq_bytes < sizeof vt->seq - 1)
+				vt->seq[vt->seq_bytes++] = ch;
+			continue;
+		case STRING_ESCAPE:
+			osc(vt);
+			if (ch == '\\')
+				vt->state = GROUND;
+			else
+				escape(vt, ch);
+			continue;
+		}
+	}
+}
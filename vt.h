@@ -0,0 +1,26 @@
+/* Copyright 2007, 2008 Peter Klausler.  See COPYING for license. */
+#ifndef VT_H
+#define VT_H
+
+#include "rgba.h"
+
+/* What the emulated terminal supports beyond the basics */
+#define VT_REP		1	/* CSI b */
+#define VT_SYNC		2	/* mode 2026 */
+#define VT_MARGINS	4	/* mode 69 and DECSLRM */
+
+struct vt_cell {
+	Unicode_t unicode;
+	rgba_t fgrgba, bgrgba;
+};
+
+struct vt;
+
+struct vt *vt_create(int rows, int columns, unsigned features);
+void vt_destroy(struct vt *);
+void vt_write(struct vt *, const char *, size_t);
+size_t vt_replies(struct vt *, char *, size_t max);
+const struct vt_cell *vt_cell(struct vt *, int row, int column);
+void vt_cursor(struct vt *, int *row, int *column);
+
+#endif
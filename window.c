@@ -5,8 +5,26 @@
  *	A "window" is a presentation of a view on part or all of
  *	the display surface.  One window is active, meaning that
  *	it directs keyboard input to its view's command handler.
+ *
+ *	Edits don't touch the display.  They're recorded as damage,
+ *	in offsets of the view, and resolved the next time that the
+ *	window is painted: rows whose text has moved are scrolled,
+ *	and only those rows that are damaged, or that were painted
+ *	in another state of comments, strings, or brackets, are
+ *	painted again.  Motion of the cursor and mark damages just
+ *	where they were and are, and whatever has entered or left
+ *	the selection between them.
  */
 
+#define DAMAGES 8
+
+struct row {			/* as last painted */
+	position_t start;
+	size_t bytes;
+	size_t comment, string;	/* how much of it they cover */
+	unsigned brackets;
+};
+
 struct window {
 	struct view *view;
 	locus_t start;
@@ -16,8 +34,17 @@ struct window {
 	rgba_t fgrgba, bgrgba;
 	unsigned last_dirties;
 	Boolean_t repaint;
-	position_t last_cursor, last_mark;
+	position_t last_cursor, last_mark, last_start;
 	struct mode *last_mode;
+	unsigned last_matches;
+	unsigned last_tabstop, last_tabs;	/* TEXT_NO_TABS */
+	struct row *painted;
+	position_t *row_start;
+	position_t spaces_end, blanks_end;	/* runs being painted */
+	Boolean_t spaces_lame, blanks_trailing;
+	int painted_row, painted_column, painted_rows, painted_columns;
+	struct interval damage[DAMAGES];
+	unsigned damages, hints;
 	struct window *next;
 };
 
@@ -26,6 +53,7 @@ static struct window *active_window;
 static struct display *display;
 static int display_rows, display_columns;
 static Boolean_t titles = TRUE;
+unsigned max_latency = 50;
 
 static void title(struct window *window)
 {
@@ -45,8 +73,8 @@ static void title(struct window *window)
 	snprintf(buff, sizeof buff, "%s%s", view->name,
 		 view->text->flags & TEXT_CREATED ? " (new)" :
 		 view->text->flags & TEXT_RDONLY ? " (read-only)" :
-		 view->text->preserved !=
-		    view->text->dirties ? " (unsaved)" : "");
+		 view->text->preserved != view->text->dirties &&
+		    !text_hash_is_saved(view->text) ? " (unsaved)" : "");
 	cursor = locus_get(view, CURSOR);
 	if (cursor < 65536) {
 		int line = current_line_number(view, cursor);
@@ -88,6 +116,7 @@ static struct window *window_create(struct view *view, struct view *after)
 	window->rows = display_rows;
 	window->columns = display_columns;
 	window->last_dirties = ~0;
+	window->painted_rows = 0;
 	return window;
 }
 
@@ -174,6 +203,8 @@ void window_destroy(struct window *window)
 		locus_destroy(window->view, window->start);
 		window->view->window = NULL;
 	}
+	RELEASE(window->painted);
+	RELEASE(window->row_start);
 	if (window == active_window) {
 		active_window = NULL;
 		wp = window_list;
@@ -333,7 +364,6 @@ static void new_start(struct view *view, position_t start)
 	else
 		start = UNSET;
 	locus_set(view, view->window->start, start);
-	view->window->last_dirties = ~0;
 }
 
 static position_t screen_start(struct view *view)
@@ -346,6 +376,42 @@ static position_t screen_start(struct view *view)
 	return start;
 }
 
+/* Scrolls the rows of the window from "row" down by "lines", or up
+ * if it's negative, on the display and in the record of what was
+ * painted there.
+ */
+static void scroll_rows(struct window *window, int row, int lines)
+{
+	struct row *painted = window->painted + row;
+	int rows = window->rows - row, j;
+
+	if (lines > 0)
+		display_insert_lines(display, window->row + row,
+				     window->column, lines,
+				     rows, window->columns);
+	else
+		display_delete_lines(display, window->row + row,
+				     window->column, -lines,
+				     rows, window->columns);
+	if (!window->painted || window->painted_rows != window->rows)
+		return;
+	if (lines > 0) {
+		if (lines > rows)
+			lines = rows;
+		memmove(painted + lines, painted,
+			(rows - lines) * sizeof *painted);
+		for (j = 0; j < lines; j++)
+			painted[j].start = UNSET;
+	} else {
+		if ((lines = -lines) > rows)
+			lines = rows;
+		memmove(painted, painted + lines,
+			(rows - lines) * sizeof *painted);
+		for (j = rows - lines; j < rows; j++)
+			painted[j].start = UNSET;
+	}
+}
+
 static position_t focus(struct window *window)
 {
 	struct view *view = window->view;
@@ -364,16 +430,14 @@ static position_t focus(struct window *window)
 	    start == cursorrow + find_row_bytes(view, cursorrow,
 						0, window->columns)) {
 		start = cursorrow;
-		display_insert_lines(display, window->row, window->column,
-				     1, window->rows, window->columns);
+		scroll_rows(window, 0, 1);
 		goto done;
 	}
 	if (cursorrow >= start &&
 	    (above = count_rows(window, start, cursorrow)) == window->rows) {
 		start += find_row_bytes(view, start, 0, window->columns);
 		above--;
-		display_delete_lines(display, window->row, window->column,
-				     1, window->rows, window->columns);
+		scroll_rows(window, 0, -1);
 		goto done;
 	}
 
@@ -413,48 +477,80 @@ done:	window->cursor_column = find_column(&above, view, cursorrow,
 	return start;
 }
 
-static Boolean_t lame_space(struct view *view, position_t start,
-			    unsigned next_tab)
+/* Finds the end of the run of spaces, or of spaces and tabs, that
+ * starts at "offset", and whether only a tab or the end of the line
+ * follows it.  Painting asks about each space and tab in turn, so the
+ * answer is kept for the rest of the run rather than sought again.
+ */
+static position_t run_end(struct view *view, position_t offset,
+			  Boolean_t tabs, Boolean_t *lame)
 {
-	unsigned distance = 0;
-	position_t offset = start;
+	position_t next;
 	Unicode_t ch;
+
+	for (;
+	     IS_UNICODE(ch = view_char(view, offset, &next)) &&
+	     ch != '\n';
+	     offset = next)
+		if (ch != ' ' && (!tabs || ch != '\t')) {
+			*lame = ch == '\t';
+			return offset;
+		}
+	*lame = TRUE;
+	return offset;
+}
+
+static Boolean_t lame_space(struct window *window, position_t at,
+			    unsigned next_tab)
+{
+	struct view *view = window->view;
+
 	if (view->shell_std_in >= 0 || view->text->flags & TEXT_EDITOR)
 		return FALSE;
-	do {
-		distance++;
-		ch = view_char(view, offset, &offset);
-		if (!IS_UNICODE(ch) || ch == '\n' || ch == '\t')
-			return TRUE;
-	} while (ch == ' ');
-	return distance > next_tab &&
+	if (at >= window->spaces_end)
+		window->spaces_end = run_end(view, at, FALSE,
+					     &window->spaces_lame);
+	if (window->spaces_lame)
+		return TRUE;
+	return window->spaces_end - at > next_tab &&
 	       !(view->text->flags & TEXT_NO_TABS) &&
 	       (next_tab ||
-		view_char_prior(view, start-1, NULL) == ' ');
+		view_char_prior(view, at, NULL) == ' ');
 }
 
-static Boolean_t lame_tab(struct view *view, position_t offset)
+static Boolean_t lame_tab(struct window *window, position_t at)
 {
-	Unicode_t ch;
+	struct view *view = window->view;
+
 	if (view->shell_std_in >= 0 || view->text->flags & TEXT_EDITOR)
 		return FALSE;
 	if (view->text->flags & TEXT_NO_TABS)
 		return TRUE;
-	for (;
-	     IS_UNICODE(ch = view_char(view, offset, &offset)) &&
-	     ch != '\n'; )
-		if (ch != ' ' && ch != '\t')
-			return FALSE;
-	return TRUE;
+	if (at >= window->blanks_end)
+		window->blanks_end = run_end(view, at, TRUE,
+					     &window->blanks_trailing);
+	return window->blanks_trailing;
+}
+
+/* Counts a bracket; TRUE when it's one to be colored */
+static Boolean_t bracket(struct text *text, Unicode_t ch, unsigned *brackets)
+{
+	const char *brack = text->brackets;
+
+	if (brackets && brack)
+		for (; *brack; brack += 2)
+			if (ch == brack[0] && (*brackets)++ & 1 ||
+			    ch == brack[1] && --*brackets & 1)
+				return TRUE;
+	return FALSE;
 }
 
 static int paintch(struct window *window, Unicode_t ch, int row, int column,
 		   position_t at, position_t cursor, position_t mark,
-		   unsigned *brackets, rgba_t fgrgba)
+		   unsigned *brackets, rgba_t fgrgba, Boolean_t matched)
 {
 	rgba_t bgrgba = window->bgrgba;
 	unsigned tabstop = window->view->text->tabstop;
-	const char *brack = window->view->text->brackets;
 
 	if (ch == '\n')
 		return column;
@@ -474,10 +570,11 @@ static int paintch(struct window *window, Unicode_t ch, int row, int column,
 			rgba = DIRTY_RGBA;
 		if (!display_cursor_color(display, rgba))
 			fgrgba = rgba;
-	}
+	} else if (matched)
+		bgrgba = MATCH_BGRGBA;
 
 	if (ch == '\t') {
-		rgba_t bg = lame_tab(window->view, at+1) ?
+		rgba_t bg = lame_tab(window, at) ?
 				LAMESPACE_BGRGBA : bgrgba;
 		do {
 			display_put(display, window->row + row,
@@ -501,18 +598,12 @@ static int paintch(struct window *window, Unicode_t ch, int row, int column,
 			ch += '@';
 	} else if (ch == ' ') {
 		if (bgrgba == window->bgrgba &&
-		    lame_space(window->view, at + 1,
-			       tabstop-1 - column % tabstop))
+		    lame_space(window, at, tabstop-1 - column % tabstop))
 			bgrgba = LAMESPACE_BGRGBA;
 	} else if (!IS_UNICODE(ch))
 		ch = ' ', bgrgba = BADCHAR_BGRGBA;
-	else if (brackets && brack)
-		for (; *brack; brack += 2)
-			if (ch == brack[0] && (*brackets)++ & 1 ||
-			    ch == brack[1] && --*brackets & 1) {
-				fgrgba = BLUE_RGBA;
-				break;
-			}
+	else if (bracket(window->view->text, ch, brackets))
+		fgrgba = BLUE_RGBA;
 
 	display_put(display, window->row + row, window->column + column++,
 		    ch, fgrgba, bgrgba);
@@ -529,16 +620,163 @@ static Boolean_t needs_repainting(struct window *window)
 		view->text->dirties != window->last_dirties ||
 		window->last_cursor != cursor ||
 		window->last_mark != mark ||
-		window->last_mode != view->mode;
+		window->last_start != locus_get(view, window->start) ||
+		window->last_mode != view->mode ||
+		window->last_matches != text_matches_serial(view->text) ||
+		window->last_tabstop != view->text->tabstop ||
+		window->last_tabs != (view->text->flags & TEXT_NO_TABS);
 }
 
 static void repainted(struct window *window, position_t cursor, position_t mark)
 {
 	window->repaint = FALSE;
+	window->damages = window->hints = 0;
 	window->last_dirties = window->view->text->dirties;
 	window->last_cursor = cursor;
 	window->last_mark = mark;
+	window->last_start = locus_get(window->view, window->start);
 	window->last_mode = window->view->mode;
+	window->last_matches = text_matches_serial(window->view->text);
+	window->last_tabstop = window->view->text->tabstop;
+	window->last_tabs = window->view->text->flags & TEXT_NO_TABS;
+}
+
+/* Damage that overlaps the latest, or that doesn't fit, joins it. */
+static void damage(struct window *window, position_t from, position_t to)
+{
+	struct interval *last = window->damage + window->damages;
+
+	if (!window->damages ||
+	    window->damages < DAMAGES &&
+	    (from > last[-1].end || to < last[-1].start)) {
+		last->start = from;
+		last->end = to;
+		window->damages++;
+		return;
+	}
+	if (from < last[-1].start)
+		last[-1].start = from;
+	if (to > last[-1].end)
+		last[-1].end = to;
+}
+
+static Boolean_t damaged(struct window *window, position_t from,
+			 position_t to)
+{
+	unsigned j;
+
+	for (j = 0; j < window->damages; j++)
+		if (window->damage[j].start <= to &&
+		    window->damage[j].end >= from)
+			return TRUE;
+	return FALSE;
+}
+
+/* Only what has entered or left the selection needs painting. */
+static void selection(struct window *window, position_t cursor,
+		      position_t mark)
+{
+	position_t from = cursor, to = mark;
+	position_t old_from = window->last_cursor, old_to = window->last_mark;
+
+	if (mark != UNSET && mark < cursor)
+		from = mark, to = cursor;
+	if (old_to != UNSET && old_to < old_from)
+		old_from = old_to, old_to = window->last_cursor;
+	if (old_to == UNSET) {
+		if (mark != UNSET)
+			damage(window, from, to);
+	} else if (mark == UNSET)
+		damage(window, old_from, old_to);
+	else {
+		if (from != old_from)
+			damage(window, from < old_from ? from : old_from,
+			       from < old_from ? old_from : from);
+		if (to != old_to)
+			damage(window, to < old_to ? to : old_to,
+			       to < old_to ? old_to : to);
+	}
+}
+
+/* Lays out the window's rows anew from "start", scrolls rows whose
+ * text has moved since they were painted, and returns FALSE when
+ * every row has to be painted again.
+ */
+static Boolean_t resolve(struct window *window, position_t start,
+			 position_t cursor, position_t mark)
+{
+	struct view *view = window->view;
+	struct row *painted;
+	int row, rows = window->rows, k;
+	unsigned j;
+	Boolean_t partial =
+		!window->repaint &&
+		window->painted_rows == rows &&
+		window->painted_columns == window->columns &&
+		window->painted_row == window->row &&
+		window->painted_column == window->column &&
+		window->last_mode == view->mode &&
+		window->last_matches == text_matches_serial(view->text) &&
+		window->last_tabstop == view->text->tabstop &&
+		window->last_tabs == (view->text->flags & TEXT_NO_TABS) &&
+		view->text->dirties - window->last_dirties == window->hints;
+
+	if (window->painted_rows != rows) {
+		RELEASE(window->painted);
+		RELEASE(window->row_start);
+		window->painted = allocate(rows * sizeof *window->painted);
+		window->row_start = allocate((rows + 1) *
+					     sizeof *window->row_start);
+		window->painted_rows = rows;
+	}
+	window->painted_columns = window->columns;
+	window->painted_row = window->row;
+	window->painted_column = window->column;
+
+	for (row = 0; row < rows; row++, start += find_row_bytes(view, start,
+						0, window->columns))
+		window->row_start[row] = start;
+	window->row_start[rows] = start;
+	if (!partial)
+		return FALSE;
+
+	/* A row's colors depend on the rest of its line. */
+	for (j = 0; j < window->damages; j++) {
+		struct interval *x = &window->damage[j];
+		x->start = find_line_start(view, x->start);
+		x->end = find_line_end(view, x->end);
+	}
+	damage(window, window->last_cursor, window->last_cursor);
+	damage(window, cursor, cursor);
+	selection(window, cursor, mark);
+
+	painted = window->painted;
+	for (row = 0; row < rows; row++)
+		if (painted[row].start != window->row_start[row])
+			break;
+	for (k = 1; row + k < rows; k++) {
+		if (painted[row].bytes &&
+		    painted[row].start == window->row_start[row+k]) {
+			scroll_rows(window, row, k);
+			break;
+		}
+		if (painted[row+k].bytes &&
+		    painted[row+k].start == window->row_start[row]) {
+			scroll_rows(window, row, -k);
+			break;
+		}
+	}
+	return TRUE;
+}
+
+/* How much of [at,limit) lies in a comment or string ending at "end" */
+static size_t within(sposition_t end, position_t at, position_t limit)
+{
+	if (end < (sposition_t) at)
+		return 0;
+	if (end < (sposition_t) limit)
+		return end + 1 - at;
+	return limit + 1 - at;
 }
 
 static void paint(struct window *window)
@@ -554,10 +792,13 @@ static void paint(struct window *window)
 	Boolean_t keywords = !no_keywords &&
 			     window == active_window &&
 			     view->text->keywords;
+	Boolean_t partial;
 
 	title(window);
 
 	at = focus(window);
+	partial = resolve(window, at, cursor, mark);
+	window->spaces_end = window->blanks_end = 0;
 	if (keywords && view->text->comment_start) {
 		sposition_t start = view->text->comment_start(view, at);
 		if (start >= 0)
@@ -566,17 +807,46 @@ static void paint(struct window *window)
 
 	for (row = 0; row < window->rows; row++) {
 
-		position_t limit = at + find_row_bytes(view, at, 0,
-						       window->columns);
+		position_t limit = window->row_start[row+1];
 		rgba_t fgrgba = window->fgrgba;
 		Boolean_t look_for_keyword = keywords;
-		position_t next;
+		position_t next, matched_end = 0;
 		unsigned *brackets_ptr = &brackets;
+		unsigned matches = 0;
+		const struct interval *match = NULL;
+		struct row *painted = &window->painted[row];
+		Boolean_t skip = partial &&
+				 painted->start == at &&
+				 painted->bytes == limit - at &&
+				 painted->comment ==
+					within(comment_end, at, limit) &&
+				 painted->string ==
+					within(string_end, at, limit) &&
+				 painted->brackets == brackets &&
+				 !damaged(window, at, limit);
+
+		painted->start = at;
+		painted->bytes = limit - at;
+		painted->comment = within(comment_end, at, limit);
+		painted->string = within(string_end, at, limit);
+		painted->brackets = brackets;
+		if (skip && !keywords && !view->text->brackets) {
+			at = limit;
+			continue;
+		}
+		if (!skip)
+			match = text_matches(view->text, view->start + at,
+					     view->start + limit, &matches);
 
 		for (column = 0; at < limit; at = next) {
 
 			Unicode_t ch = view_char(view, at, &next);
 
+			for (; matches && match->start <= view->start + at;
+			     match++, matches--)
+				if (match->end > matched_end)
+					matched_end = match->end;
+
 			if ((ch == '/' || ch == '-' || ch == '{') &&
 			    at > comment_end &&
 			    at > string_end &&
@@ -599,14 +869,22 @@ static void paint(struct window *window)
 			} else if (!is_idch(ch) && ch != '#') {
 				fgrgba = window->fgrgba;
 				look_for_keyword = keywords;
-			} else if (look_for_keyword && is_keyword(view, at))
+			} else if (skip)
+				;
+			else if (look_for_keyword && is_keyword(view, at))
 				fgrgba = KEYWORD_FGRGBA;
 			else
 				look_for_keyword = FALSE;
 
-			column = paintch(window, ch, row, column, at,
-					 cursor, mark, brackets_ptr,
-					 fgrgba);
+			/* Skipped rows are only scanned for brackets. */
+			if (!skip)
+				column = paintch(window, ch, row, column, at,
+						 cursor, mark, brackets_ptr,
+						 fgrgba,
+						 view->start + at < matched_end);
+			else if (ch > ' ' && ch != 0x7f &&
+				 IS_UNICODE(ch) && !IS_FOLDED(ch))
+				bracket(view->text, ch, brackets_ptr);
 
 			if (at == comment_end || at == string_end) {
 				fgrgba = window->fgrgba;
@@ -614,6 +892,8 @@ static void paint(struct window *window)
 				look_for_keyword = keywords;
 			}
 		}
+		if (skip)
+			continue;
 
 		display_erase(display, window->row + row,
 			      window->column + column,
@@ -627,90 +907,49 @@ static void paint(struct window *window)
 	repainted(window, cursor, mark);
 }
 
-void window_hint_deleting(struct window *window, position_t offset,
-			  size_t bytes)
+/* Moves what's been recorded in offsets of the view past an edit
+ * of "delta" bytes at "offset"; positions within deleted bytes end
+ * up at the deletion.
+ */
+static void adjust(position_t *at, position_t offset, ssize_t delta)
 {
-	struct view *view = window->view;
-	position_t at = screen_start(view);
-	unsigned row = 0, column;
-	unsigned lines = 0, end_column;
-
-	if (focus(window) != at || offset + bytes <= at)
-		return;
-	if (offset < at) {
-		bytes -= at - offset;
-		offset = at;
-	}
-	if (!bytes || view_char(view, offset, NULL) >= FOLD_START)
+	if (*at == UNSET || *at < offset)
 		return;
-	column = find_column(&row, view, at, offset, 0);
-	if (row >= window->rows)
-		return;
-	end_column = find_column(&lines, view, offset,
-				 offset + bytes, column);
-	if (!lines) {
-		unsigned old = find_row_bytes(view, offset,
-					      column, window->columns);
-		unsigned new = find_row_bytes(view, offset + bytes,
-					      end_column, window->columns);
-		if (new + bytes == old) {
-			display_delete_chars(display, window->row + row,
-					     window->column + column,
-					     end_column - column,
-					     window->columns - column);
-			return;
-		}
-		lines++;
-	}
-	if (row + lines >= window->rows) {
-		lines = window->rows - row;
-		end_column = 0;
+	if (delta < 0 && *at < offset - delta)
+		*at = offset;
+	else
+		*at += delta;
+}
+
+static void edited(struct window *window, position_t offset, ssize_t delta)
+{
+	unsigned j;
+	int row;
+
+	if (window->painted)
+		for (row = 0; row < window->painted_rows; row++)
+			adjust(&window->painted[row].start, offset, delta);
+	for (j = 0; j < window->damages; j++) {
+		adjust(&window->damage[j].start, offset, delta);
+		adjust(&window->damage[j].end, offset, delta);
 	}
-	display_delete_lines(display, window->row + row, window->column,
-			     lines, window->rows - row, window->columns);
+	adjust(&window->last_cursor, offset, delta);
+	adjust(&window->last_mark, offset, delta);
+	window->hints++;
 }
 
-void window_hint_inserted(struct window *window, position_t offset,
+void window_hint_deleting(struct window *window, position_t offset,
 			  size_t bytes)
 {
-	struct view *view = window->view;
-	position_t at = screen_start(view);
-	position_t column, end_column;
-	unsigned row = 0, lines = 0;
+	edited(window, offset, -bytes);
+	damage(window, offset, offset);
+}
 
-	if (focus(window) != at || offset + bytes <= at)
-		return;
-	if (offset < at) {
-		bytes -= at - offset;
-		offset = at;
-	}
-	if (!bytes || view_char(view, offset, NULL) >= FOLD_START)
-		return;
-	column = find_column(&row, view, at, offset, 0);
-	if (row >= window->rows)
-		return;
-	end_column = find_column(&lines, view, offset,
-				 offset + bytes, column);
-	if (!lines) {
-		size_t old = find_row_bytes(view, offset + bytes,
-					    end_column, window->columns);
-		size_t new = find_row_bytes(view, offset,
-					    column, window->columns);
-		if (new == old + bytes) {
-			display_insert_spaces(display, window->row + row,
-					      window->column + column,
-					      end_column - column,
-					      window->columns - column);
-			return;
-		}
-		lines++;
-	}
-	if (row + lines >= window->rows) {
-		lines = window->rows - row;
-		end_column = 0;
-	}
-	display_insert_lines(display, window->row + row, window->column,
-			     lines, window->rows - row, window->columns);
+void window_hint_inserted(struct window *window, position_t offset,
+			  size_t bytes)
+{
+	edited(window, offset, bytes);
+	damage(window, offset, offset + bytes);
 }
 
 void window_next(struct view *view)
@@ -799,9 +1038,7 @@ void window_page_up(struct view *view)
 			if (!(bytes = find_row_bytes(view, start, 0,
 						     window->columns)))
 				break;
-		display_insert_lines(display, window->row, window->column,
-				     window->rows - overlap,
-				     window->rows, window->columns);
+		scroll_rows(window, 0, window->rows - overlap);
 	}
 	locus_set(view, CURSOR, start);
 }
@@ -817,9 +1054,7 @@ void window_page_down(struct view *view)
 	for (row = 0; row + overlap < window->rows; row++, start += bytes)
 		if (!(bytes = find_row_bytes(view, start, 0, window->columns)))
 			break;
-	display_delete_lines(display, window->row, window->column,
-			     window->rows - overlap,
-			     window->rows, window->columns);
+	scroll_rows(window, 0, overlap - window->rows);
 	new_start(view, start);
 	locus_set(view, CURSOR, start);
 }
@@ -887,20 +1122,47 @@ static void repaint(void)
 		       active_window->column + active_window->cursor_column);
 }
 
+/* Commands that are already waiting are read and applied before
+ * the windows are repainted, so that typeahead, key repeat, and
+ * pastes are shown once they've all been handled -- or after
+ * max_latency milliseconds, so that the display doesn't seem frozen.
+ */
+static Boolean_t overdue(struct timeval *painted)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - painted->tv_sec) * 1000 +
+	       (now.tv_usec - painted->tv_usec) / 1000 >= max_latency;
+}
+
 Unicode_t window_getch(void)
 {
+	static struct timeval painted;
 	Boolean_t block = FALSE;
 	for (;;) {
 		Unicode_t ch = display_getch(display, block);
 		if (ch == ERROR_CHANGED)
 			window_raise(window_current_view());
-		else if (ch != ERROR_EMPTY)
+		else if (ch != ERROR_EMPTY) {
+			if (!block && overdue(&painted)) {
+				repaint();
+				display_sync(display);
+				gettimeofday(&painted, NULL);
+			}
 			return ch;
+		}
 		repaint();
+		gettimeofday(&painted, NULL);
 		block = TRUE;
 	}
 }
 
+char *window_paste(size_t *bytes)
+{
+	return display_paste(display, bytes);
+}
+
 unsigned window_columns(struct window *window)
 {
 	return window ? window->columns : 80;
@@ -19,6 +19,8 @@ void window_page_up(struct view *);
 void window_page_down(struct view *);
 void window_beep(struct view *);
 Unicode_t window_getch(void);
+char *window_paste(size_t *bytes);
+extern unsigned max_latency; /* -l 50, in milliseconds */
 struct view *window_current_view(void);
 unsigned window_columns(struct window *);
 void windows_end(void);